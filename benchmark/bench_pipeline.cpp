@@ -0,0 +1,198 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+// Runs BMInferencePipe with MockDetectorDelegate on a plain Linux box and reports throughput and
+// end-to-end latency (push_frame to detected callback). Streams are fed by one thread, like a demux
+// loop, each at fps frames per second; frames pushed during the first second are left out of the
+// latency figures. With the stage costs set to 0 it measures the overhead of the pipe, the worker
+// pools and the queues alone.
+//
+// With replicas > 1 the forward runs on that many model instances, each a mock device of its own,
+// the i-th being slow[i] percent as fast as the first (comma separated, the last value repeats);
+// replica_fail_after/replica_fail_num make the last replica fail for a while to show the failover
+// and its return after cooldown_ms.
+//
+// usage: bench_pipeline [key=value ...]
+//   streams=8 fps=25 seconds=10 queue_type=0 queue_size=32 batch=4 batch_delay_us=2000
+//   pre_threads=4 infer_threads=1 post_threads=2 inflight=0 inflight_batches=1 work_stealing=0
+//   pre_us=1000 fwd_us=5000 fwd_frame_us=500 fwd_host_us=0 post_us=500 busy=0 thread_sync=1
+//   replicas=1 speed=100,50 balance=0 replica_fail_after=-1 replica_fail_num=-1 cooldown_ms=1000
+//   trace=<file> trace_sample=16   writes a Chrome trace of one frame in trace_sample
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include "bmutility_mock_delegate.h"
+
+struct BenchFrame {
+    int64_t seq;
+    int64_t push_us;
+};
+
+static int64_t arg_int(std::map<std::string, std::string> &args, const std::string &key, int64_t def) {
+    auto it = args.find(key);
+    return it != args.end() ? atoll(it->second.c_str()) : def;
+}
+
+// i-th value of a comma separated list, the last one repeating
+static int64_t list_int(std::map<std::string, std::string> &args, const std::string &key, size_t i, int64_t def) {
+    auto it = args.find(key);
+    if (it == args.end()) return def;
+    const char *p = it->second.c_str();
+    for (size_t k = 0; k < i && strchr(p, ',') != nullptr; k++) p = strchr(p, ',') + 1;
+    return atoll(p);
+}
+
+static int64_t percentile(const std::vector<int64_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = (size_t) (p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+int main(int argc, char *argv[]) {
+    std::map<std::string, std::string> args;
+    for (int i = 1; i < argc; i++) {
+        const char *eq = strchr(argv[i], '=');
+        if (eq == nullptr) {
+            std::cerr << "[ERROR] bench_pipeline: expected key=value, got " << argv[i] << std::endl;
+            return 1;
+        }
+        args[std::string(argv[i], eq - argv[i])] = eq + 1;
+    }
+
+    int streams = arg_int(args, "streams", 8);
+    int fps = arg_int(args, "fps", 25);
+    int seconds = arg_int(args, "seconds", 10);
+
+    bm::DetectorParam param;
+    int queue_type = arg_int(args, "queue_type", BLOCKING_QUEUE_STD_QUEUE);
+    int queue_size = arg_int(args, "queue_size", 32);
+    int64_t batch_delay_us = arg_int(args, "batch_delay_us", 2000);
+    int work_stealing = arg_int(args, "work_stealing", 0);
+    param.batch_num = arg_int(args, "batch", 4);
+    param.preprocess_thread_num = arg_int(args, "pre_threads", 4);
+    param.inference_thread_num = arg_int(args, "infer_threads", 1);
+    param.postprocess_thread_num = arg_int(args, "post_threads", 2);
+    param.max_inflight_frames = arg_int(args, "inflight", 0);
+    param.inference_inflight_batches = arg_int(args, "inflight_batches", 1);
+    param.preprocess_queue_type = param.inference_queue_type = param.postprocess_queue_type = queue_type;
+    param.preprocess_queue_size = param.inference_queue_size = param.postprocess_queue_size = queue_size;
+    param.preprocess_batch_delay_us = param.inference_batch_delay_us = batch_delay_us;
+    param.preprocess_work_stealing = param.postprocess_work_stealing = work_stealing;
+
+    bm::MockDelegateParam cost;
+    cost.preprocess_frame_us = arg_int(args, "pre_us", 1000);
+    cost.forward_us = arg_int(args, "fwd_us", 5000);
+    cost.forward_frame_us = arg_int(args, "fwd_frame_us", 500);
+    cost.forward_host_us = arg_int(args, "fwd_host_us", 0);
+    cost.postprocess_frame_us = arg_int(args, "post_us", 500);
+    cost.busy_wait = arg_int(args, "busy", 0) != 0;
+    cost.thread_sync = arg_int(args, "thread_sync", 1) != 0;
+
+    int64_t total = (int64_t) streams * fps * seconds;
+    int64_t warmup = (int64_t) streams * fps;
+    if (total <= warmup) {
+        std::cerr << "[ERROR] bench_pipeline: run for more than one second" << std::endl;
+        return 1;
+    }
+    // latency of frame seq, -1 until it is done
+    std::vector<int64_t> latency(total, -1);
+
+    auto delegate = std::make_shared<bm::MockDetectorDelegate<BenchFrame>>(cost);
+    delegate->set_detected_callback([&latency](BenchFrame &frame) {
+        latency[frame.seq] = blocking_queue_now_us() - frame.push_us;
+    });
+    bm::BMInferencePipe<BenchFrame> pipe;
+    // all frames come from the feeding loop below
+    pipe.set_single_producer(true);
+    int replicas = arg_int(args, "replicas", 1);
+    std::vector<std::shared_ptr<bm::MockDetectorDelegate<BenchFrame>>> devices(1, delegate);
+    for (int i = 1; i < replicas; i++) {
+        bm::MockDelegateParam rcost = cost;
+        int64_t speed = std::max<int64_t>(list_int(args, "speed", i - 1, 100), 1);
+        rcost.forward_us = cost.forward_us * 100 / speed;
+        rcost.forward_frame_us = cost.forward_frame_us * 100 / speed;
+        if (i == replicas - 1) {
+            rcost.forward_fail_after = arg_int(args, "replica_fail_after", -1);
+            rcost.forward_fail_num = arg_int(args, "replica_fail_num", -1);
+        }
+        devices.push_back(std::make_shared<bm::MockDetectorDelegate<BenchFrame>>(rcost));
+        pipe.add_forward_replica(devices.back());
+    }
+    pipe.set_replica_balance(arg_int(args, "balance", bm::REPLICA_BALANCE_LEAST_OUTSTANDING));
+    pipe.set_replica_cooldown(arg_int(args, "cooldown_ms", 1000));
+    std::string trace_path = args.count("trace") ? args["trace"] : "";
+    std::unique_ptr<bm::Tracer> tracer;
+    if (!trace_path.empty()) {
+        tracer.reset(new bm::Tracer(1 << 20, arg_int(args, "trace_sample", 16)));
+        pipe.set_tracer(tracer.get(), [](const BenchFrame &frame) { return (uint64_t) frame.seq; });
+    }
+    if (pipe.init(param, delegate) != 0) {
+        std::cerr << "[ERROR] bench_pipeline: init failed" << std::endl;
+        return 1;
+    }
+
+    // frames of all streams interleaved at streams * fps per second; a frame the pipe is too busy
+    // to take within one frame interval is skipped, like a decoder dropping it
+    int64_t interval_ns = 1000000000LL / ((int64_t) streams * fps);
+    long wait_ms = std::max<long>(1, 1000 / fps);
+    int64_t busy_num = 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    int64_t t0 = blocking_queue_now_us();
+    for (int64_t seq = 0; seq < total; seq++) {
+        BenchFrame frame;
+        frame.seq = seq;
+        frame.push_us = blocking_queue_now_us();
+        if (pipe.push_frame(&frame, wait_ms) != 0) busy_num++;
+
+        next.tv_nsec += interval_ns;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+    }
+    double feed = (blocking_queue_now_us() - t0) / 1e6;
+    pipe.drain();
+    double elapsed = (blocking_queue_now_us() - t0) / 1e6;
+    uint64_t busy_us = delegate->device_busy_us();
+    std::vector<bm::ReplicaStats> replica_stats = pipe.replica_stats();
+    pipe.stop();
+
+    std::vector<int64_t> sorted;
+    sorted.reserve(total - warmup);
+    for (int64_t seq = warmup; seq < total; seq++) {
+        if (latency[seq] >= 0) sorted.push_back(latency[seq]);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    uint64_t done = pipe.completed_frames();
+    printf("streams=%d fps=%d seconds=%d queue_type=%d queue_size=%d batch=%d threads=%d/%d/%d inflight=%d "
+           "inflight_batches=%d busy=%d\n", streams, fps, seconds, queue_type, queue_size, param.batch_num,
+           param.preprocess_thread_num, param.inference_thread_num, param.postprocess_thread_num,
+           param.max_inflight_frames, param.inference_inflight_batches, (int) cost.busy_wait);
+    printf("offered %.1f fps, done %.1f fps, skipped %ld of %ld frames, device busy %.1f%%\n",
+           total / feed, done / elapsed, (long) busy_num, (long) total, 100.0 * busy_us / (elapsed * 1e6));
+    printf("latency us: p50 %ld p90 %ld p99 %ld p99.9 %ld max %ld\n", (long) percentile(sorted, 50),
+           (long) percentile(sorted, 90), (long) percentile(sorted, 99), (long) percentile(sorted, 99.9),
+           (long) (sorted.empty() ? 0 : sorted.back()));
+    for (size_t i = 0; replicas > 1 && i < replica_stats.size(); i++) {
+        const bm::ReplicaStats &rs = replica_stats[i];
+        printf("replica %zu: %lu frames in %lu batches, %lu errors, %ld us per frame, device busy %.1f%%%s\n", i,
+               (unsigned long) rs.frame_num, (unsigned long) rs.batch_num, (unsigned long) rs.error_num,
+               (long) rs.frame_us, 100.0 * devices[i]->device_busy_us() / (elapsed * 1e6),
+               rs.healthy ? "" : ", out of rotation");
+    }
+    if (tracer && tracer->dump(trace_path) != 0) return 1;
+    return 0;
+}
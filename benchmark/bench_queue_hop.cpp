@@ -0,0 +1,106 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+// Cost of one hop between two pipeline stages for every BlockingQueueType: one producer thread
+// pushes items to one consumer thread. "stream" is the time per item while the producer keeps the
+// queue busy (push one by one, pop up to batch), "ping-pong" half the round trip of a single item
+// bounced between two queues, i.e. the latency of a hop to a waiting consumer. "local" pushes and
+// pops batches on one thread: the cost of the queue operations alone, without the cache line
+// transfers and wake-ups between cores, or the context switches on a single core, a real hop adds.
+//
+// usage: bench_queue_hop [items=2000000] [batch=8] [rounds=100000] [wait_profile=1]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include "bmutility_thread_queue.h"
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double stream_ns(int type, int item_num, int batch, int profile) {
+    auto que = create_work_queue<int64_t>("hop", type, 1024, 1 << 30);
+    que->set_wait_profile(profile);
+    std::thread consumer([&] {
+        std::vector<int64_t> items;
+        items.reserve(batch);
+        int64_t num = 0;
+        while (num < item_num) {
+            items.clear();
+            que->pop_front(items, 1, batch);
+            num += items.size();
+        }
+    });
+    int64_t t0 = now_us();
+    for (int64_t i = 0; i < item_num; i++) que->push(i);
+    consumer.join();
+    return (now_us() - t0) * 1000.0 / item_num;
+}
+
+static double local_ns(int type, int item_num, int batch) {
+    auto que = create_work_queue<int64_t>("local", type, 1024, 1 << 30);
+    std::vector<int64_t> items;
+    items.reserve(batch);
+    int64_t t0 = now_us();
+    for (int64_t i = 0; i < item_num; i += batch) {
+        for (int k = 0; k < batch; k++) {
+            int64_t v = i + k;
+            que->push(v);
+        }
+        items.clear();
+        que->pop_front(items, 1, batch);
+    }
+    return (now_us() - t0) * 1000.0 / item_num;
+}
+
+static double ping_pong_ns(int type, int rounds, int profile) {
+    auto ping = create_work_queue<int64_t>("ping", type, 1024, 1 << 30);
+    auto pong = create_work_queue<int64_t>("pong", type, 1024, 1 << 30);
+    ping->set_wait_profile(profile);
+    pong->set_wait_profile(profile);
+    std::thread echo([&] {
+        std::vector<int64_t> items;
+        for (int i = 0; i < rounds; i++) {
+            items.clear();
+            ping->pop_front(items, 1, 1);
+            pong->push(items);
+        }
+    });
+    std::vector<int64_t> items;
+    int64_t t0 = now_us();
+    for (int64_t i = 0; i < rounds; i++) {
+        ping->push(i);
+        items.clear();
+        pong->pop_front(items, 1, 1);
+    }
+    echo.join();
+    return (now_us() - t0) * 1000.0 / rounds / 2;
+}
+
+int main(int argc, char *argv[]) {
+    int item_num = argc > 1 ? atoi(argv[1]) : 2000000;
+    int batch = argc > 2 ? atoi(argv[2]) : 8;
+    int rounds = argc > 3 ? atoi(argv[3]) : 100000;
+    int profile = argc > 4 ? atoi(argv[4]) : WAIT_PROFILE_LOW_LATENCY;
+
+    const char *names[] = {"std_queue", "vector", "ring", "spsc"};
+    printf("items=%d batch=%d rounds=%d wait_profile=%d cpus=%u\n", item_num, batch, rounds, profile,
+           std::thread::hardware_concurrency());
+    printf("queue\tlocal(ns/item)\tstream(ns/item)\tping-pong(ns/hop)\n");
+    for (int type : {BLOCKING_QUEUE_STD_QUEUE, BLOCKING_QUEUE_VECTOR, BLOCKING_QUEUE_RING, BLOCKING_QUEUE_SPSC}) {
+        double local = local_ns(type, item_num, batch);
+        double stream = stream_ns(type, item_num, batch, profile);
+        double hop = ping_pong_ns(type, rounds, profile);
+        printf("%s\t%.1f\t%.1f\t%.1f\n", names[type], local, stream, hop);
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+// Compares WorkerPool throughput with a single shared queue against work-stealing mode.
+// Item cost is uneven (like postprocess time depending on box count).
+//
+// usage: bench_worker_pool [items=200000] [queue_type=0] [steal_chunk=4] [max_pop=1]
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <cstdlib>
+#include "bmutility_thread_queue.h"
+
+static void busy_work(int units) {
+    volatile uint64_t x = 0;
+    for (int i = 0; i < units; ++i) x += i * 2654435761u;
+}
+
+static double run_once(int thread_num, int queue_type, int steal_chunk, int max_pop, int item_num,
+                       const std::vector<int> &costs) {
+    auto que = create_work_queue<int>("bench", queue_type, 1024, 1 << 30);
+    std::atomic<int> done(0);
+    WorkerPool<int> pool;
+    pool.init(que.get(), thread_num, 1, max_pop);
+    pool.setWorkStealing(steal_chunk);
+    pool.startWork([&](std::vector<int> &items) {
+        for (int cost : items) busy_work(cost);
+        done.fetch_add(items.size(), std::memory_order_relaxed);
+    });
+
+    const int producer_num = 2;
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producer_num; ++p) {
+        producers.emplace_back([&, p] {
+            for (int i = p; i < item_num; i += producer_num) {
+                int cost = costs[i];
+                que->push(cost);
+            }
+        });
+    }
+    for (auto &th : producers) th.join();
+    while (done.load(std::memory_order_relaxed) < item_num) std::this_thread::yield();
+    auto t1 = std::chrono::steady_clock::now();
+    pool.stopWork();
+
+    double sec = std::chrono::duration<double>(t1 - t0).count();
+    return item_num / sec;
+}
+
+int main(int argc, char *argv[]) {
+    int item_num = argc > 1 ? atoi(argv[1]) : 200000;
+    int queue_type = argc > 2 ? atoi(argv[2]) : BLOCKING_QUEUE_STD_QUEUE;
+    int steal_chunk = argc > 3 ? atoi(argv[3]) : 4;
+    int max_pop = argc > 4 ? atoi(argv[4]) : 1;
+
+    // 80% cheap items, 20% expensive ones
+    std::mt19937 rng(1234);
+    std::vector<int> costs(item_num);
+    for (auto &c : costs) c = (rng() % 5 == 0) ? 2000 + rng() % 8000 : 50 + rng() % 200;
+
+    std::cout << "items=" << item_num << " queue_type=" << queue_type << " steal_chunk=" << steal_chunk
+              << " max_pop=" << max_pop << std::endl;
+    std::cout << "threads\tshared(items/s)\tstealing(items/s)\tspeedup" << std::endl;
+    for (int thread_num : {1, 2, 4, 8, 12, 16}) {
+        double shared = run_once(thread_num, queue_type, 0, max_pop, item_num, costs);
+        double stealing = run_once(thread_num, queue_type, steal_chunk, max_pop, item_num, costs);
+        std::cout << thread_num << "\t" << (int64_t)shared << "\t" << (int64_t)stealing << "\t"
+                  << stealing / shared << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#include "bmutility_affinity.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+namespace bm {
+    static bool read_sys_line(const std::string &path, std::string &line) {
+        std::ifstream ifs(path);
+        if (!ifs.is_open()) return false;
+        std::getline(ifs, line);
+        return true;
+    }
+
+    static int read_sys_int(const std::string &path, int defval) {
+        std::string line;
+        if (!read_sys_line(path, line) || line.empty()) return defval;
+        return atoi(line.c_str());
+    }
+
+    int parse_cpu_list(const std::string &str, std::vector<int> &cpus) {
+        cpus.clear();
+        size_t pos = 0;
+        while (pos < str.size()) {
+            size_t end = str.find(',', pos);
+            if (end == std::string::npos) end = str.size();
+            std::string item = str.substr(pos, end - pos);
+            pos = end + 1;
+            item.erase(std::remove_if(item.begin(), item.end(), ::isspace), item.end());
+            if (item.empty()) continue;
+
+            char *p = nullptr;
+            long first = strtol(item.c_str(), &p, 10);
+            long last = first;
+            if (*p == '-') last = strtol(p + 1, &p, 10);
+            if (*p != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+            for (long c = first; c <= last; c++) cpus.push_back((int) c);
+        }
+        return 0;
+    }
+
+    static void allowed_cpus(std::vector<int> &cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        cpus.clear();
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+            int num = sysconf(_SC_NPROCESSORS_ONLN);
+            for (int c = 0; c < num; c++) cpus.push_back(c);
+            return;
+        }
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) cpus.push_back(c);
+        }
+    }
+
+    int numa_node_cpus(std::vector<std::vector<int>> &nodes) {
+        std::vector<int> allowed;
+        allowed_cpus(allowed);
+        nodes.clear();
+
+        DIR *dir = opendir("/sys/devices/system/node");
+        if (dir != nullptr) {
+            std::vector<int> ids;
+            struct dirent *ent;
+            while ((ent = readdir(dir)) != nullptr) {
+                if (strncmp(ent->d_name, "node", 4) == 0 && isdigit(ent->d_name[4])) {
+                    ids.push_back(atoi(ent->d_name + 4));
+                }
+            }
+            closedir(dir);
+            std::sort(ids.begin(), ids.end());
+
+            for (int id : ids) {
+                std::string line;
+                std::vector<int> cpus, usable;
+                if (!read_sys_line("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist", line) ||
+                    parse_cpu_list(line, cpus) != 0) {
+                    continue;
+                }
+                for (int c : cpus) {
+                    if (std::find(allowed.begin(), allowed.end(), c) != allowed.end()) usable.push_back(c);
+                }
+                if (nodes.size() <= (size_t) id) nodes.resize(id + 1);
+                nodes[id] = usable;
+            }
+        }
+
+        if (nodes.empty()) {
+            nodes.push_back(allowed);
+        }
+        return nodes.empty() || allowed.empty() ? -1 : 0;
+    }
+
+    int cpu_numa_node(int cpu) {
+        std::vector<std::vector<int>> nodes;
+        numa_node_cpus(nodes);
+        for (size_t n = 0; n < nodes.size(); n++) {
+            if (std::find(nodes[n].begin(), nodes[n].end(), cpu) != nodes[n].end()) return n;
+        }
+        return -1;
+    }
+
+    // SMT siblings next to each other: (package, core, cpu) order
+    static void sort_by_core(std::vector<int> &cpus) {
+        struct Key { int package, core, cpu; };
+        std::vector<Key> keys;
+        for (int c : cpus) {
+            std::string topo = "/sys/devices/system/cpu/cpu" + std::to_string(c) + "/topology/";
+            keys.push_back(Key{read_sys_int(topo + "physical_package_id", 0), read_sys_int(topo + "core_id", c), c});
+        }
+        std::sort(keys.begin(), keys.end(), [](const Key &a, const Key &b) {
+            if (a.package != b.package) return a.package < b.package;
+            if (a.core != b.core) return a.core < b.core;
+            return a.cpu < b.cpu;
+        });
+        for (size_t i = 0; i < keys.size(); i++) cpus[i] = keys[i].cpu;
+    }
+
+    int placement_cpuset(const CpuPlacement &placement, int index, cpu_set_t *cpuset) {
+        CPU_ZERO(cpuset);
+        if (placement.policy == CPU_PLACE_NONE) return 0;
+
+        if (placement.policy == CPU_PLACE_CPU_LIST) {
+            if (placement.cpus.empty()) {
+                std::cerr << "[ERROR] cpu placement: empty cpu list" << std::endl;
+                return -1;
+            }
+            int cpu = placement.cpus[index % placement.cpus.size()];
+            if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                std::cerr << "[ERROR] cpu placement: invalid cpu " << cpu << std::endl;
+                return -1;
+            }
+            CPU_SET(cpu, cpuset);
+            return 0;
+        }
+
+        std::vector<std::vector<int>> nodes;
+        if (numa_node_cpus(nodes) != 0) {
+            std::cerr << "[ERROR] cpu placement: no usable cpu" << std::endl;
+            return -1;
+        }
+        if (placement.numa_node >= 0) {
+            if ((size_t) placement.numa_node >= nodes.size() || nodes[placement.numa_node].empty()) {
+                std::cerr << "[ERROR] cpu placement: numa node " << placement.numa_node << " has no usable cpu"
+                          << std::endl;
+                return -1;
+            }
+            std::vector<int> node = nodes[placement.numa_node];
+            nodes.assign(1, node);
+        }
+        nodes.erase(std::remove_if(nodes.begin(), nodes.end(),
+                                   [](const std::vector<int> &n) { return n.empty(); }), nodes.end());
+        if (nodes.empty()) {
+            std::cerr << "[ERROR] cpu placement: no usable cpu" << std::endl;
+            return -1;
+        }
+
+        switch (placement.policy) {
+            case CPU_PLACE_NUMA_NODE:
+                if (placement.numa_node < 0) {
+                    std::cerr << "[ERROR] cpu placement: numa_node not set" << std::endl;
+                    return -1;
+                }
+                for (int c : nodes[0]) CPU_SET(c, cpuset);
+                return 0;
+            case CPU_PLACE_COMPACT: {
+                std::vector<int> order;
+                for (auto &n : nodes) {
+                    std::vector<int> cpus = n;
+                    sort_by_core(cpus);
+                    order.insert(order.end(), cpus.begin(), cpus.end());
+                }
+                CPU_SET(order[index % order.size()], cpuset);
+                return 0;
+            }
+            case CPU_PLACE_SCATTER: {
+                const std::vector<int> &node = nodes[index % nodes.size()];
+                CPU_SET(node[(index / nodes.size()) % node.size()], cpuset);
+                return 0;
+            }
+            default:
+                std::cerr << "[ERROR] cpu placement: unknown policy " << placement.policy << std::endl;
+                return -1;
+        }
+    }
+
+    int set_thread_affinity(pthread_t thread, const cpu_set_t *cpuset) {
+        int ret = pthread_setaffinity_np(thread, sizeof(cpu_set_t), cpuset);
+        if (ret != 0) {
+            std::cerr << "[ERROR] calling pthread_setaffinity_np failed: " << strerror(ret) << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+}
@@ -0,0 +1,56 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef SOPHON_PIPELINE_BMUTILITY_AFFINITY_H
+#define SOPHON_PIPELINE_BMUTILITY_AFFINITY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+namespace bm {
+    enum CpuPlacePolicy {
+        CPU_PLACE_NONE = 0,      // leave it to the scheduler
+        CPU_PLACE_COMPACT = 1,   // worker i on the i-th CPU, filling one NUMA node (and its SMT siblings) first
+        CPU_PLACE_SCATTER = 2,   // workers spread round-robin over the NUMA nodes
+        CPU_PLACE_CPU_LIST = 3,  // worker i on cpus[i % cpus.size()]
+        CPU_PLACE_NUMA_NODE = 4, // every worker may run on any CPU of numa_node
+    };
+
+    struct CpuPlacement {
+        CpuPlacement() : policy(CPU_PLACE_NONE), numa_node(-1) {}
+
+        int policy;
+        std::vector<int> cpus; // CPU_PLACE_CPU_LIST
+        int numa_node;         // CPU_PLACE_NUMA_NODE; with COMPACT/SCATTER, >= 0 limits them to that node
+    };
+
+    // "0-3,8,10-11" -> {0,1,2,3,8,10,11}; -1 on a malformed list
+    int parse_cpu_list(const std::string &str, std::vector<int> &cpus);
+
+    // CPUs of each NUMA node from sysfs, restricted to the CPUs this process may run on. Hosts
+    // without NUMA information report a single node.
+    int numa_node_cpus(std::vector<std::vector<int>> &nodes);
+
+    // NUMA node of a CPU, -1 if unknown
+    int cpu_numa_node(int cpu);
+
+    // Fills cpuset for worker index of a pool; -1 if the placement can't be satisfied on this host.
+    // Returns 0 with an empty cpuset for CPU_PLACE_NONE.
+    int placement_cpuset(const CpuPlacement &placement, int index, cpu_set_t *cpuset);
+
+    // pthread_setaffinity_np wrapper that reports failures instead of aborting
+    int set_thread_affinity(pthread_t thread, const cpu_set_t *cpuset);
+}
+
+#endif //SOPHON_PIPELINE_BMUTILITY_AFFINITY_H
@@ -0,0 +1,294 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_DEDUP_H
+#define BMUTILITY_DEDUP_H
+
+#include <map>
+#include <unordered_map>
+#include "bmutility_pipeline.h"
+
+namespace bm {
+    // 8-bit luma of a decoded frame, e.g. data[0]/linesize[0] of a YUV AVFrame
+    struct LumaPlane {
+        LumaPlane() : data(nullptr), width(0), height(0), stride(0) {}
+
+        const uint8_t *data;
+        int width;
+        int height;
+        int stride;
+    };
+
+    struct DedupParam {
+        DedupParam() {
+            grid_size = 16;
+            cell_threshold = 8;
+            max_changed_cells = 0;
+            max_reuse_num = 50;
+            notify_detected = true;
+        }
+
+        // the fingerprint is the mean luma of grid_size x grid_size cells
+        int grid_size;
+        // a cell has changed when its mean moved by more than this many luma levels
+        int cell_threshold;
+        // a frame reuses the last result while at most this many cells have changed
+        int max_changed_cells;
+        // consecutive frames of a stream that may reuse one result before the model runs again
+        int max_reuse_num;
+        // postprocess invokes the detected callback for reused frames; turn it off when the pipe does
+        // it (BMInferencePipe::set_ordered_output)
+        bool notify_detected;
+    };
+
+    struct DedupStats {
+        uint64_t hits;   // frames that reused the last result of their stream
+        uint64_t misses; // frames the model ran on
+
+        DedupStats() : hits(0), misses(0) {}
+    };
+
+    // state DedupDetectorDelegate keeps in every frame, see its TagFunc
+    struct DedupTag {
+        DedupTag() : hit(false), token(0) {}
+
+        bool hit;       // the frame reuses the last result of its stream
+        uint64_t token; // a miss whose fingerprint waits for its postprocess, 0: none
+    };
+
+    // Wraps a DetectorDelegate to skip the model on static scenes. preprocess takes a fingerprint
+    // of every frame's luma plane and compares it with the one of the stream's last frame that went
+    // through the model: a frame that hasn't changed beyond the thresholds skips preprocess, forward
+    // and postprocess of the wrapped delegate and gets that frame's result through the reuse
+    // callback instead.
+    //
+    // The reference of a stream is only updated once its frame has been postprocessed, so a hit
+    // always has a result to reuse. The wrapper keeps the fingerprint and result_func(frame) of the
+    // reference, R being e.g. the detections, and finds a miss's fingerprint again by the token in
+    // its DedupTag. The result is taken before the detected callback hands the frame on; set the
+    // callback on the wrapper, not on the wrapped delegate, and let the wrapped postprocess hand
+    // frames on through it before it returns. The luma plane only has to be valid during preprocess;
+    // a frame without one always runs the model. Reused frames are notified after the batch's other
+    // frames, use BMInferencePipe::set_ordered_output where the order matters. An
+    // AsyncDetectorDelegate runs synchronously behind the wrapper.
+    template<typename T1, typename R>
+    class DedupDetectorDelegate : public DetectorDelegate<T1> {
+    public:
+        using StreamKeyFunc = std::function<int(const T1 &frame)>;
+        // 0 and the frame's luma plane, -1 if it has none
+        using LumaFunc = std::function<int(const T1 &frame, LumaPlane &plane)>;
+        // reference to the DedupTag the frame carries
+        using TagFunc = std::function<DedupTag &(T1 &frame)>;
+        // the part of a postprocessed frame hits reuse
+        using ResultFunc = std::function<R(const T1 &frame)>;
+        // copies the result of the stream's reference onto frame
+        using ReuseFunc = std::function<void(const R &last, T1 &frame)>;
+
+    private:
+        struct Stream {
+            Stream() : token(0), reuse_num(0) {}
+
+            // the reference: the newest miss postprocessed so far
+            std::vector<uint8_t> fingerprint;
+            std::shared_ptr<const R> last;
+            uint64_t token;
+            int reuse_num;
+            // fingerprints of the misses between preprocess and postprocess, by token; the ones
+            // older than the reference are dropped with it, shed frames included
+            std::map<uint64_t, std::vector<uint8_t>> pending;
+            DedupStats stats;
+        };
+
+        std::shared_ptr<DetectorDelegate<T1>> m_delegate;
+        DedupParam m_param;
+        StreamKeyFunc m_key_func;
+        LumaFunc m_luma_func;
+        TagFunc m_tag_func;
+        ResultFunc m_result_func;
+        ReuseFunc m_reuse_func;
+
+        pthread_mutex_t m_mtx;
+        std::unordered_map<int, Stream> m_streams;
+        uint64_t m_next_token;
+
+        // The postprocessed miss frame with token becomes the reference of stream key, unless it
+        // already has or a newer miss got there first.
+        void set_reference(int key, uint64_t token, const T1 &frame) {
+            std::vector<uint8_t> fp;
+            pthread_mutex_lock(&m_mtx);
+            Stream &s = m_streams[key];
+            auto it = s.pending.find(token);
+            bool found = it != s.pending.end();
+            if (found) {
+                fp.swap(it->second);
+                s.pending.erase(s.pending.begin(), ++it);
+            }
+            pthread_mutex_unlock(&m_mtx);
+            if (!found) return;
+
+            std::shared_ptr<const R> last = std::make_shared<const R>(m_result_func(frame));
+            pthread_mutex_lock(&m_mtx);
+            if (token > s.token) {
+                s.fingerprint.swap(fp);
+                s.last.swap(last);
+                s.token = token;
+                s.reuse_num = 0;
+            }
+            pthread_mutex_unlock(&m_mtx);
+        }
+
+        bool fingerprint(const T1 &frame, std::vector<uint8_t> &fp) const {
+            LumaPlane plane;
+            if (m_luma_func(frame, plane) != 0 || plane.data == nullptr || plane.width <= 0 || plane.height <= 0) {
+                return false;
+            }
+            // 4x4 samples per cell are enough to see anything larger than a cell move
+            int grid = m_param.grid_size;
+            fp.resize(grid * grid);
+            for (int gy = 0; gy < grid; gy++) {
+                for (int gx = 0; gx < grid; gx++) {
+                    int sum = 0;
+                    for (int sy = 0; sy < 4; sy++) {
+                        int y = (int) (((int64_t) gy * 4 + sy) * plane.height / (grid * 4));
+                        const uint8_t *row = plane.data + (int64_t) y * plane.stride;
+                        for (int sx = 0; sx < 4; sx++) {
+                            sum += row[((int64_t) gx * 4 + sx) * plane.width / (grid * 4)];
+                        }
+                    }
+                    fp[gy * grid + gx] = (uint8_t) (sum / 16);
+                }
+            }
+            return true;
+        }
+
+        bool unchanged(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) const {
+            if (a.size() != b.size()) return false;
+            int changed = 0;
+            for (size_t i = 0; i < a.size(); i++) {
+                if (std::abs((int) a[i] - (int) b[i]) > m_param.cell_threshold && ++changed > m_param.max_changed_cells) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Runs func on the frames that are no hits. Frames are moved out and back when the batch
+        // mixes hits and misses.
+        template<typename Func>
+        int run_misses(std::vector<T1> &frames, Func func) {
+            size_t miss_num = 0;
+            for (auto &frame : frames) {
+                if (!m_tag_func(frame).hit) miss_num++;
+            }
+            if (miss_num == 0) return 0;
+            if (miss_num == frames.size()) return func(frames);
+
+            static thread_local std::vector<T1> misses;
+            static thread_local std::vector<size_t> pos;
+            misses.clear();
+            pos.clear();
+            for (size_t i = 0; i < frames.size(); i++) {
+                if (m_tag_func(frames[i]).hit) continue;
+                misses.push_back(std::move(frames[i]));
+                pos.push_back(i);
+            }
+            int ret = func(misses);
+            for (size_t i = 0; i < pos.size(); i++) frames[pos[i]] = std::move(misses[i]);
+            misses.clear();
+            return ret;
+        }
+
+    public:
+        DedupDetectorDelegate(std::shared_ptr<DetectorDelegate<T1>> delegate, StreamKeyFunc key_func,
+                              LumaFunc luma_func, TagFunc tag_func, ResultFunc result_func, ReuseFunc reuse_func,
+                              const DedupParam &param = DedupParam())
+                : m_delegate(delegate), m_param(param), m_key_func(key_func), m_luma_func(luma_func),
+                  m_tag_func(tag_func), m_result_func(result_func), m_reuse_func(reuse_func), m_next_token(0) {
+            if (m_param.grid_size < 1) m_param.grid_size = 1;
+            pthread_mutex_init(&m_mtx, NULL);
+        }
+
+        ~DedupDetectorDelegate() override {
+            pthread_mutex_destroy(&m_mtx);
+        }
+
+        int set_detected_callback(typename DetectorDelegate<T1>::DetectedFinishFunc func) override {
+            DetectorDelegate<T1>::set_detected_callback(func);
+            // the wrapped postprocess is about to hand a miss on, take it as reference first
+            return m_delegate->set_detected_callback([this, func](T1 &frame) {
+                uint64_t token = m_tag_func(frame).token;
+                if (token != 0) set_reference(m_key_func(frame), token, frame);
+                if (func != nullptr) func(frame);
+            });
+        }
+
+        int preprocess(std::vector<T1> &frames) override {
+            std::vector<uint8_t> fp;
+            for (auto &frame : frames) {
+                DedupTag &tag = m_tag_func(frame);
+                bool has_fp = fingerprint(frame, fp);
+                pthread_mutex_lock(&m_mtx);
+                Stream &s = m_streams[m_key_func(frame)];
+                tag.hit = has_fp && s.last && s.reuse_num < m_param.max_reuse_num && unchanged(fp, s.fingerprint);
+                tag.token = 0;
+                if (tag.hit) {
+                    s.reuse_num++;
+                    s.stats.hits++;
+                } else {
+                    s.stats.misses++;
+                    if (has_fp) {
+                        tag.token = ++m_next_token;
+                        s.pending[tag.token].swap(fp);
+                    }
+                }
+                pthread_mutex_unlock(&m_mtx);
+            }
+            return run_misses(frames, [this](std::vector<T1> &misses) { return m_delegate->preprocess(misses); });
+        }
+
+        int forward(std::vector<T1> &frames) override {
+            return run_misses(frames, [this](std::vector<T1> &misses) { return m_delegate->forward(misses); });
+        }
+
+        int postprocess(std::vector<T1> &frames) override {
+            int ret = run_misses(frames, [this](std::vector<T1> &misses) {
+                // stream and token of every miss, the wrapped postprocess may move the frames on
+                static thread_local std::vector<std::pair<int, uint64_t>> refs;
+                refs.clear();
+                for (auto &frame : misses) refs.emplace_back(m_key_func(frame), m_tag_func(frame).token);
+                int ret = m_delegate->postprocess(misses);
+                // the ones not handed on through the detected callback are still in misses
+                for (size_t i = 0; i < misses.size(); i++) {
+                    if (refs[i].second != 0) set_reference(refs[i].first, refs[i].second, misses[i]);
+                }
+                return ret;
+            });
+
+            for (auto &frame : frames) {
+                if (!m_tag_func(frame).hit) continue;
+                pthread_mutex_lock(&m_mtx);
+                std::shared_ptr<const R> last = m_streams[m_key_func(frame)].last;
+                pthread_mutex_unlock(&m_mtx);
+                m_reuse_func(*last, frame);
+                if (m_param.notify_detected) this->notify_detected(frame);
+            }
+            return ret;
+        }
+
+        std::unordered_map<int, DedupStats> stats() {
+            std::unordered_map<int, DedupStats> stats;
+            pthread_mutex_lock(&m_mtx);
+            for (auto &it : m_streams) stats[it.first] = it.second.stats;
+            pthread_mutex_unlock(&m_mtx);
+            return stats;
+        }
+    };
+} // end namespace bm
+
+#endif //BMUTILITY_DEDUP_H
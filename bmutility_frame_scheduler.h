@@ -0,0 +1,203 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_FRAME_SCHEDULER_H
+#define BMUTILITY_FRAME_SCHEDULER_H
+
+#include <unordered_map>
+#include "bmutility_pipeline.h"
+
+namespace bm {
+    struct ScheduleStats {
+        uint64_t offered;  // frames given to push_frame
+        uint64_t admitted; // frames sent to the pipe
+        uint64_t skipped;  // frames left out by the stride, passed to the skip callback
+
+        ScheduleStats() : offered(0), admitted(0), skipped(0) {}
+    };
+
+    // Admission in front of a BMInferencePipe: runs detection on every Nth frame of a stream
+    // (set_stream_stride) or at a target analytics fps of a stream (set_stream_fps), and hands every
+    // other frame to the skip callback, e.g. to mark it for the tracker to interpolate.
+    //
+    // With set_adaptive the strides of all streams are stretched by a common load scale: it grows
+    // while the pipe holds more than target_inflight frames or sheds frames past their deadline, and
+    // shrinks back to 1 once the pipe is below half of target_inflight. The total inference rate thus
+    // settles under what the pipe can take, and every stream is thinned out by the same factor.
+    //
+    // push_frame of one stream is meant to be called from one thread, e.g. its decoder.
+    template<typename T1>
+    class FrameScheduler {
+    public:
+        using StreamKeyFunc = std::function<int(const T1 &frame)>;
+        using SkipFunc = std::function<void(T1 &frame)>;
+
+    private:
+        struct Stream {
+            Stream() : stride(0), fps(0), phase(1.0), next_us(0) {}
+
+            int stride;     // 0: default stride
+            double fps;     // > 0 takes precedence over the stride
+            double phase;   // stride mode: the next frame is admitted once this reaches 1
+            int64_t next_us; // fps mode: earliest time of the next admitted frame
+            ScheduleStats stats;
+        };
+
+        BMInferencePipe<T1> *m_pipe;
+        StreamKeyFunc m_key_func;
+        SkipFunc m_skip_func;
+        int m_default_stride;
+
+        pthread_mutex_t m_mtx;
+        std::unordered_map<int, Stream> m_streams;
+
+        // load adaptation
+        uint64_t m_target_inflight;
+        double m_max_scale;
+        int64_t m_interval_us;
+        std::atomic<double> m_scale;
+        std::atomic<int64_t> m_next_adjust_us;
+        uint64_t m_last_shed;
+
+        void adjust(int64_t now) {
+            int64_t next = m_next_adjust_us.load(std::memory_order_relaxed);
+            if (m_target_inflight == 0 || now < next) return;
+            // one caller per interval does the update
+            if (!m_next_adjust_us.compare_exchange_strong(next, now + m_interval_us)) return;
+
+            uint64_t inflight = m_pipe->inflight_frames();
+            uint64_t shed = m_pipe->shed_frames();
+            double scale = m_scale.load(std::memory_order_relaxed);
+            if (inflight > m_target_inflight || shed > m_last_shed) {
+                scale = std::min(scale * 1.25, m_max_scale);
+            } else if (inflight * 2 < m_target_inflight) {
+                scale = std::max(scale / 1.1, 1.0);
+            }
+            m_last_shed = shed;
+            m_scale.store(scale, std::memory_order_relaxed);
+        }
+
+        // decides on the frame and updates the stream's state for it
+        bool admit(Stream &s, int64_t now, double scale) {
+            if (s.fps > 0) {
+                int64_t interval = (int64_t) (1000000.0 * scale / s.fps);
+                if (now < s.next_us) return false;
+                // keep the phase while on time, restart it after a gap
+                s.next_us = s.next_us + interval > now ? s.next_us + interval : now + interval;
+                return true;
+            }
+            int stride = s.stride > 0 ? s.stride : m_default_stride;
+            // a fractional stride (scale > 1) admits frames at the right average rate
+            bool admitted = s.phase >= 1.0 - 1e-9;
+            if (admitted) s.phase = std::max(s.phase - 1.0, 0.0);
+            s.phase += 1.0 / (stride * scale);
+            return admitted;
+        }
+
+    public:
+        FrameScheduler(BMInferencePipe<T1> *pipe, StreamKeyFunc key_func)
+                : m_pipe(pipe), m_key_func(key_func), m_default_stride(1), m_target_inflight(0),
+                  m_max_scale(1.0), m_interval_us(0), m_scale(1.0), m_next_adjust_us(0), m_last_shed(0) {
+            pthread_mutex_init(&m_mtx, NULL);
+        }
+
+        ~FrameScheduler() {
+            pthread_mutex_destroy(&m_mtx);
+        }
+
+        // stride of the streams without one of their own, 1 runs every frame
+        void set_default_stride(int stride) {
+            m_default_stride = stride > 1 ? stride : 1;
+        }
+
+        // runs detection on every stride-th frame of the stream
+        void set_stream_stride(int key, int stride) {
+            pthread_mutex_lock(&m_mtx);
+            Stream &s = m_streams[key];
+            s.stride = stride > 1 ? stride : 1;
+            s.fps = 0;
+            pthread_mutex_unlock(&m_mtx);
+        }
+
+        // runs detection on at most fps frames per second of the stream, whatever its frame rate
+        void set_stream_fps(int key, double fps) {
+            pthread_mutex_lock(&m_mtx);
+            Stream &s = m_streams[key];
+            s.fps = fps > 0 ? fps : 0;
+            s.next_us = 0;
+            pthread_mutex_unlock(&m_mtx);
+        }
+
+        // called for every skipped frame, on the thread of push_frame
+        void set_skip_callback(SkipFunc func) {
+            m_skip_func = func;
+        }
+
+        // Call before the first push_frame: every interval_ms the load scale is adapted to keep the
+        // pipe's in-flight frames under target_inflight, between 1 and max_scale. target_inflight 0
+        // turns it off. A good target is about two batches per stage.
+        void set_adaptive(int target_inflight, double max_scale = 8.0, int interval_ms = 200) {
+            m_target_inflight = target_inflight > 0 ? target_inflight : 0;
+            m_max_scale = max_scale > 1.0 ? max_scale : 1.0;
+            m_interval_us = (int64_t) (interval_ms > 0 ? interval_ms : 1) * 1000;
+            m_last_shed = m_pipe->shed_frames();
+            m_scale.store(1.0);
+        }
+
+        // Returns BM_INFER_PIPE_SKIPPED for a frame the schedule leaves out, after the skip callback,
+        // otherwise what BMInferencePipe::push_frame returns. A frame the pipe was too busy to take
+        // (BM_INFER_PIPE_BUSY) doesn't use up the stream's turn, the next frame gets it.
+        int push_frame(T1 *frame, long wait_ms = 0) {
+            int64_t now = blocking_queue_now_us();
+            adjust(now);
+            double scale = m_scale.load(std::memory_order_relaxed);
+            int key = m_key_func(*frame);
+
+            pthread_mutex_lock(&m_mtx);
+            Stream &s = m_streams[key];
+            Stream saved = s;
+            s.stats.offered++;
+            bool admitted = admit(s, now, scale);
+            if (!admitted) s.stats.skipped++;
+            pthread_mutex_unlock(&m_mtx);
+
+            if (!admitted) {
+                if (m_skip_func != nullptr) m_skip_func(*frame);
+                return BM_INFER_PIPE_SKIPPED;
+            }
+
+            int ret = m_pipe->push_frame(frame, wait_ms);
+            pthread_mutex_lock(&m_mtx);
+            Stream &t = m_streams[key];
+            if (ret == 0) {
+                t.stats.admitted++;
+            } else {
+                t.phase = saved.phase;
+                t.next_us = saved.next_us;
+            }
+            pthread_mutex_unlock(&m_mtx);
+            return ret;
+        }
+
+        // current stretch of all strides, 1 while the pipe keeps up
+        double load_scale() const {
+            return m_scale.load(std::memory_order_relaxed);
+        }
+
+        std::unordered_map<int, ScheduleStats> stats() {
+            std::unordered_map<int, ScheduleStats> stats;
+            pthread_mutex_lock(&m_mtx);
+            for (auto &it : m_streams) stats[it.first] = it.second.stats;
+            pthread_mutex_unlock(&m_mtx);
+            return stats;
+        }
+    };
+} // end namespace bm
+
+#endif //BMUTILITY_FRAME_SCHEDULER_H
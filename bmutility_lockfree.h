@@ -0,0 +1,355 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_LOCKFREE_H
+#define BMUTILITY_LOCKFREE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#define BM_CACHELINE_SIZE 64
+
+// Bounded multi-producer/multi-consumer ring (D. Vyukov's sequence-per-cell design).
+// try_push/try_pop never block; callers decide how to wait when the ring is full or empty.
+// Every cell also carries a caller-defined stamp (e.g. enqueue time) that can be read at the front.
+template<typename T>
+class MpmcRing {
+    struct Cell {
+        std::atomic<size_t> seq;
+        std::atomic<int64_t> stamp;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        T *ptr() { return reinterpret_cast<T *>(&storage); }
+    };
+
+public:
+    explicit MpmcRing(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        m_mask = cap - 1;
+        m_cells = new Cell[cap];
+        for (size_t i = 0; i < cap; ++i) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        m_enqueue_pos.store(0, std::memory_order_relaxed);
+        m_dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    ~MpmcRing() {
+        size_t enq = m_enqueue_pos.load(std::memory_order_acquire);
+        for (size_t pos = m_dequeue_pos.load(std::memory_order_acquire); pos != enq; ++pos) {
+            m_cells[pos & m_mask].ptr()->~T();
+        }
+        delete[] m_cells;
+    }
+
+    MpmcRing(const MpmcRing &) = delete;
+    MpmcRing &operator=(const MpmcRing &) = delete;
+
+    bool try_push(T &&data, int64_t stamp = 0) {
+        Cell *cell;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+            if (dif == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        new(cell->ptr()) T(std::move(data));
+        cell->stamp.store(stamp, std::memory_order_relaxed);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Stamp of the oldest element; false when empty. Best effort under concurrent pops.
+    bool front_stamp(int64_t &stamp) const {
+        size_t pos = m_dequeue_pos.load(std::memory_order_acquire);
+        const Cell &cell = m_cells[pos & m_mask];
+        if (cell.seq.load(std::memory_order_acquire) != pos + 1) return false;
+        stamp = cell.stamp.load(std::memory_order_relaxed);
+        return true;
+    }
+
+    // Moves the oldest element into fn(T &, int64_t stamp) and destroys it; T need not be
+    // default-constructible.
+    template<typename Fn>
+    bool try_consume(Fn &&fn) {
+        Cell *cell;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (dif == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        fn(*cell->ptr(), cell->stamp.load(std::memory_order_relaxed));
+        cell->ptr()->~T();
+        cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &data) {
+        return try_consume([&data](T &o, int64_t) { data = std::move(o); });
+    }
+
+    // Approximate while producers/consumers are active, exact when quiescent.
+    size_t size() const {
+        size_t deq = m_dequeue_pos.load(std::memory_order_acquire);
+        size_t enq = m_enqueue_pos.load(std::memory_order_acquire);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    // explicit padding instead of alignas: over-aligned new is not guaranteed before C++17
+    char m_pad0[BM_CACHELINE_SIZE];
+    std::atomic<size_t> m_enqueue_pos;
+    char m_pad1[BM_CACHELINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_dequeue_pos;
+    char m_pad2[BM_CACHELINE_SIZE - sizeof(std::atomic<size_t>)];
+    Cell *m_cells;
+    size_t m_mask;
+};
+
+// Bounded single-producer/single-consumer ring. Both sides are wait-free: each index is written by
+// one thread only, published with release and read with acquire. The producer can stage several
+// elements and make them visible with one publish(); the consumer retires a whole batch at once.
+template<typename T>
+class SpscRing {
+    struct Cell {
+        int64_t stamp;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        T *ptr() { return reinterpret_cast<T *>(&storage); }
+    };
+
+public:
+    explicit SpscRing(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        m_mask = cap - 1;
+        m_cells = new Cell[cap];
+        m_tail.store(0, std::memory_order_relaxed);
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail_pending = 0;
+        m_head_cache = 0;
+        m_tail_cache = 0;
+    }
+
+    ~SpscRing() {
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        for (size_t pos = m_head.load(std::memory_order_acquire); pos != tail; ++pos) {
+            m_cells[pos & m_mask].ptr()->~T();
+        }
+        delete[] m_cells;
+    }
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    // producer: write one element without making it visible yet
+    bool stage(T &&data, int64_t stamp = 0) {
+        if (m_tail_pending - m_head_cache > m_mask) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (m_tail_pending - m_head_cache > m_mask) return false;
+        }
+        Cell &cell = m_cells[m_tail_pending & m_mask];
+        new(cell.ptr()) T(std::move(data));
+        cell.stamp = stamp;
+        m_tail_pending++;
+        return true;
+    }
+
+    // producer: make every staged element visible to the consumer
+    void publish() {
+        m_tail.store(m_tail_pending, std::memory_order_release);
+    }
+
+    bool try_push(T &&data, int64_t stamp = 0) {
+        if (!stage(std::move(data), stamp)) return false;
+        publish();
+        return true;
+    }
+
+    // consumer: stamp of the oldest published element, false when empty
+    bool front_stamp(int64_t &stamp) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (m_tail_cache == head) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (m_tail_cache == head) return false;
+        }
+        stamp = m_cells[head & m_mask].stamp;
+        return true;
+    }
+
+    // consumer: hand up to max_num elements to fn(T &, int64_t stamp), then release their slots in one store
+    template<typename Fn>
+    size_t consume(size_t max_num, Fn &&fn) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (m_tail_cache == head) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (m_tail_cache == head) return 0;
+        }
+        size_t n = m_tail_cache - head;
+        if (n > max_num) n = max_num;
+        for (size_t i = 0; i < n; ++i) {
+            Cell &cell = m_cells[(head + i) & m_mask];
+            T *p = cell.ptr();
+            fn(*p, cell.stamp);
+            p->~T();
+        }
+        m_head.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    size_t size() const {
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    char m_pad0[BM_CACHELINE_SIZE];
+    std::atomic<size_t> m_tail;
+    size_t m_tail_pending;  // producer only
+    size_t m_head_cache;    // producer only
+    char m_pad1[BM_CACHELINE_SIZE - 3 * sizeof(size_t)];
+    std::atomic<size_t> m_head;
+    size_t m_tail_cache;    // consumer only
+    char m_pad2[BM_CACHELINE_SIZE - 2 * sizeof(size_t)];
+    Cell *m_cells;
+    size_t m_mask;
+};
+
+// Chase-Lev work-stealing deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory
+// Models"). The owner pushes and takes at the bottom, any thread may steal from the top. T must be
+// trivially copyable (typically a pointer). Retired arrays are kept until destruction because a
+// concurrent thief may still read from them.
+template<typename T>
+class ChaseLevDeque {
+    static_assert(std::is_trivially_copyable<T>::value, "ChaseLevDeque holds trivially copyable values");
+
+    struct Array {
+        int64_t size;
+        std::atomic<T> *slots;
+        Array *prev;
+
+        explicit Array(int64_t n) : size(n), slots(new std::atomic<T>[n]), prev(nullptr) {}
+        ~Array() { delete[] slots; }
+
+        T get(int64_t i) const { return slots[i & (size - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, T v) { slots[i & (size - 1)].store(v, std::memory_order_relaxed); }
+    };
+
+public:
+    explicit ChaseLevDeque(int64_t capacity = 64) {
+        int64_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        m_top.store(0, std::memory_order_relaxed);
+        m_bottom.store(0, std::memory_order_relaxed);
+        m_array.store(new Array(cap), std::memory_order_relaxed);
+    }
+
+    ~ChaseLevDeque() {
+        Array *a = m_array.load(std::memory_order_relaxed);
+        while (a != nullptr) {
+            Array *prev = a->prev;
+            delete a;
+            a = prev;
+        }
+    }
+
+    ChaseLevDeque(const ChaseLevDeque &) = delete;
+    ChaseLevDeque &operator=(const ChaseLevDeque &) = delete;
+
+    // owner only
+    void push(T v) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array *a = m_array.load(std::memory_order_relaxed);
+        if (b - t > a->size - 1) {
+            Array *grown = new Array(a->size * 2);
+            for (int64_t i = t; i < b; ++i) grown->put(i, a->get(i));
+            grown->prev = a;
+            m_array.store(grown, std::memory_order_release);
+            a = grown;
+        }
+        a->put(b, v);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // owner only, LIFO end
+    bool take(T &v) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array *a = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        if (t > b) {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        v = a->get(b);
+        if (t == b) {
+            // last element, race against thieves
+            bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                     std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // any thread, FIFO end; false when empty or when the race was lost
+    bool steal(T &v) {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b) return false;
+        Array *a = m_array.load(std::memory_order_acquire);
+        v = a->get(t);
+        return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    size_t size() const {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+private:
+    char m_pad0[BM_CACHELINE_SIZE];
+    std::atomic<int64_t> m_top;
+    char m_pad1[BM_CACHELINE_SIZE - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> m_bottom;
+    std::atomic<Array *> m_array;
+    char m_pad2[BM_CACHELINE_SIZE];
+};
+
+#endif //BMUTILITY_LOCKFREE_H
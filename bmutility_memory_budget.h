@@ -0,0 +1,165 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_MEMORY_BUDGET_H
+#define BMUTILITY_MEMORY_BUDGET_H
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "bmutility_thread_queue.h"
+
+namespace bm {
+    // What a full MemoryBudget does with a new frame
+    enum MemoryPolicy {
+        // waits up to the push_frame timeout for memory to be released
+        MEMORY_POLICY_BLOCK = 0,
+        // refuses the frame right away
+        MEMORY_POLICY_SHED = 1,
+    };
+
+    // Byte budget shared by everything that holds frames in a process, e.g. one BMInferencePipe per
+    // model. Users open an account each; acquire() charges it and blocks while the budget would be
+    // exceeded, release() gives the bytes back. A single charge larger than the whole budget is let
+    // through when nothing else is charged, so an oversized frame can't stall a pipe forever.
+    //
+    // The fast path is a CAS, the mutex is only taken to park, like CreditGate.
+    class MemoryBudget {
+    public:
+        class Account {
+            friend class MemoryBudget;
+            std::string m_name;
+            std::atomic<int64_t> m_used;
+
+        public:
+            explicit Account(const std::string &name) : m_name(name), m_used(0) {}
+
+            const std::string &name() const { return m_name; }
+
+            int64_t used() const { return m_used.load(std::memory_order_relaxed); }
+        };
+
+    private:
+        std::atomic<int64_t> m_capacity;
+        std::atomic<int64_t> m_used;
+        std::atomic<int> m_waiters;
+        pthread_mutex_t m_mtx;
+        pthread_cond_t m_condv;
+        // under m_mtx
+        std::vector<std::unique_ptr<Account>> m_accounts;
+
+        bool try_charge(int64_t bytes) {
+            int64_t capacity = m_capacity.load(std::memory_order_relaxed);
+            int64_t used = m_used.load(std::memory_order_relaxed);
+            while (capacity <= 0 || used == 0 || used + bytes <= capacity) {
+                if (m_used.compare_exchange_weak(used, used + bytes, std::memory_order_acquire)) return true;
+            }
+            return false;
+        }
+
+    public:
+        // capacity_bytes 0 is unlimited, usage is still accounted
+        explicit MemoryBudget(int64_t capacity_bytes = 0) : m_capacity(capacity_bytes), m_used(0), m_waiters(0) {
+            pthread_mutex_init(&m_mtx, NULL);
+            blocking_queue_cond_init(&m_condv);
+        }
+
+        ~MemoryBudget() {
+            pthread_cond_destroy(&m_condv);
+            pthread_mutex_destroy(&m_mtx);
+        }
+
+        // the process-wide budget, unlimited until set_capacity()
+        static MemoryBudget &global() {
+            static MemoryBudget budget;
+            return budget;
+        }
+
+        void set_capacity(int64_t capacity_bytes) {
+            m_capacity = capacity_bytes;
+            wake();
+        }
+
+        int64_t capacity() const { return m_capacity.load(std::memory_order_relaxed); }
+
+        int64_t used() const { return m_used.load(std::memory_order_relaxed); }
+
+        // The account stays valid until close_account(); the budget must outlive it.
+        Account *open_account(const std::string &name) {
+            pthread_mutex_lock(&m_mtx);
+            m_accounts.emplace_back(new Account(name));
+            Account *account = m_accounts.back().get();
+            pthread_mutex_unlock(&m_mtx);
+            return account;
+        }
+
+        // gives back whatever the account still holds
+        void close_account(Account *account) {
+            if (account == nullptr) return;
+            release(account, account->used());
+            pthread_mutex_lock(&m_mtx);
+            m_accounts.erase(std::remove_if(m_accounts.begin(), m_accounts.end(), [account](const std::unique_ptr<Account> &a) {
+                return a.get() == account;
+            }), m_accounts.end());
+            pthread_mutex_unlock(&m_mtx);
+        }
+
+        // Waits until deadline_us (blocking_queue_now_us() clock, 0 tries once) for the budget to take
+        // bytes more. 0 on success, -1 on timeout or once *cancel is set (see wake()).
+        int acquire(Account *account, int64_t bytes, int64_t deadline_us, const std::atomic<bool> *cancel = nullptr) {
+            while (!try_charge(bytes)) {
+                if ((cancel != nullptr && cancel->load()) || deadline_us == 0 ||
+                    (deadline_us != BLOCKING_QUEUE_NO_DEADLINE && blocking_queue_now_us() >= deadline_us)) {
+                    return -1;
+                }
+                pthread_mutex_lock(&m_mtx);
+                m_waiters.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                int64_t used = m_used.load(std::memory_order_relaxed);
+                int64_t capacity = m_capacity.load(std::memory_order_relaxed);
+                if (capacity > 0 && used > 0 && used + bytes > capacity && (cancel == nullptr || !cancel->load())) {
+                    blocking_queue_cond_wait(&m_condv, &m_mtx, deadline_us);
+                }
+                m_waiters.fetch_sub(1);
+                pthread_mutex_unlock(&m_mtx);
+            }
+            account->m_used.fetch_add(bytes, std::memory_order_relaxed);
+            return 0;
+        }
+
+        void release(Account *account, int64_t bytes) {
+            if (bytes == 0) return;
+            account->m_used.fetch_sub(bytes, std::memory_order_relaxed);
+            m_used.fetch_sub(bytes, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_waiters.load(std::memory_order_relaxed) > 0) wake();
+        }
+
+        // wakes every waiting acquire() to check its cancel flag and the capacity again
+        void wake() {
+            pthread_mutex_lock(&m_mtx);
+            pthread_cond_broadcast(&m_condv);
+            pthread_mutex_unlock(&m_mtx);
+        }
+
+        // (account name, bytes held) of every open account
+        std::vector<std::pair<std::string, int64_t>> usage() {
+            std::vector<std::pair<std::string, int64_t>> usage;
+            pthread_mutex_lock(&m_mtx);
+            for (auto &a : m_accounts) usage.emplace_back(a->name(), a->used());
+            pthread_mutex_unlock(&m_mtx);
+            return usage;
+        }
+    };
+} // end namespace bm
+
+#endif //BMUTILITY_MEMORY_BUDGET_H
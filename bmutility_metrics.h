@@ -0,0 +1,201 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_METRICS_H
+#define BMUTILITY_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include "bmutility_lockfree.h"
+
+// Counters behind WorkQueue::stats() and WorkerPool::workerStats(). Writers only do relaxed atomic
+// adds on their own counters, once per push, pop or batch rather than per element; readers take a
+// snapshot at any time without any lock, the fields of one snapshot may be a few operations apart
+// from each other.
+
+#define BM_LATENCY_HIST_BUCKETS 24
+
+struct LatencyStats {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    // bucket 0 counts 0us, bucket i counts [2^(i-1), 2^i) us, the last bucket everything above
+    uint64_t buckets[BM_LATENCY_HIST_BUCKETS];
+
+    LatencyStats() : count(0), sum_us(0), max_us(0) { memset(buckets, 0, sizeof(buckets)); }
+
+    double mean_us() const { return count > 0 ? (double) sum_us / count : 0; }
+
+    // upper bound of the bucket holding the p-th percentile (0 < p <= 100)
+    uint64_t percentile_us(double p) const {
+        uint64_t target = (uint64_t) (count * p / 100.0 + 0.5), seen = 0;
+        if (target == 0) target = 1;
+        for (int i = 0; i < BM_LATENCY_HIST_BUCKETS - 1; i++) {
+            seen += buckets[i];
+            if (seen >= target) return i == 0 ? 0 : (1ull << i) - 1;
+        }
+        return max_us;
+    }
+};
+
+class LatencyHistogram {
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum_us;
+    std::atomic<uint64_t> m_max_us;
+    std::atomic<uint64_t> m_buckets[BM_LATENCY_HIST_BUCKETS];
+
+public:
+    LatencyHistogram() : m_count(0), m_sum_us(0), m_max_us(0) {
+        for (auto &b : m_buckets) b.store(0, std::memory_order_relaxed);
+    }
+
+    static int bucket_of(uint64_t us) {
+        if (us == 0) return 0;
+        int b = 64 - __builtin_clzll(us);
+        return b < BM_LATENCY_HIST_BUCKETS ? b : BM_LATENCY_HIST_BUCKETS - 1;
+    }
+
+    // n samples of us each, e.g. all elements of one popped batch
+    void add(int64_t us, uint64_t n = 1) {
+        uint64_t v = us > 0 ? (uint64_t) us : 0;
+        m_count.fetch_add(n, std::memory_order_relaxed);
+        m_sum_us.fetch_add(v * n, std::memory_order_relaxed);
+        m_buckets[bucket_of(v)].fetch_add(n, std::memory_order_relaxed);
+        uint64_t max = m_max_us.load(std::memory_order_relaxed);
+        while (v > max && !m_max_us.compare_exchange_weak(max, v, std::memory_order_relaxed)) {}
+    }
+
+    void snapshot(LatencyStats &st) const {
+        st.count = m_count.load(std::memory_order_relaxed);
+        st.sum_us = m_sum_us.load(std::memory_order_relaxed);
+        st.max_us = m_max_us.load(std::memory_order_relaxed);
+        for (int i = 0; i < BM_LATENCY_HIST_BUCKETS; i++) {
+            st.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// Counters are cumulative: rates are the difference of two snapshots over their timestamp_us.
+struct QueueStats {
+    int64_t timestamp_us;   // blocking_queue_now_us() when the snapshot was taken
+    uint64_t push_num;      // elements handed to push(), including the ones dropped on the way in
+    uint64_t pop_num;
+    uint64_t drop_num;      // elements discarded by drop(), drop policies or the drop callback path
+    uint64_t depth;         // push_num - pop_num - drop_num
+    uint64_t high_water;    // largest depth seen by a producer
+    uint64_t push_block_us; // total time producers were parked on a full queue
+    uint64_t pop_wait_us;   // total time consumers were parked waiting for elements
+    LatencyStats time_in_queue; // empty unless WorkQueue::set_latency_metrics is on
+
+    QueueStats() : timestamp_us(0), push_num(0), pop_num(0), drop_num(0), depth(0), high_water(0),
+                   push_block_us(0), pop_wait_us(0) {}
+};
+
+class QueueMetrics {
+    // producer and consumer counters live on different cache lines
+    std::atomic<uint64_t> m_push_num;
+    std::atomic<uint64_t> m_push_block_us;
+    std::atomic<uint64_t> m_high_water;
+    char m_pad0[BM_CACHELINE_SIZE];
+    std::atomic<uint64_t> m_pop_num;
+    std::atomic<uint64_t> m_pop_wait_us;
+    std::atomic<uint64_t> m_drop_num;
+    char m_pad1[BM_CACHELINE_SIZE];
+    LatencyHistogram m_time_in_queue;
+
+public:
+    QueueMetrics() : m_push_num(0), m_push_block_us(0), m_high_water(0), m_pop_num(0), m_pop_wait_us(0),
+                     m_drop_num(0) {}
+
+    // depth: queue size right after the push
+    void on_push(uint64_t num, size_t depth) {
+        m_push_num.fetch_add(num, std::memory_order_relaxed);
+        uint64_t hw = m_high_water.load(std::memory_order_relaxed);
+        while (depth > hw && !m_high_water.compare_exchange_weak(hw, depth, std::memory_order_relaxed)) {}
+    }
+
+    void on_push_block(int64_t us) {
+        if (us > 0) m_push_block_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    // num elements dequeued by one pop
+    void on_pop(uint64_t num) {
+        if (num > 0) m_pop_num.fetch_add(num, std::memory_order_relaxed);
+    }
+
+    // one dequeued element spent us in the queue, only with WorkQueue::set_latency_metrics
+    void on_time_in_queue(int64_t us) {
+        m_time_in_queue.add(us);
+    }
+
+    void on_pop_wait(int64_t us) {
+        if (us > 0) m_pop_wait_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    void on_drop(uint64_t num) {
+        if (num > 0) m_drop_num.fetch_add(num, std::memory_order_relaxed);
+    }
+
+    void snapshot(QueueStats &st) const {
+        st.pop_num = m_pop_num.load(std::memory_order_relaxed);
+        st.drop_num = m_drop_num.load(std::memory_order_relaxed);
+        st.push_num = m_push_num.load(std::memory_order_relaxed);
+        st.depth = st.push_num > st.pop_num + st.drop_num ? st.push_num - st.pop_num - st.drop_num : 0;
+        st.high_water = m_high_water.load(std::memory_order_relaxed);
+        st.push_block_us = m_push_block_us.load(std::memory_order_relaxed);
+        st.pop_wait_us = m_pop_wait_us.load(std::memory_order_relaxed);
+        m_time_in_queue.snapshot(st.time_in_queue);
+    }
+};
+
+struct WorkerStats {
+    uint64_t batch_num;    // callbacks run
+    uint64_t item_num;     // elements passed to the callbacks
+    uint64_t busy_us;      // time spent in the callback
+    uint64_t idle_us;      // time spent waiting for work
+    LatencyStats callback_latency;
+
+    WorkerStats() : batch_num(0), item_num(0), busy_us(0), idle_us(0) {}
+};
+
+// one per worker thread, only written by its owner
+class WorkerMetrics {
+    std::atomic<uint64_t> m_batch_num;
+    std::atomic<uint64_t> m_item_num;
+    std::atomic<uint64_t> m_busy_us;
+    std::atomic<uint64_t> m_idle_us;
+    LatencyHistogram m_callback_latency;
+    char m_pad[BM_CACHELINE_SIZE];
+
+public:
+    WorkerMetrics() : m_batch_num(0), m_item_num(0), m_busy_us(0), m_idle_us(0) {}
+
+    void on_idle(int64_t us) {
+        if (us > 0) m_idle_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    void on_batch(size_t item_num, int64_t us) {
+        m_batch_num.fetch_add(1, std::memory_order_relaxed);
+        m_item_num.fetch_add(item_num, std::memory_order_relaxed);
+        if (us > 0) m_busy_us.fetch_add(us, std::memory_order_relaxed);
+        m_callback_latency.add(us);
+    }
+
+    void snapshot(WorkerStats &st) const {
+        st.batch_num = m_batch_num.load(std::memory_order_relaxed);
+        st.item_num = m_item_num.load(std::memory_order_relaxed);
+        st.busy_us = m_busy_us.load(std::memory_order_relaxed);
+        st.idle_us = m_idle_us.load(std::memory_order_relaxed);
+        m_callback_latency.snapshot(st.callback_latency);
+    }
+};
+
+#endif //BMUTILITY_METRICS_H
@@ -0,0 +1,171 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_MOCK_DELEGATE_H
+#define BMUTILITY_MOCK_DELEGATE_H
+
+#include <unordered_map>
+#include "bmutility_pipeline.h"
+
+namespace bm {
+    // Costs of MockDetectorDelegate: each stage takes *_us per batch plus *_frame_us per frame.
+    struct MockDelegateParam {
+        MockDelegateParam() {
+            preprocess_us = 0;
+            preprocess_frame_us = 1000;
+            forward_us = 5000;
+            forward_frame_us = 500;
+            forward_host_us = 0;
+            postprocess_us = 0;
+            postprocess_frame_us = 500;
+            notify_detected = true;
+            forward_fail_after = -1;
+            forward_fail_num = -1;
+            busy_wait = false;
+            thread_sync = true;
+        }
+
+        int64_t preprocess_us;
+        int64_t preprocess_frame_us;
+        int64_t forward_us;
+        int64_t forward_frame_us;
+        // host side of a forward per batch (input upload, launch), before the batch reaches the device
+        int64_t forward_host_us;
+        int64_t postprocess_us;
+        int64_t postprocess_frame_us;
+        // postprocess invokes the detected callback for every frame; turn it off when the pipe does
+        // it (BMInferencePipe::set_ordered_output)
+        bool notify_detected;
+        // every forward after this many batches fails, like a device that went away; -1 never fails
+        int64_t forward_fail_after;
+        // how many forwards fail from then on, like a device that came back; -1 all of them
+        int64_t forward_fail_num;
+        // host stages spin for their cost instead of sleeping, loading the cores like real
+        // preprocess and postprocess
+        bool busy_wait;
+        // forward_complete waits for every batch the calling thread has submitted, like
+        // bm_thread_sync; false waits for its own batch only, like a per-launch completion event
+        bool thread_sync;
+    };
+
+    // Stand-in for a real detector to test and benchmark pipelines on a plain CPU box. Preprocess
+    // and postprocess sleep (or spin, see busy_wait) for their cost, like a CPU stage that is busy
+    // for that long. Forward runs on a simulated accelerator that executes one batch at a time in
+    // submission order: a submitted batch starts when the previous one is done, and
+    // forward_complete sleeps until the end of the last batch its thread submitted (see
+    // thread_sync). An idle device between two batches therefore shows up as lost throughput, just
+    // like on the TPU.
+    template<typename T1>
+    class MockDetectorDelegate : public AsyncDetectorDelegate<T1> {
+        MockDelegateParam m_param;
+        pthread_mutex_t m_mtx;
+        int64_t m_device_free_us;
+        uint64_t m_device_busy_us;
+        // end time of every submitted batch, keyed by the batch vector
+        std::unordered_map<const void *, int64_t> m_done_us;
+        // end time of the last batch submitted by each thread
+        std::unordered_map<pthread_t, int64_t> m_thread_done_us;
+        std::atomic<uint64_t> m_frame_num;
+        std::atomic<int64_t> m_submit_num;
+
+        static void sleep_until_us(int64_t deadline_us) {
+            struct timespec ts;
+            ts.tv_sec = deadline_us / 1000000;
+            ts.tv_nsec = (deadline_us % 1000000) * 1000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+        }
+
+        static void sleep_us(int64_t us) {
+            if (us > 0) sleep_until_us(blocking_queue_now_us() + us);
+        }
+
+        // cost of a host stage
+        void host_us(int64_t us) {
+            if (!m_param.busy_wait) {
+                sleep_us(us);
+                return;
+            }
+            int64_t deadline_us = blocking_queue_now_us() + us;
+            while (blocking_queue_now_us() < deadline_us) {}
+        }
+
+    public:
+        explicit MockDetectorDelegate(const MockDelegateParam &param = MockDelegateParam())
+                : m_param(param), m_device_free_us(0), m_device_busy_us(0), m_frame_num(0), m_submit_num(0) {
+            pthread_mutex_init(&m_mtx, NULL);
+        }
+
+        ~MockDetectorDelegate() override {
+            pthread_mutex_destroy(&m_mtx);
+        }
+
+        int preprocess(std::vector<T1> &frames) override {
+            host_us(m_param.preprocess_us + m_param.preprocess_frame_us * (int64_t) frames.size());
+            return 0;
+        }
+
+        int forward_submit(std::vector<T1> &frames) override {
+            int64_t batch = m_submit_num.fetch_add(1, std::memory_order_relaxed);
+            if (m_param.forward_fail_after >= 0 && batch >= m_param.forward_fail_after &&
+                (m_param.forward_fail_num < 0 || batch < m_param.forward_fail_after + m_param.forward_fail_num)) {
+                return -1;
+            }
+            host_us(m_param.forward_host_us);
+            int64_t cost = m_param.forward_us + m_param.forward_frame_us * (int64_t) frames.size();
+            pthread_mutex_lock(&m_mtx);
+            int64_t start = std::max(blocking_queue_now_us(), m_device_free_us);
+            m_device_free_us = start + cost;
+            m_device_busy_us += cost;
+            m_done_us[&frames] = m_device_free_us;
+            m_thread_done_us[pthread_self()] = m_device_free_us;
+            pthread_mutex_unlock(&m_mtx);
+            return 0;
+        }
+
+        int forward_complete(std::vector<T1> &frames) override {
+            int64_t done_us = 0;
+            pthread_mutex_lock(&m_mtx);
+            auto it = m_done_us.find(&frames);
+            if (it != m_done_us.end()) {
+                done_us = m_param.thread_sync ? m_thread_done_us[pthread_self()] : it->second;
+                m_done_us.erase(it);
+            }
+            pthread_mutex_unlock(&m_mtx);
+            if (done_us == 0) {
+                std::cerr << "[ERROR] MockDetectorDelegate: batch was not submitted" << std::endl;
+                return -1;
+            }
+            sleep_until_us(done_us);
+            return 0;
+        }
+
+        int postprocess(std::vector<T1> &frames) override {
+            host_us(m_param.postprocess_us + m_param.postprocess_frame_us * (int64_t) frames.size());
+            m_frame_num.fetch_add(frames.size(), std::memory_order_relaxed);
+            if (m_param.notify_detected) {
+                for (auto &frame : frames) this->notify_detected(frame);
+            }
+            return 0;
+        }
+
+        // frames through postprocess so far
+        uint64_t frame_num() const { return m_frame_num.load(std::memory_order_relaxed); }
+
+        // total time the simulated device has been busy; divided by the elapsed time it gives the
+        // device utilization
+        uint64_t device_busy_us() {
+            pthread_mutex_lock(&m_mtx);
+            uint64_t us = m_device_busy_us;
+            pthread_mutex_unlock(&m_mtx);
+            return us;
+        }
+    };
+} // end namespace bm
+
+#endif //BMUTILITY_MOCK_DELEGATE_H
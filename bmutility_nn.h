@@ -447,7 +447,10 @@ namespace bm {
                                                 m_netinfo->output_scales[index], &m_outputTensors[index]);
         }
 
-        int forward() {
+        // forward() without the wait: the network runs on the TPU while the caller goes on, sync()
+        // waits for it. Both have to be called from the same thread. It uses the network's own
+        // tensors, so only one launch may be outstanding per network.
+        int launch() {
             bool user_mem = false; // if false, bmrt will alloc mem every time.
             if (m_outputTensors->device_mem.size != 0) {
                 // if true, bmrt don't alloc mem again.
@@ -460,13 +463,25 @@ namespace bm {
                 std::cout << "bm_launch_tensor() failed=" << std::endl;
                 return -1;
             }
+            return 0;
+        }
 
-            /* wait for inference done */
+        // Waits for everything the calling thread has launched, bm_thread_sync has no way to wait for
+        // one launch alone.
+        int sync() {
             bm_status_t res = (bm_status_t)bm_thread_sync (m_handle);
             if (res != BM_SUCCESS) {
                 std::cout << "bm_thread_sync: Failed to sync: " << m_netinfo->name << " inference" << std::endl;
                 return -1;
             }
+            return 0;
+        }
+
+        int forward() {
+            if (launch() != 0) return -1;
+
+            /* wait for inference done */
+            if (sync() != 0) return -1;
 
 #if 0
             for(int i = 0;i < m_netinfo->output_num; ++i) {
@@ -0,0 +1,193 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_OBJECT_POOL_H
+#define BMUTILITY_OBJECT_POOL_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <pthread.h>
+
+#include "bmutility_lockfree.h"
+
+#define BM_OBJECT_POOL_MAX_THREADS 128
+
+// Index of the calling thread into every ObjectPool's cache array. A slot is handed to the next new
+// thread once its owner exits; threads beyond BM_OBJECT_POOL_MAX_THREADS get -1 and bypass the caches.
+class ObjectPoolThreadSlot {
+    int m_id;
+
+    static pthread_mutex_t &registry_mutex() {
+        static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+        return mtx;
+    }
+
+    static std::vector<int> &free_ids() {
+        static std::vector<int> ids;
+        return ids;
+    }
+
+    static int &next_id() {
+        static int id = 0;
+        return id;
+    }
+
+    ObjectPoolThreadSlot() : m_id(-1) {
+        pthread_mutex_lock(&registry_mutex());
+        if (!free_ids().empty()) {
+            m_id = free_ids().back();
+            free_ids().pop_back();
+        } else if (next_id() < BM_OBJECT_POOL_MAX_THREADS) {
+            m_id = next_id()++;
+        }
+        pthread_mutex_unlock(&registry_mutex());
+    }
+
+public:
+    ~ObjectPoolThreadSlot() {
+        if (m_id < 0) return;
+        pthread_mutex_lock(&registry_mutex());
+        free_ids().push_back(m_id);
+        pthread_mutex_unlock(&registry_mutex());
+    }
+
+    static int current() {
+        static thread_local ObjectPoolThreadSlot slot;
+        return slot.m_id;
+    }
+};
+
+// Thread-caching pool of reusable T objects. Each thread keeps up to cache_size objects that it
+// acquires and releases without any lock; an empty cache refills half of itself from the shared list
+// and a full one spills half of itself there, so the shared lock is taken once per cache_size/2
+// objects even when objects are acquired on one thread (e.g. the decoder) and released on another
+// (e.g. postprocess). Objects are not reset on release. The pool must outlive all its objects.
+//
+// With BMInferencePipe<ObjectPool<Frame>::Ptr> a frame goes back to the pool when the last stage
+// drops it, so steady state allocates no payloads.
+template<typename T>
+class ObjectPool {
+public:
+    struct Releaser {
+        ObjectPool *pool;
+
+        void operator()(T *obj) const { pool->release(obj); }
+    };
+
+    using Ptr = std::unique_ptr<T, Releaser>;
+    using Factory = std::function<T *()>;
+
+private:
+    struct Cache {
+        T **objs;
+        size_t num;
+        char pad[BM_CACHELINE_SIZE];
+    };
+
+    size_t m_cache_size;
+    Factory m_factory;
+    Cache *m_caches;
+    T **m_cache_objs;
+    std::vector<T *> m_shared;
+    pthread_mutex_t m_mtx;
+    std::atomic<size_t> m_created;
+
+    T *create() {
+        m_created.fetch_add(1, std::memory_order_relaxed);
+        return m_factory != nullptr ? m_factory() : new T();
+    }
+
+public:
+    explicit ObjectPool(size_t cache_size = 32, Factory factory = nullptr)
+            : m_cache_size(cache_size > 1 ? cache_size : 2), m_factory(factory), m_created(0) {
+        m_caches = new Cache[BM_OBJECT_POOL_MAX_THREADS];
+        m_cache_objs = new T *[BM_OBJECT_POOL_MAX_THREADS * m_cache_size];
+        for (int i = 0; i < BM_OBJECT_POOL_MAX_THREADS; i++) {
+            m_caches[i].objs = m_cache_objs + i * m_cache_size;
+            m_caches[i].num = 0;
+        }
+        pthread_mutex_init(&m_mtx, NULL);
+    }
+
+    ~ObjectPool() {
+        for (int i = 0; i < BM_OBJECT_POOL_MAX_THREADS; i++) {
+            for (size_t k = 0; k < m_caches[i].num; k++) delete m_caches[i].objs[k];
+        }
+        for (auto obj : m_shared) delete obj;
+        delete[] m_cache_objs;
+        delete[] m_caches;
+        pthread_mutex_destroy(&m_mtx);
+    }
+
+    // creates num objects up front so that the shared list never has to grow in steady state
+    void reserve(size_t num) {
+        pthread_mutex_lock(&m_mtx);
+        m_shared.reserve(m_shared.size() + num + BM_OBJECT_POOL_MAX_THREADS * m_cache_size);
+        for (size_t i = 0; i < num; i++) m_shared.push_back(create());
+        pthread_mutex_unlock(&m_mtx);
+    }
+
+    T *acquire() {
+        int slot = ObjectPoolThreadSlot::current();
+        if (slot >= 0) {
+            Cache &cache = m_caches[slot];
+            if (cache.num == 0) {
+                pthread_mutex_lock(&m_mtx);
+                while (cache.num < m_cache_size / 2 && !m_shared.empty()) {
+                    cache.objs[cache.num++] = m_shared.back();
+                    m_shared.pop_back();
+                }
+                pthread_mutex_unlock(&m_mtx);
+            }
+            if (cache.num > 0) return cache.objs[--cache.num];
+            return create();
+        }
+
+        T *obj = nullptr;
+        pthread_mutex_lock(&m_mtx);
+        if (!m_shared.empty()) {
+            obj = m_shared.back();
+            m_shared.pop_back();
+        }
+        pthread_mutex_unlock(&m_mtx);
+        return obj != nullptr ? obj : create();
+    }
+
+    void release(T *obj) {
+        if (obj == nullptr) return;
+        int slot = ObjectPoolThreadSlot::current();
+        if (slot >= 0) {
+            Cache &cache = m_caches[slot];
+            if (cache.num == m_cache_size) {
+                pthread_mutex_lock(&m_mtx);
+                while (cache.num > m_cache_size / 2) {
+                    m_shared.push_back(cache.objs[--cache.num]);
+                }
+                pthread_mutex_unlock(&m_mtx);
+            }
+            cache.objs[cache.num++] = obj;
+            return;
+        }
+
+        pthread_mutex_lock(&m_mtx);
+        m_shared.push_back(obj);
+        pthread_mutex_unlock(&m_mtx);
+    }
+
+    Ptr make() {
+        return Ptr(acquire(), Releaser{this});
+    }
+
+    // objects created so far, a pool that stops growing has reached its steady state
+    size_t created() const { return m_created.load(std::memory_order_relaxed); }
+};
+
+#endif //BMUTILITY_OBJECT_POOL_H
@@ -12,8 +12,242 @@
 
 #include <memory>
 #include "bmutility_thread_queue.h"
+#include "bmutility_reorder.h"
+#include "bmutility_memory_budget.h"
+
+// push_frame status when the pipeline has no credit left for a new frame
+#define BM_INFER_PIPE_BUSY 1
+// FrameScheduler::push_frame status for a frame that was not sent to the pipe
+#define BM_INFER_PIPE_SKIPPED 2
+// preprocess batch deadline a pipe with a memory budget uses when none is set
+#define BM_INFER_PIPE_BUDGET_BATCH_DELAY_US 10000
 
 namespace bm {
+    // Counting semaphore for end-to-end flow control. The fast path is one CAS; the mutex is only
+    // taken to park when no credit is left, using the same waiter-count handshake as the ring queues.
+    class CreditGate {
+        std::atomic<int> m_credits;
+        std::atomic<int> m_waiters;
+        std::atomic<bool> m_stop;
+        pthread_mutex_t m_mtx;
+        pthread_cond_t m_condv;
+
+    public:
+        CreditGate() : m_credits(0), m_waiters(0), m_stop(false) {
+            pthread_mutex_init(&m_mtx, NULL);
+            blocking_queue_cond_init(&m_condv);
+        }
+
+        ~CreditGate() {
+            pthread_cond_destroy(&m_condv);
+            pthread_mutex_destroy(&m_mtx);
+        }
+
+        void reset(int credits) {
+            m_credits = credits;
+            m_stop = false;
+        }
+
+        bool try_acquire() {
+            int c = m_credits.load(std::memory_order_relaxed);
+            while (c > 0) {
+                if (m_credits.compare_exchange_weak(c, c - 1, std::memory_order_acquire)) return true;
+            }
+            return false;
+        }
+
+        // waits until deadline_us (blocking_queue_now_us() clock), 0 on success, -1 on timeout or stop
+        int acquire(int64_t deadline_us) {
+            while (!try_acquire()) {
+                if (m_stop || (deadline_us != BLOCKING_QUEUE_NO_DEADLINE && blocking_queue_now_us() >= deadline_us)) {
+                    return -1;
+                }
+                pthread_mutex_lock(&m_mtx);
+                m_waiters.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (m_credits.load(std::memory_order_relaxed) <= 0 && !m_stop) {
+                    blocking_queue_cond_wait(&m_condv, &m_mtx, deadline_us);
+                }
+                m_waiters.fetch_sub(1);
+                pthread_mutex_unlock(&m_mtx);
+            }
+            return 0;
+        }
+
+        void release(int num) {
+            m_credits.fetch_add(num, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_waiters.load(std::memory_order_relaxed) > 0) {
+                pthread_mutex_lock(&m_mtx);
+                pthread_cond_broadcast(&m_condv);
+                pthread_mutex_unlock(&m_mtx);
+            }
+        }
+
+        void stop() {
+            pthread_mutex_lock(&m_mtx);
+            m_stop = true;
+            pthread_cond_broadcast(&m_condv);
+            pthread_mutex_unlock(&m_mtx);
+        }
+
+        int available() const { return m_credits.load(std::memory_order_relaxed); }
+    };
+
+    // Lets drain() wait for the work admitted before it while holding new work back. Producers
+    // bracket every admission with enter()/leave(), which costs two atomic adds outside a drain.
+    class DrainBarrier {
+        std::atomic<int> m_admitting;
+        std::atomic<bool> m_draining;
+        std::atomic<bool> m_closing;
+        pthread_mutex_t m_mtx;
+        pthread_cond_t m_condv;
+
+    public:
+        DrainBarrier() : m_admitting(0), m_draining(false), m_closing(false) {
+            pthread_mutex_init(&m_mtx, NULL);
+            blocking_queue_cond_init(&m_condv);
+        }
+
+        ~DrainBarrier() {
+            pthread_cond_destroy(&m_condv);
+            pthread_mutex_destroy(&m_mtx);
+        }
+
+        // Waits up to deadline_us while a drain is in progress (0: don't wait). Returns 0 once
+        // admitted, the caller then has to call leave(); BM_INFER_PIPE_BUSY otherwise.
+        int enter(int64_t deadline_us) {
+            while (true) {
+                m_admitting.fetch_add(1);
+                if (!m_draining) return 0;
+                leave();
+
+                if (deadline_us == 0) return BM_INFER_PIPE_BUSY;
+                int ret = 0;
+                pthread_mutex_lock(&m_mtx);
+                while (m_draining && ret != ETIMEDOUT) {
+                    ret = blocking_queue_cond_wait(&m_condv, &m_mtx, deadline_us);
+                }
+                pthread_mutex_unlock(&m_mtx);
+                if (ret == ETIMEDOUT && m_draining) return BM_INFER_PIPE_BUSY;
+            }
+        }
+
+        void leave() {
+            m_admitting.fetch_sub(1);
+            notify();
+        }
+
+        // Call after any progress a drain may be waiting for; a single load unless draining.
+        void notify() {
+            if (m_draining || m_closing) {
+                pthread_mutex_lock(&m_mtx);
+                pthread_cond_broadcast(&m_condv);
+                pthread_mutex_unlock(&m_mtx);
+            }
+        }
+
+        // false if a drain is already in progress
+        bool begin() {
+            bool expected = false;
+            return m_draining.compare_exchange_strong(expected, true);
+        }
+
+        // Between begin() and end(): waits until deadline_us for done() to hold, false on timeout.
+        // done() is evaluated under the barrier's mutex after every notify().
+        template<typename Pred>
+        bool wait(Pred done, int64_t deadline_us) {
+            int ret = 0;
+            pthread_mutex_lock(&m_mtx);
+            while (!done() && ret != ETIMEDOUT) {
+                ret = blocking_queue_cond_wait(&m_condv, &m_mtx, deadline_us);
+            }
+            bool ok = done();
+            pthread_mutex_unlock(&m_mtx);
+            return ok;
+        }
+
+        // admissions in flight, 0 means every admitted item has been handed to the first stage
+        int admitting() const { return m_admitting; }
+
+        bool draining() const { return m_draining; }
+
+        // For stop(), once the caller's stop flag is set: waits until the admissions in flight have
+        // left. Producers re-check that flag after enter(), so nothing is admitted afterwards.
+        void close() {
+            m_closing = true;
+            wait([this] { return m_admitting == 0; }, BLOCKING_QUEUE_NO_DEADLINE);
+        }
+
+        void end() {
+            pthread_mutex_lock(&m_mtx);
+            m_draining = false;
+            pthread_cond_broadcast(&m_condv);
+            pthread_mutex_unlock(&m_mtx);
+        }
+    };
+
+    // create_work_queue for a hop between pipeline stages: BLOCKING_QUEUE_SPSC is only honoured with
+    // one producer and one consumer thread, otherwise it falls back to BLOCKING_QUEUE_RING.
+    // producer_num 0 stands for callers on any number of threads, e.g. push_frame.
+    template<typename T>
+    std::shared_ptr<WorkQueue<T>> create_stage_queue(const std::string &name, int type, int limit,
+                                                     int producer_num, int consumer_num) {
+        if (type == BLOCKING_QUEUE_SPSC && (producer_num != 1 || consumer_num != 1)) {
+            std::cout << "WARNING: " << name << " is not a single producer, single consumer thread hop"
+                      << ", use ring queue instead of spsc" << std::endl;
+            type = BLOCKING_QUEUE_RING;
+        }
+        return create_work_queue<T>(name, type, limit);
+    }
+
+    enum PipeStage {
+        PIPE_STAGE_PREPROCESS = 0,
+        PIPE_STAGE_INFERENCE = 1,
+        PIPE_STAGE_POSTPROCESS = 2,
+        PIPE_STAGE_NUM = 3,
+    };
+
+    // frames of one stream dropped for being past their deadline, by the stage that found them
+    struct ExpiryStats {
+        uint64_t expired[PIPE_STAGE_NUM];
+
+        ExpiryStats() { memset(expired, 0, sizeof(expired)); }
+
+        uint64_t total() const { return expired[0] + expired[1] + expired[2]; }
+    };
+
+    // bytes of the frames a pipe holds by the stage they are in, see BMInferencePipe::set_memory_budget
+    struct MemoryUsage {
+        int64_t stage_bytes[PIPE_STAGE_NUM];
+        uint64_t refused; // frames push_frame turned away for lack of memory
+
+        MemoryUsage() : refused(0) { memset(stage_bytes, 0, sizeof(stage_bytes)); }
+
+        int64_t total() const { return stage_bytes[0] + stage_bytes[1] + stage_bytes[2]; }
+    };
+
+    // how BMInferencePipe picks the forward replica of a batch, see add_forward_replica()
+    enum ReplicaBalance {
+        // fewest frames dispatched and not forwarded yet
+        REPLICA_BALANCE_LEAST_OUTSTANDING = 0,
+        // earliest expected finish: outstanding frames times the EWMA of the forward time per frame
+        REPLICA_BALANCE_EWMA_LATENCY = 1,
+    };
+
+    struct ReplicaStats {
+        ReplicaStats() : batch_num(0), frame_num(0), error_num(0), drop_num(0), outstanding(0), frame_us(0),
+                         healthy(true) {}
+
+        uint64_t batch_num;  // batches forwarded
+        uint64_t frame_num;  // frames forwarded
+        uint64_t error_num;  // failed forward calls
+        uint64_t drop_num;   // frames of its failed batches no other replica had room for
+        int64_t outstanding; // frames dispatched and not forwarded yet
+        int64_t frame_us;    // EWMA of the forward time per frame
+        bool healthy;        // in rotation, or back in it once its cool-down is over
+    };
+
     // declare before
     template<typename T> class BMInferencePipe;
 
@@ -33,9 +267,38 @@ namespace bm {
         virtual int postprocess(std::vector<T1> &frames) = 0;
 
         virtual int set_detected_callback(DetectedFinishFunc func) { m_pfnDetectFinish = func; return 0;};
+
+        void notify_detected(T1 &frame) {
+            if (m_pfnDetectFinish != nullptr) m_pfnDetectFinish(frame);
+        }
         void set_next_inference_pipe(BMInferencePipe<T1> *nextPipe) { m_nextInferPipe = nextPipe; }
     };
 
+    // DetectorDelegate whose forward is split into submission and completion, so that the pipe can
+    // keep up to DetectorParam::inference_inflight_batches batches on the accelerator while the
+    // forward worker hands results on and gathers the next batch. Both calls for a batch run on the
+    // same worker thread, and the batches of a worker complete in the order they were submitted.
+    //
+    // On the TPU completion is bm_thread_sync (BMNNNetwork::sync), which waits for every launch of
+    // the calling thread: completing the oldest batch also waits for the ones submitted after it,
+    // and the device idles while the worker gathers and launches the next batch, as with a single
+    // batch in flight. Depths above 1 only pay off with a delegate that can wait for one launch
+    // alone; see MockDelegateParam::thread_sync to compare both.
+    template<typename T1>
+    class AsyncDetectorDelegate : public DetectorDelegate<T1> {
+    public:
+        virtual int forward_submit(std::vector<T1> &frames) = 0;
+
+        // waits for the oldest batch submitted by this thread
+        virtual int forward_complete(std::vector<T1> &frames) = 0;
+
+        int forward(std::vector<T1> &frames) override {
+            int ret = forward_submit(frames);
+            if (ret != 0) return ret;
+            return forward_complete(frames);
+        }
+    };
+
     struct DetectorParam {
         DetectorParam() {
             preprocess_queue_size = 5;
@@ -47,6 +310,30 @@ namespace bm {
             postprocess_queue_size = 5;
             postprocess_thread_num = 2;
             batch_num=4;
+
+            preprocess_queue_type = BLOCKING_QUEUE_STD_QUEUE;
+            inference_queue_type = BLOCKING_QUEUE_STD_QUEUE;
+            postprocess_queue_type = BLOCKING_QUEUE_STD_QUEUE;
+
+            preprocess_work_stealing = 0;
+            inference_work_stealing = 0;
+            postprocess_work_stealing = 0;
+
+            preprocess_batch_delay_us = 0;
+            inference_batch_delay_us = 0;
+            postprocess_batch_delay_us = 0;
+
+            max_inflight_frames = 0;
+
+            preprocess_max_thread_num = 0;
+            inference_max_thread_num = 0;
+            postprocess_max_thread_num = 0;
+
+            preprocess_wait_profile = WAIT_PROFILE_LOW_CPU;
+            inference_wait_profile = WAIT_PROFILE_LOW_CPU;
+            postprocess_wait_profile = WAIT_PROFILE_LOW_CPU;
+
+            inference_inflight_batches = 1;
         }
 
         int preprocess_queue_size;
@@ -59,73 +346,857 @@ namespace bm {
         int postprocess_thread_num;
         int batch_num;
 
+        // BlockingQueueType of each stage's input queue. BLOCKING_QUEUE_SPSC is only honoured when the
+        // hop has one producer and one consumer thread, otherwise it falls back to BLOCKING_QUEUE_RING.
+        // push_frame counts as several producers unless BMInferencePipe::set_single_producer is set.
+        int preprocess_queue_type;
+        int inference_queue_type;
+        int postprocess_queue_type;
+
+        // WorkerPool::setWorkStealing chunk of each stage, 0 keeps the single shared queue
+        int preprocess_work_stealing;
+        int inference_work_stealing;
+        int postprocess_work_stealing;
+
+        // Adaptive batching deadline of each stage (WorkerPool::setBatchDeadline): a stage takes a
+        // partial batch once its oldest queued frame has waited this long. 0 waits for a full batch.
+        int64_t preprocess_batch_delay_us;
+        int64_t inference_batch_delay_us;
+        int64_t postprocess_batch_delay_us;
+
+        // Credit budget of the whole pipe: push_frame takes one credit per frame and postprocess gives
+        // it back, so at most this many frames are between push_frame and the end of postprocess. Keep
+        // it at or below the smallest queue size so that no stage ever blocks on a full queue, and at
+        // least batch_num unless preprocess_batch_delay_us is set. 0 disables the budget.
+        int max_inflight_frames;
+
+        // Autoscaling upper bound of each stage (WorkerPool::setAutoScale): the stage starts with
+        // *_thread_num workers, never goes below that, and grows up to this many under load.
+        // 0 (or anything not above *_thread_num) keeps the thread count fixed.
+        int preprocess_max_thread_num;
+        int inference_max_thread_num;
+        int postprocess_max_thread_num;
+
+        // CPU placement of each stage's workers (WorkerPool::setPlacement), CPU_PLACE_NONE by default
+        CpuPlacement preprocess_placement;
+        CpuPlacement inference_placement;
+        CpuPlacement postprocess_placement;
+
+        // WaitProfile of each stage's input queue: WAIT_PROFILE_LOW_LATENCY spins briefly before
+        // parking a waiting worker or producer, trading CPU for wakeup latency on short hops.
+        int preprocess_wait_profile;
+        int inference_wait_profile;
+        int postprocess_wait_profile;
+
+        // Batches each inference worker keeps submitted at once with an AsyncDetectorDelegate; a
+        // batch goes on to postprocess when it completes. 1 runs forward synchronously. See
+        // AsyncDetectorDelegate for why more than 1 doesn't help with bm_thread_sync.
+        int inference_inflight_batches;
     };
 
     template<typename T1>
     class BMInferencePipe {
+    public:
+        using StreamKeyFunc = std::function<int(const T1 &frame)>;
+        using SeqFunc = std::function<int64_t(const T1 &frame)>;
+        // reference to the frame's deadline field, blocking_queue_now_us() clock
+        using DeadlineFunc = std::function<int64_t &(T1 &frame)>;
+        // stage is a PipeStage
+        using DropFunc = std::function<void(T1 &frame, int stage)>;
+        // bytes a frame holds
+        using CostFunc = std::function<int64_t(const T1 &frame)>;
+        // id of a frame in a trace, e.g. stream id << 32 | frame number
+        using TraceIdFunc = std::function<uint64_t(const T1 &frame)>;
+
+    private:
         DetectorParam m_param;
         std::shared_ptr<DetectorDelegate<T1>> m_detect_delegate;
+        StreamKeyFunc m_stream_key_func = nullptr;
+        std::unordered_map<int, int> m_stream_weights;
+        std::shared_ptr<FairQueue<T1>> m_fairQue;
+        CreditGate m_credits;
+
+        StreamKeyFunc m_order_key_func = nullptr;
+        SeqFunc m_order_seq_func = nullptr;
+        int m_order_window = 0;
+        long m_order_timeout_ms = 0;
+        std::shared_ptr<ReorderBuffer<T1>> m_reorder;
+
+        // frames are counted in by push_frame and out by postprocess, see drain()
+        DrainBarrier m_drain;
+        std::atomic<uint64_t> m_admitted;
+        std::atomic<uint64_t> m_completed;
+        std::atomic<uint64_t> m_shed;
+        std::atomic<bool> m_stopped;
 
-        std::shared_ptr<BlockingQueue<T1>> m_preprocessQue;
-        std::shared_ptr<BlockingQueue<T1>> m_postprocessQue;
-        std::shared_ptr<BlockingQueue<T1>> m_forwardQue;
+        std::shared_ptr<WorkQueue<T1>> m_preprocessQue;
+        std::shared_ptr<WorkQueue<T1>> m_postprocessQue;
 
         WorkerPool<T1> m_preprocessWorkerPool;
-        WorkerPool<T1> m_forwardWorkerPool;
         WorkerPool<T1> m_postprocessWorkerPool;
 
+        // batches submitted by one inference worker and not completed yet, oldest at head
+        struct InflightRing {
+            std::vector<std::vector<T1>> batches;
+            std::vector<int64_t> submit_us;
+            size_t head = 0;
+            size_t num = 0;
+        };
 
-    public:
-        BMInferencePipe() {
+        // A model instance with its own inference queue and workers. The frames of a batch count
+        // as outstanding from dispatch() until their forward is over.
+        struct Replica {
+            std::shared_ptr<DetectorDelegate<T1>> delegate;
+            // set when the replica keeps several batches in flight
+            std::shared_ptr<AsyncDetectorDelegate<T1>> async_delegate;
+            CpuPlacement placement;
+            std::shared_ptr<WorkQueue<T1>> queue;
+            WorkerPool<T1> pool;
+            std::vector<InflightRing> inflight;
+            std::atomic<int64_t> outstanding{0};
+            std::atomic<int64_t> frame_us{0};
+            std::atomic<bool> healthy{true};
+            // when a retired replica goes back into rotation, and its failures in a row
+            std::atomic<int64_t> retry_us{0};
+            std::atomic<int> fail_streak{0};
+            std::atomic<uint64_t> batch_num{0};
+            std::atomic<uint64_t> frame_num{0};
+            std::atomic<uint64_t> error_num{0};
+            std::atomic<uint64_t> drop_num{0};
+            int trace_track = 0;
+        };
+        // replica 0 is the delegate given to init()
+        std::vector<std::unique_ptr<Replica>> m_replicas;
+        std::atomic<int> m_healthy_num;
+        int m_balance = REPLICA_BALANCE_LEAST_OUTSTANDING;
+        // guards replicas leaving and rejoining the rotation, and redispatch() against stop()
+        pthread_mutex_t m_replica_mtx;
+        bool m_redispatch_closed = false;
+        int64_t m_replica_cooldown_us = 1000000;
+
+        // push_frame is only called from one thread, see set_single_producer()
+        bool m_single_producer = false;
+
+        // load shedding, see set_frame_deadline()
+        DeadlineFunc m_deadline_func = nullptr;
+        int64_t m_latency_budget_us = 0;
+        StreamKeyFunc m_expiry_key_func = nullptr;
+        std::unordered_map<int, int64_t> m_stream_budgets;
+        DropFunc m_drop_func = nullptr;
+        pthread_mutex_t m_expiry_mtx;
+        std::unordered_map<int, ExpiryStats> m_expiry;
+
+        // memory accounting, see set_memory_budget()
+        MemoryBudget *m_budget = nullptr;
+        MemoryBudget::Account *m_account = nullptr;
+        CostFunc m_cost_func = nullptr;
+        int m_memory_policy = MEMORY_POLICY_BLOCK;
+        std::atomic<int64_t> m_stage_bytes[PIPE_STAGE_NUM];
+        std::atomic<uint64_t> m_memory_refused;
+
+        // tracing, see set_tracer()
+        Tracer *m_tracer = nullptr;
+        TraceIdFunc m_trace_id_func = nullptr;
+        int m_trace_tracks[PIPE_STAGE_NUM];
+
+        void trace_enqueue(int track, const std::vector<T1> &items) {
+            if (m_tracer == nullptr || !m_tracer->enabled()) return;
+            int64_t now = blocking_queue_now_us();
+            for (auto &frame : items) {
+                uint64_t id = m_trace_id_func(frame);
+                if (m_tracer->sampled(id)) m_tracer->record(track, TRACE_ENQUEUE, id, now);
+            }
+        }
+
+        int64_t frames_bytes(const std::vector<T1> &items) const {
+            if (m_cost_func == nullptr) return 0;
+            int64_t bytes = 0;
+            for (auto &frame : items) bytes += m_cost_func(frame);
+            return bytes;
+        }
 
+        // moves bytes from stage from on to stage to; PIPE_STAGE_NUM gives them back to the budget
+        void move_bytes(int64_t bytes, int from, int to) {
+            if (m_cost_func == nullptr || bytes == 0) return;
+            m_stage_bytes[from].fetch_sub(bytes, std::memory_order_relaxed);
+            if (to < PIPE_STAGE_NUM) {
+                m_stage_bytes[to].fetch_add(bytes, std::memory_order_relaxed);
+            } else {
+                m_budget->release(m_account, bytes);
+            }
+        }
+
+        // Takes the frames past their deadline out of items before stage works on them. They count
+        // as completed for credits and drain().
+        void shed_expired(std::vector<T1> &items, int stage) {
+            if (m_deadline_func == nullptr) return;
+            int64_t now = blocking_queue_now_us();
+            size_t keep = 0;
+            int64_t bytes = 0;
+            for (size_t i = 0; i < items.size(); i++) {
+                if (m_deadline_func(items[i]) > now) {
+                    if (keep != i) items[keep] = std::move(items[i]);
+                    keep++;
+                    continue;
+                }
+                if (m_cost_func != nullptr) bytes += m_cost_func(items[i]);
+                int key = m_expiry_key_func != nullptr ? m_expiry_key_func(items[i]) : 0;
+                pthread_mutex_lock(&m_expiry_mtx);
+                m_expiry[key].expired[stage]++;
+                pthread_mutex_unlock(&m_expiry_mtx);
+                if (m_reorder) m_reorder->drop(items[i]);
+                if (m_drop_func != nullptr) m_drop_func(items[i], stage);
+            }
+            size_t num = items.size() - keep;
+            if (num == 0) return;
+            items.erase(items.begin() + keep, items.end());
+            m_shed.fetch_add(num);
+            release_frames(num, bytes, stage);
+        }
+
+        // num frames holding bytes leave the pipe at stage without reaching postprocess
+        void release_frames(size_t num, int64_t bytes, int stage) {
+            if (m_param.max_inflight_frames > 0) m_credits.release(num);
+            move_bytes(bytes, stage, PIPE_STAGE_NUM);
+            m_completed.fetch_add(num);
+            m_drain.notify();
+        }
+
+        // Puts retired replicas whose cool-down is over back into rotation; their next batch is the
+        // probe, a failure retires them again for twice as long.
+        void readmit_replicas() {
+            if (m_replica_cooldown_us < 0) return;
+            int64_t now = blocking_queue_now_us();
+            for (size_t i = 0; i < m_replicas.size(); i++) {
+                Replica &r = *m_replicas[i];
+                if (r.healthy.load(std::memory_order_relaxed) || now < r.retry_us.load(std::memory_order_relaxed)) {
+                    continue;
+                }
+                pthread_mutex_lock(&m_replica_mtx);
+                bool back = !r.healthy && now >= r.retry_us;
+                if (back) {
+                    r.healthy = true;
+                    m_healthy_num.fetch_add(1);
+                }
+                pthread_mutex_unlock(&m_replica_mtx);
+                if (back) std::cout << "WARNING: BMInferencePipe: replica " << i << " back in rotation" << std::endl;
+            }
+        }
+
+        int64_t replica_cost(const Replica &r, size_t frame_num) const {
+            int64_t cost = r.outstanding.load(std::memory_order_relaxed) + (int64_t) frame_num;
+            if (m_balance == REPLICA_BALANCE_EWMA_LATENCY) {
+                cost *= std::max<int64_t>(r.frame_us.load(std::memory_order_relaxed), 1);
+            }
+            return cost;
+        }
+
+        // least loaded replica in rotation for a batch of frame_num frames
+        Replica *pick_replica(size_t frame_num) {
+            if (m_healthy_num.load(std::memory_order_relaxed) < (int) m_replicas.size()) readmit_replicas();
+            Replica *best = nullptr;
+            int64_t best_cost = INT64_MAX;
+            for (auto &r : m_replicas) {
+                if (!r->healthy.load(std::memory_order_relaxed)) continue;
+                int64_t cost = replica_cost(*r, frame_num);
+                if (cost < best_cost) {
+                    best = r.get();
+                    best_cost = cost;
+                }
+            }
+            return best != nullptr ? best : m_replicas[0].get();
+        }
+
+        void dispatch(std::vector<T1> &items) {
+            Replica *r = m_replicas.size() == 1 ? m_replicas[0].get() : pick_replica(items.size());
+            r->outstanding.fetch_add(items.size(), std::memory_order_relaxed);
+            trace_enqueue(r->trace_track, items);
+            r->queue->push(items);
+        }
+
+        // Hands the frames of a batch replica from can't forward to the other replicas in rotation,
+        // least loaded first. It runs on an inference worker, so it never waits for room: two failing
+        // replicas would block on each other's full queues. Frames no replica takes, also those of
+        // a batch failing while stop() takes the replicas down, are dropped.
+        void redispatch(Replica &from, std::vector<T1> &items) {
+            pthread_mutex_lock(&m_replica_mtx);
+            if (!m_redispatch_closed) {
+                std::vector<Replica *> order;
+                for (auto &r : m_replicas) {
+                    if (r.get() != &from && r->healthy.load(std::memory_order_relaxed)) order.push_back(r.get());
+                }
+                size_t num = items.size();
+                std::sort(order.begin(), order.end(), [this, num](const Replica *a, const Replica *b) {
+                    return replica_cost(*a, num) < replica_cost(*b, num);
+                });
+                for (size_t i = 0; i < order.size() && !items.empty(); i++) {
+                    Replica *r = order[i];
+                    r->outstanding.fetch_add(items.size(), std::memory_order_relaxed);
+                    trace_enqueue(r->trace_track, items);
+                    // a stopped or full queue leaves the frames in items for the next replica
+                    r->queue->try_push(items);
+                    r->outstanding.fetch_sub(items.size(), std::memory_order_relaxed);
+                }
+            }
+            pthread_mutex_unlock(&m_replica_mtx);
+            if (items.empty()) return;
+
+            int64_t bytes = frames_bytes(items);
+            for (auto &frame : items) {
+                if (m_reorder) m_reorder->drop(frame);
+                if (m_drop_func != nullptr) m_drop_func(frame, PIPE_STAGE_INFERENCE);
+            }
+            from.drop_num.fetch_add(items.size(), std::memory_order_relaxed);
+            release_frames(items.size(), bytes, PIPE_STAGE_INFERENCE);
+            items.clear();
+        }
+
+        // Takes a failed replica out of rotation for its cool-down, unless it is the last one: then
+        // the pipe carries on as with a single delegate whose forward failed.
+        bool retire(Replica &r) {
+            pthread_mutex_lock(&m_replica_mtx);
+            if (!r.healthy) {
+                pthread_mutex_unlock(&m_replica_mtx);
+                return true;
+            }
+            if (m_healthy_num == 1) {
+                pthread_mutex_unlock(&m_replica_mtx);
+                return false;
+            }
+            int streak = r.fail_streak.fetch_add(1);
+            int64_t cooldown_us = m_replica_cooldown_us << std::min(streak, 6);
+            r.retry_us = m_replica_cooldown_us < 0 ? INT64_MAX : blocking_queue_now_us() + cooldown_us;
+            r.healthy = false;
+            m_healthy_num.fetch_sub(1);
+            pthread_mutex_unlock(&m_replica_mtx);
+
+            size_t index = 0;
+            while (m_replicas[index].get() != &r) index++;
+            std::cerr << "[ERROR] BMInferencePipe: forward of replica " << index << " failed, removed from rotation";
+            if (m_replica_cooldown_us >= 0) std::cerr << " for " << cooldown_us / 1000 << " ms";
+            std::cerr << std::endl;
+            return true;
+        }
+
+        // Sheds the expired frames of a batch the replica popped, and hands the batch to another
+        // replica when this one is out of rotation. false when nothing is left for the replica.
+        bool take_batch(Replica &r, std::vector<T1> &items) {
+            size_t num = items.size();
+            shed_expired(items, PIPE_STAGE_INFERENCE);
+            r.outstanding.fetch_sub(num - items.size(), std::memory_order_relaxed);
+            if (items.empty()) return false;
+            if (!r.healthy.load(std::memory_order_relaxed)) {
+                r.outstanding.fetch_sub(items.size(), std::memory_order_relaxed);
+                redispatch(r, items);
+                return false;
+            }
+            return true;
+        }
+
+        // ret is what the forward of the batch returned
+        void forward_done(Replica &r, std::vector<T1> &items, int ret, int64_t start_us) {
+            r.outstanding.fetch_sub(items.size(), std::memory_order_relaxed);
+            if (ret != 0) {
+                r.error_num.fetch_add(1, std::memory_order_relaxed);
+                if (retire(r)) {
+                    redispatch(r, items);
+                    return;
+                }
+            }
+            if (r.fail_streak.load(std::memory_order_relaxed) != 0) r.fail_streak.store(0, std::memory_order_relaxed);
+            int64_t us = (blocking_queue_now_us() - start_us) / (int64_t) items.size();
+            int64_t ewma = r.frame_us.load(std::memory_order_relaxed);
+            r.frame_us.store(ewma == 0 ? us : ewma + (us - ewma) / 8, std::memory_order_relaxed);
+            r.batch_num.fetch_add(1, std::memory_order_relaxed);
+            r.frame_num.fetch_add(items.size(), std::memory_order_relaxed);
+            move_bytes(frames_bytes(items), PIPE_STAGE_INFERENCE, PIPE_STAGE_POSTPROCESS);
+            trace_enqueue(m_trace_tracks[PIPE_STAGE_POSTPROCESS], items);
+            m_postprocessQue->push(items);
+        }
+
+        void complete_oldest(Replica &r, InflightRing &ring) {
+            std::vector<T1> &batch = ring.batches[ring.head];
+            int ret = r.async_delegate->forward_complete(batch);
+            forward_done(r, batch, ret, ring.submit_us[ring.head]);
+            batch.clear();
+            ring.head = (ring.head + 1) % ring.batches.size();
+            ring.num--;
+        }
+
+        // the batch is moved into a ring slot, whose buffer keeps its capacity across batches
+        void submit_batch(Replica &r, std::vector<T1> &items) {
+            if (!take_batch(r, items)) return;
+            InflightRing &ring = r.inflight[WorkerPool<T1>::workerIndex()];
+            size_t slot = (ring.head + ring.num) % ring.batches.size();
+            std::vector<T1> &batch = ring.batches[slot];
+            batch.insert(batch.end(), std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()));
+            ring.submit_us[slot] = blocking_queue_now_us();
+            if (r.async_delegate->forward_submit(batch) != 0) {
+                // never reached the device, so not part of the ring
+                forward_done(r, batch, -1, ring.submit_us[slot]);
+                batch.clear();
+                return;
+            }
+            ring.num++;
+            while (ring.num > (size_t) m_param.inference_inflight_batches) complete_oldest(r, ring);
+        }
+
+        int start_replica(Replica &r, const DetectorParam &param, int producer_num) {
+            int inference_thread_max = std::max(param.inference_thread_num, param.inference_max_thread_num);
+            r.queue = create_stage_queue<T1>("inference", param.inference_queue_type, param.inference_queue_size,
+                                             producer_num, inference_thread_max);
+            r.queue->set_wait_profile(param.inference_wait_profile);
+            r.pool.init(r.queue.get(), param.inference_thread_num, 1, 8);
+            r.pool.setWorkStealing(param.inference_work_stealing);
+            r.pool.setBatchDeadline(param.inference_batch_delay_us);
+            set_auto_scale(r.pool, param.inference_thread_num, param.inference_max_thread_num);
+            r.pool.setPlacement(r.placement);
+            if (m_tracer != nullptr) r.pool.setTracer(m_tracer, r.trace_track, m_trace_id_func);
+
+            r.async_delegate = std::dynamic_pointer_cast<AsyncDetectorDelegate<T1>>(r.delegate);
+            if (r.async_delegate && param.inference_inflight_batches > 1) {
+                Replica *pr = &r;
+                r.inflight.clear();
+                r.inflight.resize(inference_thread_max);
+                for (auto &ring : r.inflight) {
+                    ring.batches.resize(param.inference_inflight_batches + 1);
+                    ring.submit_us.resize(param.inference_inflight_batches + 1);
+                }
+                r.pool.setIdleCallback([this, pr](int index) {
+                    while (pr->inflight[index].num > 0) complete_oldest(*pr, pr->inflight[index]);
+                });
+                return r.pool.startWork([this, pr](std::vector<T1> &items) {
+                    submit_batch(*pr, items);
+                });
+            }
+            r.async_delegate.reset();
+            Replica *pr = &r;
+            return r.pool.startWork([this, pr](std::vector<T1> &items) {
+                if (!take_batch(*pr, items)) return;
+                int64_t start_us = blocking_queue_now_us();
+                int ret = pr->delegate->forward(items);
+                forward_done(*pr, items, ret, start_us);
+            });
+        }
+
+        static void set_auto_scale(WorkerPool<T1> &pool, int thread_num, int max_thread_num) {
+            if (max_thread_num > thread_num) {
+                pool.setAutoScale(thread_num, max_thread_num);
+            }
+        }
+
+        int push_admitted(T1 *frame, int64_t deadline_us) {
+            if (m_stopped) return -1;
+            if (m_deadline_func != nullptr) {
+                int64_t budget_us = m_latency_budget_us;
+                if (!m_stream_budgets.empty() && m_expiry_key_func != nullptr) {
+                    auto it = m_stream_budgets.find(m_expiry_key_func(*frame));
+                    if (it != m_stream_budgets.end()) budget_us = it->second;
+                }
+                m_deadline_func(*frame) = budget_us > 0 ? blocking_queue_now_us() + budget_us : BLOCKING_QUEUE_NO_DEADLINE;
+            }
+            int ret = m_drain.enter(deadline_us);
+            if (ret != 0) return ret;
+            // stop() may have come in between, it waits for the admissions that got past this point
+            if (m_stopped) {
+                m_drain.leave();
+                return -1;
+            }
+            if (m_param.max_inflight_frames > 0) {
+                bool ok = deadline_us == 0 ? m_credits.try_acquire() : m_credits.acquire(deadline_us) == 0;
+                if (!ok) {
+                    m_drain.leave();
+                    return BM_INFER_PIPE_BUSY;
+                }
+            }
+            if (m_cost_func != nullptr) {
+                int64_t bytes = m_cost_func(*frame);
+                int64_t budget_deadline_us = m_memory_policy == MEMORY_POLICY_SHED ? 0 : deadline_us;
+                if (m_budget->acquire(m_account, bytes, budget_deadline_us, &m_stopped) != 0) {
+                    if (m_param.max_inflight_frames > 0) m_credits.release(1);
+                    m_memory_refused.fetch_add(1, std::memory_order_relaxed);
+                    m_drain.leave();
+                    return m_stopped ? -1 : BM_INFER_PIPE_BUSY;
+                }
+                m_stage_bytes[PIPE_STAGE_PREPROCESS].fetch_add(bytes, std::memory_order_relaxed);
+            }
+            m_admitted.fetch_add(1);
+            if (m_reorder) m_reorder->expect(*frame);
+            if (m_tracer != nullptr) {
+                uint64_t id = m_trace_id_func(*frame);
+                if (m_tracer->sampled(id)) {
+                    m_tracer->record(m_trace_tracks[PIPE_STAGE_PREPROCESS], TRACE_ENQUEUE, id, blocking_queue_now_us());
+                }
+            }
+            m_preprocessQue->push(*frame);
+            m_drain.leave();
+            return 0;
+        }
+
+        void set_flush(bool enable) {
+            m_preprocessQue->set_flush(enable);
+            for (auto &r : m_replicas) r->queue->set_flush(enable);
+            m_postprocessQue->set_flush(enable);
+        }
+
+    public:
+        BMInferencePipe() : m_admitted(0), m_completed(0), m_shed(0), m_stopped(false), m_healthy_num(0),
+                            m_memory_refused(0) {
+            pthread_mutex_init(&m_expiry_mtx, NULL);
+            pthread_mutex_init(&m_replica_mtx, NULL);
+            for (auto &bytes : m_stage_bytes) bytes = 0;
+            for (auto &track : m_trace_tracks) track = 0;
         }
 
         virtual ~BMInferencePipe() {
+            stop();
+            if (m_budget != nullptr) m_budget->close_account(m_account);
+            pthread_mutex_destroy(&m_expiry_mtx);
+            pthread_mutex_destroy(&m_replica_mtx);
+        }
+
+        // Call before init(): the preprocess queue becomes a FairQueue keyed by func (e.g. the frame's
+        // channel id) so that every preprocess batch mixes the streams fairly.
+        void set_stream_key_func(StreamKeyFunc func) {
+            m_stream_key_func = func;
+        }
+
+        // weighted share of a stream in the preprocess batches, see FairQueue::set_weight
+        void set_stream_weight(int key, int weight) {
+            m_stream_weights[key] = weight;
+            if (m_fairQue) m_fairQue->set_weight(key, weight);
+        }
+
+        // Call before init(): postprocessed frames go through a ReorderBuffer keyed on
+        // (stream_key(frame), seq(frame)) and the pipe invokes the detected callback in that order,
+        // so the delegate's postprocess must not call it itself. See ReorderBuffer for window_size
+        // and timeout_ms.
+        void set_ordered_output(StreamKeyFunc stream_key, SeqFunc seq, int window_size = 32, long timeout_ms = 100) {
+            m_order_key_func = stream_key;
+            m_order_seq_func = seq;
+            m_order_window = window_size;
+            m_order_timeout_ms = timeout_ms;
+        }
 
+        // Call before init(): promises that push_frame and try_push_frame are only ever called from one
+        // thread, e.g. a single demux loop feeding all streams, so that the preprocess queue may be a
+        // BLOCKING_QUEUE_SPSC one. Pipes fed by one decoder thread per stream must not set it.
+        void set_single_producer(bool enable) {
+            m_single_producer = enable;
+        }
+
+        // Call before init(): push_frame stamps every frame with a deadline of now + latency_budget_us
+        // through deadline(frame), and each stage takes the frames past their deadline out of a batch
+        // before working on it, so an overloaded pipe spends its time on fresh frames. stream_key
+        // selects the per-stream budget and counters (all frames are stream 0 without it).
+        void set_frame_deadline(DeadlineFunc deadline, int64_t latency_budget_us, StreamKeyFunc stream_key = nullptr) {
+            m_deadline_func = deadline;
+            m_latency_budget_us = latency_budget_us;
+            m_expiry_key_func = stream_key;
+        }
+
+        // Call before init(): latency budget of one stream, 0 never expires its frames
+        void set_stream_latency_budget(int key, int64_t latency_budget_us) {
+            m_stream_budgets[key] = latency_budget_us;
+        }
+
+        // called for every expired frame, from the worker of the stage that found it, and for every
+        // frame of a failed forward that no replica had room for (stage PIPE_STAGE_INFERENCE)
+        void set_drop_callback(DropFunc func) {
+            m_drop_func = func;
+        }
+
+        // Call before init(): every frame is charged cost(frame) bytes against budget from push_frame
+        // until it leaves postprocess or is shed. While the budget is exhausted push_frame waits like
+        // for a credit with MEMORY_POLICY_BLOCK, or turns the frame away at once with
+        // MEMORY_POLICY_SHED, and returns BM_INFER_PIPE_BUSY. cost must give the same value for a
+        // frame all along the pipe, e.g. the size of its decoded image. name labels the pipe in
+        // MemoryBudget::usage(); the budget must outlive the pipe.
+        //
+        // The budget can run out with fewer than batch_num frames in the pipe, which a preprocess
+        // stage waiting for full batches would never see complete. init() therefore sets
+        // preprocess_batch_delay_us to BM_INFER_PIPE_BUDGET_BATCH_DELAY_US if it is 0, so that a
+        // partial batch goes on and frees its bytes.
+        void set_memory_budget(CostFunc cost, int policy = MEMORY_POLICY_BLOCK, const std::string &name = "pipe",
+                               MemoryBudget *budget = &MemoryBudget::global()) {
+            if (m_budget != nullptr) m_budget->close_account(m_account);
+            m_budget = budget;
+            m_account = budget->open_account(name);
+            m_cost_func = cost;
+            m_memory_policy = policy;
+        }
+
+        // Call before init(): traces the frames tracer samples by id(frame) through every stage, see
+        // Tracer. The tracer must outlive the pipe.
+        void set_tracer(Tracer *tracer, TraceIdFunc id) {
+            m_tracer = tracer;
+            m_trace_id_func = id;
+        }
+
+        MemoryUsage memory_usage() const {
+            MemoryUsage usage;
+            for (int i = 0; i < PIPE_STAGE_NUM; i++) {
+                usage.stage_bytes[i] = m_stage_bytes[i].load(std::memory_order_relaxed);
+            }
+            usage.refused = m_memory_refused.load(std::memory_order_relaxed);
+            return usage;
+        }
+
+        // frames shed per stream so far
+        std::unordered_map<int, ExpiryStats> expiry_stats() {
+            pthread_mutex_lock(&m_expiry_mtx);
+            std::unordered_map<int, ExpiryStats> stats = m_expiry;
+            pthread_mutex_unlock(&m_expiry_mtx);
+            return stats;
+        }
+
+        // Call before init(): another instance of the model, e.g. on another core or card, with
+        // inference_thread_num workers of its own placed by placement. The delegate given to init()
+        // is the first replica and the only one that runs preprocess and postprocess, so a replica's
+        // forward has to take its input from the frames and leave its output there. Each batch goes
+        // to the least loaded replica (set_replica_balance), and a replica whose forward fails is
+        // taken out of rotation, its batch handed to another one. It rejoins after a cool-down, see
+        // set_replica_cooldown.
+        void add_forward_replica(std::shared_ptr<DetectorDelegate<T1>> delegate,
+                                 const CpuPlacement &placement = CpuPlacement()) {
+            std::unique_ptr<Replica> r(new Replica());
+            r->delegate = delegate;
+            r->placement = placement;
+            m_replicas.push_back(std::move(r));
+        }
+
+        // a ReplicaBalance, REPLICA_BALANCE_LEAST_OUTSTANDING by default
+        void set_replica_balance(int balance) {
+            m_balance = balance;
+        }
+
+        // Call before init(): a failed replica rejoins the rotation after cooldown_ms (1000 by
+        // default), doubled for every failure in a row up to 64 times; its next batch tells whether
+        // it recovered. A negative value retires failed replicas for good.
+        void set_replica_cooldown(long cooldown_ms) {
+            m_replica_cooldown_us = cooldown_ms < 0 ? -1 : (int64_t) cooldown_ms * 1000;
+        }
+
+        // per replica, replica 0 being the delegate given to init()
+        std::vector<ReplicaStats> replica_stats() const {
+            std::vector<ReplicaStats> stats(m_replicas.size());
+            for (size_t i = 0; i < m_replicas.size(); i++) {
+                const Replica &r = *m_replicas[i];
+                stats[i].batch_num = r.batch_num.load(std::memory_order_relaxed);
+                stats[i].frame_num = r.frame_num.load(std::memory_order_relaxed);
+                stats[i].error_num = r.error_num.load(std::memory_order_relaxed);
+                stats[i].drop_num = r.drop_num.load(std::memory_order_relaxed);
+                stats[i].outstanding = r.outstanding.load(std::memory_order_relaxed);
+                stats[i].frame_us = r.frame_us.load(std::memory_order_relaxed);
+                stats[i].healthy = r.healthy.load(std::memory_order_relaxed);
+            }
+            return stats;
         }
 
         int init(const DetectorParam &param, std::shared_ptr<DetectorDelegate<T1>> delegate) {
             m_param = param;
             m_detect_delegate = delegate;
 
-            const int underlying_type_std_queue = 0;
-            m_preprocessQue = std::make_shared<BlockingQueue<T1>>(
-                "preprocess", underlying_type_std_queue,
-                param.preprocess_queue_size);
-            m_postprocessQue = std::make_shared<BlockingQueue<T1>>(
-                "postprocess", underlying_type_std_queue,
-                param.postprocess_queue_size);
-            m_forwardQue = std::make_shared<BlockingQueue<T1>>(
-                "inference", underlying_type_std_queue,
-                param.inference_queue_size);
+            std::unique_ptr<Replica> primary(new Replica());
+            primary->delegate = delegate;
+            primary->placement = param.inference_placement;
+            m_replicas.insert(m_replicas.begin(), std::move(primary));
+            m_healthy_num = m_replicas.size();
+            if (m_tracer != nullptr) {
+                m_trace_tracks[PIPE_STAGE_PREPROCESS] = m_tracer->add_track("preprocess");
+                for (size_t i = 0; i < m_replicas.size(); i++) {
+                    m_replicas[i]->trace_track = m_tracer->add_track(i == 0 ? "inference" : "inference" + std::to_string(i));
+                }
+                m_trace_tracks[PIPE_STAGE_INFERENCE] = m_replicas[0]->trace_track;
+                m_trace_tracks[PIPE_STAGE_POSTPROCESS] = m_tracer->add_track("postprocess");
+            }
+
+            if (m_order_key_func != nullptr && m_order_seq_func != nullptr) {
+                m_reorder = std::make_shared<ReorderBuffer<T1>>(m_order_key_func, m_order_seq_func, [this](T1 &frame) {
+                    m_detect_delegate->notify_detected(frame);
+                }, m_order_window, m_order_timeout_ms);
+            }
+
+            if (param.max_inflight_frames > 0) {
+                int min_queue_size = std::min(param.preprocess_queue_size,
+                                              std::min(param.inference_queue_size, param.postprocess_queue_size));
+                if (param.max_inflight_frames > min_queue_size) {
+                    std::cout << "WARNING: max_inflight_frames(" << param.max_inflight_frames
+                              << ") exceeds the smallest queue size(" << min_queue_size
+                              << "), stages may still block on a full queue" << std::endl;
+                }
+                if (param.max_inflight_frames < param.batch_num && param.preprocess_batch_delay_us == 0) {
+                    // preprocess waits for batch_num frames and would never get them
+                    std::cout << "WARNING: max_inflight_frames(" << param.max_inflight_frames
+                              << ") is below batch_num, use " << param.batch_num << std::endl;
+                    m_param.max_inflight_frames = param.batch_num;
+                }
+                m_credits.reset(m_param.max_inflight_frames);
+            }
+            if (m_cost_func != nullptr && param.batch_num > 1 && param.preprocess_batch_delay_us == 0) {
+                // the budget, maybe shared with other pipes, can run out with fewer than batch_num
+                // frames queued and preprocess would wait for the rest forever
+                std::cout << "WARNING: preprocess_batch_delay_us is 0 with a memory budget, use "
+                          << BM_INFER_PIPE_BUDGET_BATCH_DELAY_US << std::endl;
+                m_param.preprocess_batch_delay_us = BM_INFER_PIPE_BUDGET_BATCH_DELAY_US;
+            }
+
+            int preprocess_thread_max = std::max(param.preprocess_thread_num, param.preprocess_max_thread_num);
+            int inference_thread_max = std::max(param.inference_thread_num, param.inference_max_thread_num);
+            int postprocess_thread_max = std::max(param.postprocess_thread_num, param.postprocess_max_thread_num);
+
+            if (m_stream_key_func != nullptr) {
+                m_fairQue = std::make_shared<FairQueue<T1>>("preprocess", m_stream_key_func,
+                                                            param.preprocess_queue_size);
+                for (auto &w : m_stream_weights) m_fairQue->set_weight(w.first, w.second);
+                m_preprocessQue = m_fairQue;
+            } else {
+                m_preprocessQue = create_stage_queue<T1>("preprocess", param.preprocess_queue_type,
+                                                       param.preprocess_queue_size, m_single_producer ? 1 : 0,
+                                                       preprocess_thread_max);
+            }
+            m_postprocessQue = create_stage_queue<T1>("postprocess", param.postprocess_queue_type,
+                                                      param.postprocess_queue_size,
+                                                      inference_thread_max * (int) m_replicas.size(),
+                                                      postprocess_thread_max);
+            m_preprocessQue->set_wait_profile(param.preprocess_wait_profile);
+            m_postprocessQue->set_wait_profile(param.postprocess_wait_profile);
 
             m_preprocessWorkerPool.init(m_preprocessQue.get(), param.preprocess_thread_num, param.batch_num, param.batch_num);
-            m_preprocessWorkerPool.startWork([this, &param](std::vector<T1> &items) {
+            m_preprocessWorkerPool.setWorkStealing(param.preprocess_work_stealing);
+            m_preprocessWorkerPool.setBatchDeadline(m_param.preprocess_batch_delay_us);
+            set_auto_scale(m_preprocessWorkerPool, param.preprocess_thread_num, param.preprocess_max_thread_num);
+            m_preprocessWorkerPool.setPlacement(param.preprocess_placement);
+            if (m_tracer != nullptr) {
+                m_preprocessWorkerPool.setTracer(m_tracer, m_trace_tracks[PIPE_STAGE_PREPROCESS], m_trace_id_func);
+            }
+            int ret = m_preprocessWorkerPool.startWork([this, &param](std::vector<T1> &items) {
+                shed_expired(items, PIPE_STAGE_PREPROCESS);
+                if (items.empty()) return;
+                int64_t bytes = frames_bytes(items);
                 m_detect_delegate->preprocess(items);
-                this->m_forwardQue->push(items);
+                move_bytes(bytes, PIPE_STAGE_PREPROCESS, PIPE_STAGE_INFERENCE);
+                dispatch(items);
             });
 
-            m_forwardWorkerPool.init(m_forwardQue.get(), param.inference_thread_num, 1, 8);
-            m_forwardWorkerPool.startWork([this, &param](std::vector<T1> &items) {
-                m_detect_delegate->forward(items);
-                this->m_postprocessQue->push(items);
-            });
+            // with several replicas a failed batch is also handed over by the inference workers
+            int forward_producer_num = preprocess_thread_max + (m_replicas.size() > 1 ? 1 : 0);
+            for (auto &r : m_replicas) ret |= start_replica(*r, param, forward_producer_num);
 
             m_postprocessWorkerPool.init(m_postprocessQue.get(), param.postprocess_thread_num, 1, 8);
-            m_postprocessWorkerPool.startWork([this, &param](std::vector<T1> &items) {
+            m_postprocessWorkerPool.setWorkStealing(param.postprocess_work_stealing);
+            m_postprocessWorkerPool.setBatchDeadline(param.postprocess_batch_delay_us);
+            set_auto_scale(m_postprocessWorkerPool, param.postprocess_thread_num, param.postprocess_max_thread_num);
+            m_postprocessWorkerPool.setPlacement(param.postprocess_placement);
+            if (m_tracer != nullptr) {
+                m_postprocessWorkerPool.setTracer(m_tracer, m_trace_tracks[PIPE_STAGE_POSTPROCESS], m_trace_id_func);
+            }
+            ret |= m_postprocessWorkerPool.startWork([this, &param](std::vector<T1> &items) {
+                shed_expired(items, PIPE_STAGE_POSTPROCESS);
+                if (items.empty()) return;
+                int num = items.size();
+                // before the detected callback may hand the frames on
+                int64_t bytes = frames_bytes(items);
                 m_detect_delegate->postprocess(items);
+                if (m_reorder) {
+                    for (auto &frame : items) m_reorder->push(frame);
+                }
+                if (m_param.max_inflight_frames > 0) m_credits.release(num);
+                move_bytes(bytes, PIPE_STAGE_POSTPROCESS, PIPE_STAGE_NUM);
+                m_completed.fetch_add(num);
+                m_drain.notify();
             });
+            // -1 if a stage's placement could not be applied
+            return ret != 0 ? -1 : 0;
+        }
+
+        // Waits up to wait_ms (0: forever) until every frame pushed before the call has been through
+        // postprocess. Partial batches are flushed right away meanwhile, and push_frame waits until the
+        // drain is over. The pipe keeps running afterwards. -1 on timeout or if a drain is already
+        // in progress.
+        int drain(long wait_ms = 0) {
+            if (!m_preprocessQue || m_stopped) return 0;
+            if (!m_drain.begin()) {
+                std::cerr << "[ERROR] BMInferencePipe::drain: already draining" << std::endl;
+                return -1;
+            }
+            set_flush(true);
+
+            int64_t deadline_us = blocking_queue_deadline_us(wait_ms);
+            bool drained = m_drain.wait([this] { return m_drain.admitting() == 0; }, deadline_us);
+            if (drained) {
+                uint64_t target = m_admitted;
+                drained = m_drain.wait([this, target] { return m_completed >= target; }, deadline_us);
+            }
+            // nothing more is coming for the gaps of the frames drained
+            if (drained && m_reorder) m_reorder->flush();
+
+            set_flush(false);
+            m_drain.end();
+            return drained ? 0 : -1;
+        }
+
+        // End of stream: stops taking frames, runs everything already pushed through all stages and
+        // joins the workers. Called by the destructor.
+        int stop() {
+            bool expected = false;
+            if (!m_preprocessQue || !m_stopped.compare_exchange_strong(expected, true)) return 0;
+            m_credits.stop();
+            if (m_budget != nullptr) m_budget->wake();
+            // frames admitted before m_stopped was set still reach the preprocess queue
+            m_drain.close();
+            // stage by stage, so that each stage gets all the frames of the one before it
+            m_preprocessWorkerPool.stopWork();
+            // a batch failing from here on is dropped rather than pushed to a replica stopped already
+            pthread_mutex_lock(&m_replica_mtx);
+            m_redispatch_closed = true;
+            pthread_mutex_unlock(&m_replica_mtx);
+            for (auto &r : m_replicas) r->pool.stopWork();
+            m_postprocessWorkerPool.stopWork();
+            if (m_reorder) m_reorder->flush();
             return 0;
         }
 
         int flush_frame() {
-            m_preprocessWorkerPool.flush();
-            return 0;
+            return stop();
         }
 
-        int push_frame(T1 *frame) {
-            m_preprocessQue->push(*frame);
-            return 0;
+        // With max_inflight_frames set, waits up to wait_ms (0: forever) for a credit and returns
+        // BM_INFER_PIPE_BUSY if none became free, e.g. to let the caller skip decoding the next frame.
+        // Also waits while a drain is in progress. -1 once the pipe is stopped.
+        int push_frame(T1 *frame, long wait_ms = 0) {
+            return push_admitted(frame, blocking_queue_deadline_us(wait_ms));
+        }
+
+        // Never waits for a credit or a drain.
+        int try_push_frame(T1 *frame) {
+            return push_admitted(frame, 0);
+        }
+
+        ReorderStats reorder_stats() const {
+            return m_reorder ? m_reorder->stats() : ReorderStats();
+        }
+
+        // frames that have left postprocess, or were shed, so far
+        uint64_t completed_frames() const {
+            return m_completed.load(std::memory_order_relaxed);
+        }
+
+        // frames pushed and not completed yet, a measure of the load on the pipe
+        uint64_t inflight_frames() const {
+            uint64_t completed = m_completed.load(std::memory_order_relaxed);
+            uint64_t admitted = m_admitted.load(std::memory_order_relaxed);
+            return admitted > completed ? admitted - completed : 0;
+        }
+
+        // frames dropped past their deadline so far, all streams and stages
+        uint64_t shed_frames() const {
+            return m_shed.load(std::memory_order_relaxed);
+        }
+
+        // credits left, i.e. frames push_frame can take right now without waiting
+        int available_credits() const {
+            return m_param.max_inflight_frames > 0 ? m_credits.available() : INT32_MAX;
         }
     };
 } // end namespace bm
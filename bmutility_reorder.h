@@ -0,0 +1,309 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_REORDER_H
+#define BMUTILITY_REORDER_H
+
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "bmutility_thread_queue.h"
+
+namespace bm {
+    struct ReorderStats {
+        uint64_t emit_num; // frames handed to the output callback
+        uint64_t skip_num; // sequence numbers given up on, by timeout or because the window was full
+        uint64_t late_num; // frames that arrived after their sequence number was skipped, dropped
+        uint64_t held_num; // frames waiting for an earlier one right now
+
+        ReorderStats() : emit_num(0), skip_num(0), late_num(0), held_num(0) {}
+    };
+
+    // Restores the per-stream order of frames keyed on (stream id, sequence number). A frame is
+    // handed to the output callback as soon as all earlier sequence numbers of its stream have been,
+    // otherwise it is held in a window of window_size frames per stream. A gap is skipped when the
+    // window is full or, with a timeout, once the oldest held frame has waited timeout_ms. Frames of a
+    // skipped sequence number are dropped when they show up. A sequence number more than eight
+    // windows behind the stream's position is taken as a restart of the stream. A stream starts at its first
+    // frame, or at the one passed to expect() first when the input order is known.
+    //
+    // The output callback of a stream runs under that stream's lock, so it sees the frames in order.
+    template<typename T>
+    class ReorderBuffer {
+    public:
+        using StreamKeyFunc = std::function<int(const T &frame)>;
+        using SeqFunc = std::function<int64_t(const T &frame)>;
+        using OutputFunc = std::function<void(T &frame)>;
+
+    private:
+        enum { SLOT_EMPTY = 0, SLOT_FRAME = 1, SLOT_DROPPED = 2 };
+
+        struct Stream {
+            Stream(size_t window) : slots(window), present(window, 0), stamps(window, 0), next(0),
+                                    held(0), based(false), started(false) {
+                pthread_mutex_init(&mtx, NULL);
+            }
+
+            ~Stream() {
+                pthread_mutex_destroy(&mtx);
+            }
+
+            pthread_mutex_t mtx;
+            std::vector<T> slots;
+            std::vector<char> present; // SLOT_*
+            std::vector<int64_t> stamps;
+            int64_t next;    // next sequence number to emit
+            size_t held;     // occupied slots
+            bool based;      // next has been set, by expect() or the first frame
+            bool started;    // false until the first frame was emitted
+        };
+
+        StreamKeyFunc m_key_func;
+        SeqFunc m_seq_func;
+        OutputFunc m_output;
+        size_t m_window;
+        int64_t m_timeout_us;
+
+        pthread_mutex_t m_streams_mtx;
+        std::unordered_map<int, Stream *> m_streams;
+
+        std::atomic<uint64_t> m_emit_num;
+        std::atomic<uint64_t> m_skip_num;
+        std::atomic<uint64_t> m_late_num;
+        std::atomic<int64_t> m_held_num;
+
+        // checks the timeouts while any frame is held
+        std::thread *m_timer;
+        bool m_timer_stop;
+        pthread_mutex_t m_timer_mtx;
+        pthread_cond_t m_timer_condv;
+
+        size_t slot_of(int64_t seq) const {
+            int64_t w = m_window;
+            return (size_t) (((seq % w) + w) % w);
+        }
+
+        Stream *stream_of(int key) {
+            pthread_mutex_lock(&m_streams_mtx);
+            Stream *&s = m_streams[key];
+            if (s == nullptr) s = new Stream(m_window);
+            pthread_mutex_unlock(&m_streams_mtx);
+            return s;
+        }
+
+        // emits or skips s.next, then moves on
+        void advance(Stream &s) {
+            size_t i = slot_of(s.next);
+            if (s.present[i]) {
+                emit(s, i);
+            } else {
+                m_skip_num.fetch_add(1, std::memory_order_relaxed);
+            }
+            s.next++;
+        }
+
+        void emit(Stream &s, size_t i) {
+            char state = s.present[i];
+            s.present[i] = SLOT_EMPTY;
+            s.held--;
+            s.started = true;
+            if (state != SLOT_FRAME) return;
+            m_held_num.fetch_sub(1, std::memory_order_relaxed);
+            m_output(s.slots[i]);
+            s.slots[i] = T();
+            m_emit_num.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void emit_ready(Stream &s) {
+            while (s.held > 0 && s.present[slot_of(s.next)]) advance(s);
+        }
+
+        // skips gaps up to the oldest held frame while it has waited longer than timeout_us, or
+        // unconditionally with timeout_us < 0
+        void expire(Stream &s, int64_t now, int64_t timeout_us) {
+            while (s.held > 0) {
+                int64_t seq = s.next;
+                while (!s.present[slot_of(seq)]) seq++;
+                if (timeout_us >= 0 && now - s.stamps[slot_of(seq)] < timeout_us) break;
+                while (s.next < seq) advance(s);
+                emit_ready(s);
+            }
+        }
+
+        void timer_loop() {
+            pthread_mutex_lock(&m_timer_mtx);
+            while (!m_timer_stop) {
+                if (m_held_num.load(std::memory_order_relaxed) == 0) {
+                    pthread_cond_wait(&m_timer_condv, &m_timer_mtx);
+                    continue;
+                }
+                int64_t period_us = std::max<int64_t>(m_timeout_us / 4, 1000);
+                blocking_queue_cond_wait(&m_timer_condv, &m_timer_mtx, blocking_queue_now_us() + period_us);
+                pthread_mutex_unlock(&m_timer_mtx);
+                expire_all(m_timeout_us);
+                pthread_mutex_lock(&m_timer_mtx);
+            }
+            pthread_mutex_unlock(&m_timer_mtx);
+        }
+
+        void expire_all(int64_t timeout_us) {
+            std::vector<Stream *> streams;
+            pthread_mutex_lock(&m_streams_mtx);
+            for (auto &it : m_streams) streams.push_back(it.second);
+            pthread_mutex_unlock(&m_streams_mtx);
+
+            int64_t now = blocking_queue_now_us();
+            for (auto s : streams) {
+                pthread_mutex_lock(&s->mtx);
+                expire(*s, now, timeout_us);
+                pthread_mutex_unlock(&s->mtx);
+            }
+        }
+
+        // frame == nullptr places a SLOT_DROPPED marker
+        void insert(T *frame, int key, int64_t seq) {
+            Stream &s = *stream_of(key);
+            int64_t window = m_window;
+            bool was_idle = false;
+
+            pthread_mutex_lock(&s.mtx);
+            if (!s.based) {
+                s.next = seq;
+                s.based = true;
+            } else if (seq < s.next) {
+                if (s.next - seq > window * 8) {
+                    // restart: flush what the old sequence left behind
+                    expire(s, 0, -1);
+                    s.next = seq;
+                } else if (!s.started) {
+                    // nothing emitted yet and an earlier frame came in: start from it if the held
+                    // frames still fit into the window
+                    int64_t last = seq;
+                    if (s.held > 0) {
+                        last = s.next + window - 1;
+                        while (!s.present[slot_of(last)]) last--;
+                    }
+                    if (last - seq >= window) {
+                        if (frame != nullptr) m_late_num.fetch_add(1, std::memory_order_relaxed);
+                        pthread_mutex_unlock(&s.mtx);
+                        return;
+                    }
+                    s.next = seq;
+                } else {
+                    if (frame != nullptr) m_late_num.fetch_add(1, std::memory_order_relaxed);
+                    pthread_mutex_unlock(&s.mtx);
+                    return;
+                }
+            }
+
+            // no room in the window: give up on the oldest gaps
+            while (seq >= s.next + window && s.held > 0) advance(s);
+            if (seq >= s.next + window) {
+                m_skip_num.fetch_add(seq - window + 1 - s.next, std::memory_order_relaxed);
+                s.next = seq - window + 1;
+            }
+
+            size_t i = slot_of(seq);
+            if (s.present[i]) {
+                // same sequence number twice
+                if (frame != nullptr) m_late_num.fetch_add(1, std::memory_order_relaxed);
+                pthread_mutex_unlock(&s.mtx);
+                return;
+            }
+            s.stamps[i] = blocking_queue_now_us();
+            s.held++;
+            if (frame != nullptr) {
+                s.slots[i] = std::move(*frame);
+                s.present[i] = SLOT_FRAME;
+                was_idle = m_held_num.fetch_add(1, std::memory_order_relaxed) == 0;
+            } else {
+                s.present[i] = SLOT_DROPPED;
+            }
+            emit_ready(s);
+            pthread_mutex_unlock(&s.mtx);
+
+            if (was_idle && m_timer != nullptr && m_held_num.load(std::memory_order_relaxed) > 0) {
+                pthread_mutex_lock(&m_timer_mtx);
+                pthread_cond_signal(&m_timer_condv);
+                pthread_mutex_unlock(&m_timer_mtx);
+            }
+        }
+
+    public:
+        // timeout_ms 0 waits for a missing frame until the window is full
+        ReorderBuffer(StreamKeyFunc key_func, SeqFunc seq_func, OutputFunc output, int window_size, long timeout_ms)
+                : m_key_func(key_func), m_seq_func(seq_func), m_output(output),
+                  m_window(window_size > 1 ? window_size : 1), m_timeout_us((int64_t) timeout_ms * 1000),
+                  m_emit_num(0), m_skip_num(0), m_late_num(0), m_held_num(0), m_timer(nullptr), m_timer_stop(false) {
+            pthread_mutex_init(&m_streams_mtx, NULL);
+            pthread_mutex_init(&m_timer_mtx, NULL);
+            blocking_queue_cond_init(&m_timer_condv);
+            if (m_timeout_us > 0) {
+                m_timer = new std::thread([this] { timer_loop(); });
+            }
+        }
+
+        ~ReorderBuffer() {
+            if (m_timer != nullptr) {
+                pthread_mutex_lock(&m_timer_mtx);
+                m_timer_stop = true;
+                pthread_cond_signal(&m_timer_condv);
+                pthread_mutex_unlock(&m_timer_mtx);
+                m_timer->join();
+                delete m_timer;
+            }
+            for (auto &it : m_streams) delete it.second;
+            pthread_cond_destroy(&m_timer_condv);
+            pthread_mutex_destroy(&m_timer_mtx);
+            pthread_mutex_destroy(&m_streams_mtx);
+        }
+
+        void push(T &frame) {
+            insert(&frame, m_key_func(frame), m_seq_func(frame));
+        }
+
+        // The frame won't come, e.g. because it was shed upstream: later frames of its stream don't
+        // wait for it. Not counted as a skip.
+        void drop(const T &frame) {
+            insert(nullptr, m_key_func(frame), m_seq_func(frame));
+        }
+
+        // Announces a frame in input order, before it may get reordered. Only the first frame of a
+        // stream matters: it sets where the stream starts, so that a later frame overtaking it is
+        // held instead of being emitted first.
+        void expect(const T &frame) {
+            Stream &s = *stream_of(m_key_func(frame));
+            pthread_mutex_lock(&s.mtx);
+            if (!s.based) {
+                s.next = m_seq_func(frame);
+                s.based = true;
+            }
+            pthread_mutex_unlock(&s.mtx);
+        }
+
+        // emits every held frame, skipping whatever is missing in between
+        void flush() {
+            expire_all(-1);
+        }
+
+        ReorderStats stats() const {
+            ReorderStats st;
+            st.emit_num = m_emit_num.load(std::memory_order_relaxed);
+            st.skip_num = m_skip_num.load(std::memory_order_relaxed);
+            st.late_num = m_late_num.load(std::memory_order_relaxed);
+            int64_t held = m_held_num.load(std::memory_order_relaxed);
+            st.held_num = held > 0 ? held : 0;
+            return st;
+        }
+    };
+} // end namespace bm
+
+#endif //BMUTILITY_REORDER_H
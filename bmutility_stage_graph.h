@@ -0,0 +1,469 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_STAGE_GRAPH_H
+#define BMUTILITY_STAGE_GRAPH_H
+
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "bmutility_pipeline.h"
+
+#define BM_STAGE_GRAPH_MAX_EDGES 32
+
+namespace bm {
+    struct StageParam {
+        StageParam() {
+            thread_num = 1;
+            max_thread_num = 0;
+            min_batch = 1;
+            max_batch = 1;
+            batch_delay_us = 0;
+            queue_type = BLOCKING_QUEUE_STD_QUEUE;
+            queue_size = 5;
+            work_stealing = 0;
+            wait_profile = WAIT_PROFILE_LOW_CPU;
+        }
+
+        int thread_num;
+        // autoscaling upper bound, see WorkerPool::setAutoScale; not above thread_num keeps it fixed
+        int max_thread_num;
+        // a batch has between min_batch and max_batch items; batch_delay_us > 0 lets a partial
+        // batch go once its oldest item has waited that long (WorkerPool::setBatchDeadline)
+        int min_batch;
+        int max_batch;
+        int64_t batch_delay_us;
+        // BlockingQueueType and size of the stage's input queue
+        int queue_type;
+        int queue_size;
+        int work_stealing;
+        CpuPlacement placement;
+        int wait_profile;
+    };
+
+    // Pipeline of named stages connected by edges, each stage with its own input queue and worker
+    // pool. A stage with several outgoing edges fans its items out (to all of them, or as chosen by
+    // its route function), a stage with several incoming edges takes items from all of them, or
+    // joins them per key with set_join. Items are moved from stage to stage; only a fan-out to more
+    // than one successor copies an item, so use a cheap handle such as std::shared_ptr<Frame> there.
+    //
+    //   StageGraph<FramePtr> g;
+    //   int det = g.add_stage("detect", det_param, detect);
+    //   int cls = g.add_stage("classify", cls_param, classify);
+    //   int reid = g.add_stage("reid", reid_param, reid);
+    //   int trk = g.add_stage("track", trk_param, track);
+    //   g.connect(det, cls); g.connect(det, reid); g.connect(cls, trk); g.connect(reid, trk);
+    //   g.set_join(trk, [](const FramePtr &f) { return f->seq; });
+    //   g.start();
+    //   g.push(det, frame);
+    template<typename T>
+    class StageGraph {
+    public:
+        // Processes a batch in place. It may remove items or add new ones (e.g. one per crop), what
+        // is left in items afterwards goes on to the successors.
+        using StageFunc = std::function<void(std::vector<T> &items)>;
+        // successors an item goes to: bit i selects the i-th edge connected from the stage
+        using RouteFunc = std::function<uint32_t(const T &item)>;
+        using JoinKeyFunc = std::function<uint64_t(const T &item)>;
+        // folds item into acc, the first arrival of the key
+        using JoinMergeFunc = std::function<void(T &acc, T &item)>;
+
+    private:
+        struct JoinSlot {
+            JoinSlot(T &&v) : acc(std::move(v)), arrived(1) {}
+
+            T acc;
+            size_t arrived;
+        };
+
+        struct Stage {
+            Stage() : in(0), done(0), bufs(4) {
+                pthread_mutex_init(&join_mtx, NULL);
+            }
+
+            ~Stage() {
+                pthread_mutex_destroy(&join_mtx);
+            }
+
+            std::string name;
+            StageParam param;
+            StageFunc func;
+            RouteFunc route;
+            std::vector<int> next;
+            std::vector<int> prev;
+
+            std::shared_ptr<WorkQueue<T>> que;
+            WorkerPool<T> pool;
+            // items pushed to que and input items fully handed on, see drain()
+            std::atomic<uint64_t> in;
+            std::atomic<uint64_t> done;
+
+            JoinKeyFunc join_key;
+            JoinMergeFunc join_merge;
+            pthread_mutex_t join_mtx;
+            std::unordered_map<uint64_t, JoinSlot> joins;
+
+            // per-edge buffers of a fan-out
+            ObjectPool<std::vector<T>> bufs;
+        };
+
+        std::vector<std::unique_ptr<Stage>> m_stages;
+        std::vector<int> m_order; // topological
+        DrainBarrier m_drain;
+        bool m_started;
+        std::atomic<bool> m_stopped;
+        // push() is only called from one thread, see set_single_producer()
+        bool m_single_producer;
+
+        template<typename U = T>
+        static typename std::enable_if<std::is_copy_constructible<U>::value>::type
+        copy_to(const T &item, std::vector<T> &dst) { dst.push_back(item); }
+
+        // connect() refuses fan-out for move-only types, so this is never called
+        template<typename U = T>
+        static typename std::enable_if<!std::is_copy_constructible<U>::value>::type
+        copy_to(const T &, std::vector<T> &) {}
+
+        void push_to(Stage &st, std::vector<T> &items) {
+            if (items.empty()) return;
+            if (st.join_key == nullptr || st.prev.size() < 2) {
+                st.in.fetch_add(items.size());
+                st.que->push(items);
+                return;
+            }
+
+            // an item goes on once every incoming edge has delivered its key
+            std::vector<T> *ready = st.bufs.acquire();
+            pthread_mutex_lock(&st.join_mtx);
+            for (auto &item : items) {
+                uint64_t key = st.join_key(item);
+                auto it = st.joins.find(key);
+                if (it == st.joins.end()) {
+                    st.joins.emplace(key, JoinSlot(std::move(item)));
+                    continue;
+                }
+                if (st.join_merge != nullptr) st.join_merge(it->second.acc, item);
+                if (++it->second.arrived == st.prev.size()) {
+                    ready->push_back(std::move(it->second.acc));
+                    st.joins.erase(it);
+                }
+            }
+            pthread_mutex_unlock(&st.join_mtx);
+            if (!ready->empty()) {
+                st.in.fetch_add(ready->size());
+                st.que->push(*ready);
+            }
+            ready->clear();
+            st.bufs.release(ready);
+        }
+
+        void deliver(Stage &st, std::vector<T> &items) {
+            if (st.next.empty()) return;
+            if (st.next.size() == 1 && st.route == nullptr) {
+                push_to(*m_stages[st.next[0]], items);
+                return;
+            }
+
+            size_t edge_num = st.next.size();
+            uint32_t all = edge_num == 32 ? 0xffffffffu : (1u << edge_num) - 1;
+            std::vector<T> *outs[BM_STAGE_GRAPH_MAX_EDGES];
+            for (size_t e = 0; e < edge_num; e++) outs[e] = st.bufs.acquire();
+            for (auto &item : items) {
+                uint32_t mask = (st.route != nullptr ? st.route(item) : all) & all;
+                if (mask == 0) continue;
+                // copies for all but the last selected edge, which takes the item itself
+                int last = 31 - __builtin_clz(mask);
+                for (int e = 0; e < last; e++) {
+                    if (mask & (1u << e)) copy_to(item, *outs[e]);
+                }
+                outs[last]->push_back(std::move(item));
+            }
+            for (size_t e = 0; e < edge_num; e++) {
+                push_to(*m_stages[st.next[e]], *outs[e]);
+                outs[e]->clear();
+                st.bufs.release(outs[e]);
+            }
+        }
+
+        void set_flush(bool enable) {
+            for (auto &st : m_stages) st->que->set_flush(enable);
+        }
+
+        int sort_stages() {
+            std::vector<int> indegree(m_stages.size(), 0);
+            for (auto &st : m_stages) {
+                for (int n : st->next) indegree[n]++;
+            }
+            m_order.clear();
+            for (size_t i = 0; i < m_stages.size(); i++) {
+                if (indegree[i] == 0) m_order.push_back(i);
+            }
+            for (size_t k = 0; k < m_order.size(); k++) {
+                for (int n : m_stages[m_order[k]]->next) {
+                    if (--indegree[n] == 0) m_order.push_back(n);
+                }
+            }
+            return m_order.size() == m_stages.size() ? 0 : -1;
+        }
+
+        bool valid(int id) const { return id >= 0 && (size_t) id < m_stages.size(); }
+
+    public:
+        StageGraph() : m_started(false), m_stopped(false), m_single_producer(false) {}
+
+        virtual ~StageGraph() {
+            stop();
+        }
+
+        // Returns the stage id, -1 if the name is taken or the graph has been started.
+        int add_stage(const std::string &name, const StageParam &param, StageFunc func) {
+            if (m_started || stage_id(name) >= 0) {
+                std::cerr << "[ERROR] StageGraph::add_stage: can't add " << name << std::endl;
+                return -1;
+            }
+            Stage *st = new Stage();
+            st->name = name;
+            st->param = param;
+            st->func = func;
+            m_stages.emplace_back(st);
+            return m_stages.size() - 1;
+        }
+
+        int stage_id(const std::string &name) const {
+            for (size_t i = 0; i < m_stages.size(); i++) {
+                if (m_stages[i]->name == name) return i;
+            }
+            return -1;
+        }
+
+        int connect(int from, int to) {
+            if (m_started || !valid(from) || !valid(to) || from == to) {
+                std::cerr << "[ERROR] StageGraph::connect: invalid edge " << from << " -> " << to << std::endl;
+                return -1;
+            }
+            Stage &st = *m_stages[from];
+            if (st.next.size() >= BM_STAGE_GRAPH_MAX_EDGES) {
+                std::cerr << "[ERROR] StageGraph::connect: " << st.name << " has too many successors" << std::endl;
+                return -1;
+            }
+            if (!st.next.empty() && !std::is_copy_constructible<T>::value) {
+                std::cerr << "[ERROR] StageGraph::connect: fan-out of " << st.name
+                          << " needs a copyable element type, e.g. std::shared_ptr" << std::endl;
+                return -1;
+            }
+            st.next.push_back(to);
+            m_stages[to]->prev.push_back(from);
+            return 0;
+        }
+
+        // Items of stage id only go to the edges route selects; without one they go to all edges.
+        int set_route(int id, RouteFunc route) {
+            if (m_started || !valid(id)) return -1;
+            m_stages[id]->route = route;
+            return 0;
+        }
+
+        // Stage id waits until every incoming edge has delivered an item with the same key and then
+        // processes the first arrival once, with the later ones folded into it by merge (dropped
+        // without one). Every predecessor must deliver every key exactly once, route functions
+        // upstream must not skip a branch.
+        int set_join(int id, JoinKeyFunc key, JoinMergeFunc merge = nullptr) {
+            if (m_started || !valid(id)) return -1;
+            m_stages[id]->join_key = key;
+            m_stages[id]->join_merge = merge;
+            return 0;
+        }
+
+        // Call before start(): promises that push() is only ever called from one thread, so that entry
+        // stages may have a BLOCKING_QUEUE_SPSC queue, like BMInferencePipe::set_single_producer.
+        void set_single_producer(bool enable) {
+            m_single_producer = enable;
+        }
+
+        // Adds the preprocess, inference and postprocess stages of a DetectorDelegate as
+        // "<name>.preprocess", "<name>.inference" and "<name>.postprocess", configured from param the
+        // way BMInferencePipe does it. Connect to *first and from *last to embed it in the graph.
+        int add_detector(const std::string &name, const DetectorParam &param,
+                         std::shared_ptr<DetectorDelegate<T>> delegate, int *first, int *last) {
+            StageParam pre, infer, post;
+            pre.thread_num = param.preprocess_thread_num;
+            pre.max_thread_num = param.preprocess_max_thread_num;
+            pre.min_batch = pre.max_batch = param.batch_num;
+            pre.batch_delay_us = param.preprocess_batch_delay_us;
+            pre.queue_type = param.preprocess_queue_type;
+            pre.queue_size = param.preprocess_queue_size;
+            pre.work_stealing = param.preprocess_work_stealing;
+            pre.placement = param.preprocess_placement;
+            pre.wait_profile = param.preprocess_wait_profile;
+
+            infer.thread_num = param.inference_thread_num;
+            infer.max_thread_num = param.inference_max_thread_num;
+            infer.max_batch = 8;
+            infer.batch_delay_us = param.inference_batch_delay_us;
+            infer.queue_type = param.inference_queue_type;
+            infer.queue_size = param.inference_queue_size;
+            infer.work_stealing = param.inference_work_stealing;
+            infer.placement = param.inference_placement;
+            infer.wait_profile = param.inference_wait_profile;
+
+            post.thread_num = param.postprocess_thread_num;
+            post.max_thread_num = param.postprocess_max_thread_num;
+            post.max_batch = 8;
+            post.batch_delay_us = param.postprocess_batch_delay_us;
+            post.queue_type = param.postprocess_queue_type;
+            post.queue_size = param.postprocess_queue_size;
+            post.work_stealing = param.postprocess_work_stealing;
+            post.placement = param.postprocess_placement;
+            post.wait_profile = param.postprocess_wait_profile;
+
+            int p = add_stage(name + ".preprocess", pre, [delegate](std::vector<T> &items) {
+                delegate->preprocess(items);
+            });
+            int i = add_stage(name + ".inference", infer, [delegate](std::vector<T> &items) {
+                delegate->forward(items);
+            });
+            int o = add_stage(name + ".postprocess", post, [delegate](std::vector<T> &items) {
+                delegate->postprocess(items);
+            });
+            if (p < 0 || i < 0 || o < 0 || connect(p, i) != 0 || connect(i, o) != 0) return -1;
+            if (first != nullptr) *first = p;
+            if (last != nullptr) *last = o;
+            return 0;
+        }
+
+        // Creates the queues and starts the workers; -1 if the edges form a cycle or a stage's
+        // placement could not be applied.
+        int start() {
+            if (m_started) return -1;
+            if (sort_stages() != 0) {
+                std::cerr << "[ERROR] StageGraph::start: the stages form a cycle" << std::endl;
+                return -1;
+            }
+            m_started = true;
+
+            for (auto &st : m_stages) {
+                if (st->param.queue_size > 0 && st->param.min_batch > st->param.queue_size &&
+                    st->param.batch_delay_us == 0) {
+                    std::cout << "WARNING: " << st->name << " waits for batches of " << st->param.min_batch
+                              << " but its queue only holds " << st->param.queue_size << std::endl;
+                }
+                int producer_num = 0;
+                for (int p : st->prev) {
+                    const StageParam &pp = m_stages[p]->param;
+                    producer_num += std::max(pp.thread_num, pp.max_thread_num);
+                }
+                // entry stages are fed by push(), from any number of threads unless promised otherwise
+                if (st->prev.empty()) producer_num = m_single_producer ? 1 : 0;
+                st->que = create_stage_queue<T>(st->name, st->param.queue_type, st->param.queue_size,
+                                                producer_num, std::max(st->param.thread_num, st->param.max_thread_num));
+                st->que->set_wait_profile(st->param.wait_profile);
+            }
+
+            int ret = 0;
+            // sinks first, so that no stage pushes into a queue nobody consumes yet
+            for (auto it = m_order.rbegin(); it != m_order.rend(); ++it) {
+                Stage &st = *m_stages[*it];
+                const StageParam &param = st.param;
+                st.pool.init(st.que.get(), param.thread_num, param.min_batch, std::max(param.min_batch, param.max_batch));
+                st.pool.setWorkStealing(param.work_stealing);
+                st.pool.setBatchDeadline(param.batch_delay_us);
+                if (param.max_thread_num > param.thread_num) {
+                    st.pool.setAutoScale(param.thread_num, param.max_thread_num);
+                }
+                st.pool.setPlacement(param.placement);
+                Stage *pst = &st;
+                ret |= st.pool.startWork([this, pst](std::vector<T> &items) {
+                    size_t num = items.size();
+                    pst->func(items);
+                    deliver(*pst, items);
+                    pst->done.fetch_add(num);
+                    m_drain.notify();
+                });
+            }
+            return ret != 0 ? -1 : 0;
+        }
+
+        // Like BMInferencePipe::push_frame: waits up to wait_ms (0: forever) while a drain is in
+        // progress, BM_INFER_PIPE_BUSY if it is still going on then, -1 if the graph is not running.
+        // Only entry stages, the ones without incoming edges, take items from outside.
+        int push(int id, T &item, long wait_ms = 0) {
+            if (!m_started || m_stopped || !valid(id)) return -1;
+            if (!m_stages[id]->prev.empty()) {
+                std::cerr << "[ERROR] StageGraph::push: " << m_stages[id]->name << " is not an entry stage" << std::endl;
+                return -1;
+            }
+            int ret = m_drain.enter(blocking_queue_deadline_us(wait_ms));
+            if (ret != 0) return ret;
+            // stop() waits for the pushes that got past this point
+            if (m_stopped) {
+                m_drain.leave();
+                return -1;
+            }
+            Stage &st = *m_stages[id];
+            st.in.fetch_add(1);
+            st.que->push(item);
+            m_drain.leave();
+            return 0;
+        }
+
+        int push(int id, T &&item, long wait_ms = 0) { return push(id, item, wait_ms); }
+
+        // Waits up to wait_ms (0: forever) until every item pushed before the call has been through
+        // all the stages it was routed to, flushing partial batches meanwhile. Items still waiting
+        // for a join partner don't count. The graph keeps running afterwards; -1 on timeout.
+        int drain(long wait_ms = 0) {
+            if (!m_started || m_stopped) return 0;
+            if (!m_drain.begin()) {
+                std::cerr << "[ERROR] StageGraph::drain: already draining" << std::endl;
+                return -1;
+            }
+            set_flush(true);
+
+            int64_t deadline_us = blocking_queue_deadline_us(wait_ms);
+            bool drained = m_drain.wait([this] { return m_drain.admitting() == 0; }, deadline_us);
+            // once all predecessors of a stage are done its input count is final
+            for (size_t k = 0; drained && k < m_order.size(); k++) {
+                Stage *st = m_stages[m_order[k]].get();
+                drained = m_drain.wait([st] { return st->done >= st->in; }, deadline_us);
+            }
+
+            set_flush(false);
+            m_drain.end();
+            return drained ? 0 : -1;
+        }
+
+        // End of stream: stops the stages in topological order, so that every item already pushed
+        // runs through the rest of the graph, and joins the workers.
+        int stop() {
+            bool expected = false;
+            if (!m_started || !m_stopped.compare_exchange_strong(expected, true)) return 0;
+            m_drain.close();
+            for (int id : m_order) {
+                m_stages[id]->pool.stopWork();
+            }
+            return 0;
+        }
+
+        QueueStats stage_stats(int id) const {
+            return valid(id) && m_stages[id]->que ? m_stages[id]->que->stats() : QueueStats();
+        }
+
+        std::vector<WorkerStats> worker_stats(int id) const {
+            return valid(id) ? m_stages[id]->pool.workerStats() : std::vector<WorkerStats>();
+        }
+
+        int stage_num() const { return m_stages.size(); }
+
+        const std::string &stage_name(int id) const { return m_stages[id]->name; }
+    };
+} // end namespace bm
+
+#endif //BMUTILITY_STAGE_GRAPH_H
@@ -14,75 +14,720 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
 #include <functional>
 #include <thread>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cerrno>
+#include <time.h>
 
-#ifdef __linux__
+#include <pthread.h>
+#include "bmutility_lockfree.h"
+#include "bmutility_metrics.h"
+#include "bmutility_affinity.h"
+#include "bmutility_object_pool.h"
+#include "bmutility_trace.h"
+
+// BlockingQueue underlying storage, passed as `type`
+enum BlockingQueueType {
+    BLOCKING_QUEUE_STD_QUEUE = 0,
+    BLOCKING_QUEUE_VECTOR = 1,
+    BLOCKING_QUEUE_RING = 2, // lock-free bounded MPMC ring, capacity = limit rounded up to a power of 2
+    BLOCKING_QUEUE_SPSC = 3, // SpscQueue, only valid with exactly one producer and one consumer thread
+};
+
+#define BLOCKING_QUEUE_RING_DEFAULT_CAPACITY 1024
+
+#define BLOCKING_QUEUE_NO_DEADLINE INT64_MAX
+
+// enqueue stamps and wait deadlines, CLOCK_MONOTONIC microseconds
+static inline int64_t blocking_queue_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// wait_ms == 0 waits forever, as in pop_front
+static inline int64_t blocking_queue_deadline_us(long wait_ms) {
+    if (wait_ms == 0) return BLOCKING_QUEUE_NO_DEADLINE;
+    int64_t now = blocking_queue_now_us();
+    if (wait_ms > (BLOCKING_QUEUE_NO_DEADLINE - now) / 1000) return BLOCKING_QUEUE_NO_DEADLINE;
+    return now + (int64_t) wait_ms * 1000;
+}
+
+template<typename Rep, typename Period>
+static inline int64_t blocking_queue_deadline_us(const std::chrono::duration<Rep, Period> &timeout) {
+    int64_t now = blocking_queue_now_us();
+    double us = std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(timeout).count();
+    if (us >= (double) (BLOCKING_QUEUE_NO_DEADLINE - now)) return BLOCKING_QUEUE_NO_DEADLINE;
+    return now + (int64_t) us;
+}
+
+// condvars wait on CLOCK_MONOTONIC so that wall clock steps (NTP, date) don't affect timeouts
+static inline void blocking_queue_cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static inline int blocking_queue_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx, int64_t deadline_us) {
+    if (deadline_us == BLOCKING_QUEUE_NO_DEADLINE) {
+        return pthread_cond_wait(cond, mtx);
+    }
+    if (deadline_us < 0) deadline_us = 0;
+    struct timespec to;
+    to.tv_sec = deadline_us / 1000000;
+    to.tv_nsec = (deadline_us % 1000000) * 1000;
+    return pthread_cond_timedwait(cond, mtx, &to);
+}
+
+// How a thread waits for a queue before parking on its condvar: poll spin_num times with a cpu
+// pause in between, then yield_num times with a yield in between. Parking costs a context switch and
+// tens of microseconds of wakeup latency, spinning costs CPU while the queue is idle.
+struct WaitStrategy {
+    WaitStrategy(int spin = 0, int yield = 0) : spin_num(spin), yield_num(yield) {}
+
+    int spin_num;
+    int yield_num;
+};
+
+enum WaitProfile {
+    WAIT_PROFILE_LOW_CPU = 0,     // park right away (default)
+    WAIT_PROFILE_LOW_LATENCY = 1, // spin and yield for roughly 50-100us first
+};
 
-#include <sys/time.h>
+static inline WaitStrategy wait_strategy_of(int profile) {
+    if (profile == WAIT_PROFILE_LOW_LATENCY) return WaitStrategy(2000, 100);
+    return WaitStrategy(0, 0);
+}
 
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
 #endif
+}
 
-#include <pthread.h>
+// Common interface of the queues a WorkerPool can consume from.
+template<typename T>
+class WorkQueue {
+public:
+    virtual ~WorkQueue() {}
+
+    // push() moves from its argument, so move-only element types such as std::unique_ptr work.
+    // Returns the queue size, or -1 if the queue was stopped before every element could be queued:
+    // those are counted as dropped (and passed to BlockingQueue's drop callback) instead of vanishing.
+    virtual int push(T &data) = 0;
+    virtual int push(std::vector<T> &datas) = 0;
+
+    int push(T &&data) { return push(data); }
+
+    // Never blocks and never drops to make room: queues the elements of datas that fit right now, in
+    // order, and erases them from datas. Returns how many were queued, -1 if the queue is stopped.
+    virtual int try_push(std::vector<T> &datas) = 0;
+
+    // Waits until min_num elements are queued, then moves up to max_num of them to the back of objs.
+    // With max_delay_us >= 0 it also returns once the oldest queued element has waited max_delay_us,
+    // with whatever is queued at that point. Gives up at deadline_us (blocking_queue_now_us() clock,
+    // BLOCKING_QUEUE_NO_DEADLINE waits forever): returns -1 and sets *p_is_timeout. Returns 0 otherwise,
+    // including when the queue is stopped.
+    virtual int pop_wait(std::vector<T> &objs, int min_num, int max_num, int64_t max_delay_us,
+                         int64_t deadline_us, bool *p_is_timeout) = 0;
+
+    // Elements are appended to objs; callers may clear() and reuse one vector across calls so that
+    // steady state does not reallocate the output buffer.
+    int pop_front(std::vector<T> &objs, int min_num, int max_num, long wait_ms = 0,
+                  bool *p_is_timeout = nullptr) {
+        return pop_wait(objs, min_num, max_num, -1, blocking_queue_deadline_us(wait_ms), p_is_timeout);
+    }
+
+    // Adaptive batching: returns as soon as max_num elements are queued, or once the oldest queued
+    // element has waited max_delay_us, with whatever is queued at that point. wait_ms bounds the
+    // wait for the first element like in pop_front (0: forever).
+    int pop_batch(std::vector<T> &objs, int max_num, int64_t max_delay_us, long wait_ms = 0,
+                  bool *p_is_timeout = nullptr) {
+        return pop_wait(objs, max_num, max_num, max_delay_us, blocking_queue_deadline_us(wait_ms), p_is_timeout);
+    }
+
+    // Never blocks, returns the number of elements moved to objs.
+    int try_pop(std::vector<T> &objs, int max_num = 1) {
+        size_t num = objs.size();
+        pop_wait(objs, 1, max_num, -1, 0, nullptr);
+        return objs.size() - num;
+    }
+
+    template<typename Rep, typename Period>
+    int pop_for(std::vector<T> &objs, int min_num, int max_num, const std::chrono::duration<Rep, Period> &timeout,
+                bool *p_is_timeout = nullptr) {
+        return pop_wait(objs, min_num, max_num, -1, blocking_queue_deadline_us(timeout), p_is_timeout);
+    }
+
+    template<typename Clock, typename Duration>
+    int pop_until(std::vector<T> &objs, int min_num, int max_num, const std::chrono::time_point<Clock, Duration> &tp,
+                  bool *p_is_timeout = nullptr) {
+        return pop_wait(objs, min_num, max_num, -1, blocking_queue_deadline_us(tp - Clock::now()), p_is_timeout);
+    }
+
+    virtual void stop() = 0;
+    virtual size_t size() = 0;
+    virtual const std::string &name() = 0;
+
+    // Lock-free snapshot of the queue counters, safe to poll from any thread.
+    QueueStats stats() const {
+        QueueStats st;
+        m_metrics.snapshot(st);
+        st.timestamp_us = blocking_queue_now_us();
+        return st;
+    }
+
+    // While flushing, pops return as soon as one element is queued instead of waiting for min_num,
+    // so that partial batches move on right away (see BMInferencePipe::drain).
+    void set_flush(bool enable) {
+        m_flush.store(enable);
+        this->wake_waiters();
+    }
+
+    // Records the time every element spends in the queue in stats().time_in_queue. Off by default,
+    // it costs a clock read per pushed element and a histogram update per popped one. Set it before
+    // the queue is used.
+    void set_latency_metrics(bool enable) {
+        m_latency_metrics.store(enable);
+        if (enable) m_stamping.store(true);
+    }
+
+    // Applies to both consumers waiting for elements and producers waiting for room. Set it before
+    // the queue is used.
+    void set_wait_strategy(const WaitStrategy &strategy) { m_wait = strategy; }
+
+    void set_wait_profile(int profile) { m_wait = wait_strategy_of(profile); }
+
+protected:
+    QueueMetrics m_metrics;
+    WaitStrategy m_wait;
+    std::atomic<bool> m_flush{false};
+    std::atomic<bool> m_latency_metrics{false};
+    // elements only get their enqueue time once latency metrics or adaptive batching need it
+    std::atomic<bool> m_stamping{false};
+
+    int64_t push_stamp() const {
+        return m_stamping.load(std::memory_order_relaxed) ? blocking_queue_now_us() : 0;
+    }
+
+    // Adaptive batching goes by the enqueue time of the oldest element; the ones queued before its
+    // first pop have none and count as due.
+    void need_stamps(int64_t max_delay_us) {
+        if (max_delay_us >= 0 && !m_stamping.load(std::memory_order_relaxed)) m_stamping.store(true);
+    }
+
+    // dequeue time for the time_in_queue histogram, 0 when it is off
+    int64_t pop_stamp() const {
+        return m_latency_metrics.load(std::memory_order_relaxed) ? blocking_queue_now_us() : 0;
+    }
+
+    void on_time_in_queue(int64_t now, int64_t stamp) {
+        if (now != 0) m_metrics.on_time_in_queue(now - stamp);
+    }
+
+    // wakes parked consumers so that they re-check their condition
+    virtual void wake_waiters() = 0;
+
+    size_t pop_min(int min_num) const {
+        return m_flush.load(std::memory_order_relaxed) && min_num > 1 ? 1 : (size_t)min_num;
+    }
+
+    // Polls ready() according to the wait strategy, true as soon as it holds. false means the caller
+    // has to park.
+    template<typename Pred>
+    bool spin_until(Pred ready) const {
+        // busy polling can't help on a single CPU, the thread we wait for needs it
+        static const bool multi_cpu = std::thread::hardware_concurrency() > 1;
+        for (int i = 0; multi_cpu && i < m_wait.spin_num; i++) {
+            if (ready()) return true;
+            cpu_relax();
+        }
+        for (int i = 0; i < m_wait.yield_num; i++) {
+            if (ready()) return true;
+            std::this_thread::yield();
+        }
+        return ready();
+    }
+
+    // Shared by the queue implementations: how long to park a consumer that has fewer than min_num
+    // elements. Returns false when it should not park at all (the oldest element is already due).
+    static bool pop_wake_time(bool has_front, int64_t front_stamp, int64_t max_delay_us, int64_t deadline_us,
+                              int64_t *wake_us) {
+        *wake_us = deadline_us;
+        if (max_delay_us >= 0 && has_front) {
+            int64_t ready = front_stamp + max_delay_us;
+            if (ready <= blocking_queue_now_us()) return false;
+            if (ready < *wake_us) *wake_us = ready;
+        }
+        return true;
+    }
+
+    static int pop_result(bool stopped, bool is_timeout, bool *p_is_timeout) {
+        if (stopped) {
+            return 0;
+        }
+        if (is_timeout) {
+            if (p_is_timeout) *p_is_timeout = true;
+            return -1;
+        }
+        return 0;
+    }
+};
+
+// Overflow policy of a BlockingQueue. Every queued element gets an increasing sequence number; a
+// policy names the element to drop by its sequence number, which keeps it O(1) for the queue (the
+// element is only marked and skipped when it reaches the front). Policies are called with the
+// queue lock held and must not block; the queue's drop callback runs after the lock is released.
+#define DROP_POLICY_NONE UINT64_MAX
+
+template<typename T>
+class DropPolicy {
+public:
+    virtual ~DropPolicy() {}
+
+    // obj was just queued as seq, oldest_seq is the front of the queue. May return the seq of an
+    // older element to drop right away, or DROP_POLICY_NONE.
+    virtual uint64_t on_push(const T & /*obj*/, uint64_t /*seq*/, uint64_t /*oldest_seq*/) { return DROP_POLICY_NONE; }
+
+    // The queue is full and obj is about to be queued as seq. Returns seq to drop obj itself, or the
+    // seq of a queued element. A seq that is no longer queued is ignored and the policy is asked again,
+    // so a policy must eventually fall back to oldest_seq or seq.
+    virtual uint64_t select_victim(const T &obj, uint64_t seq, uint64_t oldest_seq) = 0;
+};
+
+template<typename T>
+class DropOldestPolicy : public DropPolicy<T> {
+public:
+    uint64_t select_victim(const T & /*obj*/, uint64_t /*seq*/, uint64_t oldest_seq) override { return oldest_seq; }
+};
+
+template<typename T>
+class DropNewestPolicy : public DropPolicy<T> {
+public:
+    uint64_t select_victim(const T & /*obj*/, uint64_t seq, uint64_t /*oldest_seq*/) override { return seq; }
+};
+
+// Drops the oldest queued element matching pred (e.g. a non-keyframe packet, a low priority
+// stream), then the incoming one if it matches, otherwise falls back to the oldest element.
+template<typename T>
+class DropIfPolicy : public DropPolicy<T> {
+    std::function<bool(const T &obj)> m_pred;
+    std::deque<uint64_t> m_candidates;
+public:
+    explicit DropIfPolicy(std::function<bool(const T &obj)> pred) : m_pred(pred) {}
+
+    uint64_t on_push(const T &obj, uint64_t seq, uint64_t oldest_seq) override {
+        while (!m_candidates.empty() && m_candidates.front() < oldest_seq) m_candidates.pop_front();
+        if (m_pred(obj)) m_candidates.push_back(seq);
+        return DROP_POLICY_NONE;
+    }
+
+    uint64_t select_victim(const T &obj, uint64_t seq, uint64_t oldest_seq) override {
+        while (!m_candidates.empty()) {
+            uint64_t victim = m_candidates.front();
+            m_candidates.pop_front();
+            if (victim >= oldest_seq) return victim;
+        }
+        return m_pred(obj) ? seq : oldest_seq;
+    }
+};
+
+// Keeps at most n queued elements per key (e.g. stream id) by dropping that key's oldest element
+// on push; a full queue drops its oldest element.
+template<typename T>
+class KeepLatestPerKeyPolicy : public DropPolicy<T> {
+    std::function<int(const T &obj)> m_key_fn;
+    size_t m_keep_num;
+    std::unordered_map<int, std::deque<uint64_t>> m_keys;
+public:
+    KeepLatestPerKeyPolicy(std::function<int(const T &obj)> key_fn, size_t keep_num)
+            : m_key_fn(key_fn), m_keep_num(keep_num > 0 ? keep_num : 1) {}
+
+    // Consumption is FIFO, so the queued elements of a key are always the newest of its seqs: when
+    // the (n+1)-th newest one has already left the queue, the queue drops nothing.
+    uint64_t on_push(const T &obj, uint64_t seq, uint64_t /*oldest_seq*/) override {
+        auto &seqs = m_keys[m_key_fn(obj)];
+        seqs.push_back(seq);
+        if (seqs.size() <= m_keep_num) return DROP_POLICY_NONE;
+        uint64_t victim = seqs.front();
+        seqs.pop_front();
+        return victim;
+    }
 
-static int cpu_index = 0;
+    uint64_t select_victim(const T & /*obj*/, uint64_t /*seq*/, uint64_t oldest_seq) override { return oldest_seq; }
+};
 
 template<typename T>
-class BlockingQueue {
+class BlockingQueue : public WorkQueue<T> {
+public:
+    using WorkQueue<T>::push;
+
 private:
+    struct Entry {
+        T value;
+        int64_t stamp; // enqueue time, blocking_queue_now_us()
+        uint64_t seq;  // sequence number the drop policy knows the entry by
+        bool dropped;  // removed by the drop policy, skipped when it reaches the front
+    };
+
+    // Queue and vector mode keep dropped entries in place until they reach the front, or until
+    // there are more of them than live entries (see maybe_compact). m_live counts the live ones.
     size_t size_impl() const {
-        return m_type == 0 ? m_queue.size() : m_vec.size();
+        if (m_type == BLOCKING_QUEUE_RING) return m_ring->size();
+        return m_live;
+    }
+
+    size_t phys_size() const {
+        return m_type == 0 ? m_queue.size() : m_vec.size() - m_vec_head;
+    }
+
+    Entry &phys_at(size_t i) {
+        return m_type == 0 ? m_queue[i] : m_vec[m_vec_head + i];
+    }
+
+    // Vector mode keeps a head offset instead of erasing the front, and compacts only once the
+    // consumed prefix is at least half of the vector, so popping k elements costs O(k) amortized.
+    void phys_pop_front() {
+        if (m_type == 0) {
+            m_queue.pop_front();
+        } else {
+            m_vec_head++;
+            if (m_vec_head == m_vec.size()) {
+                m_vec.clear();
+                m_vec_head = 0;
+            } else if (m_vec_head * 2 >= m_vec.size()) {
+                m_vec.erase(m_vec.begin(), m_vec.begin() + m_vec_head);
+                m_vec_head = 0;
+            }
+        }
+    }
+
+    uint64_t front_seq() {
+        return phys_size() > 0 ? phys_at(0).seq : m_next_seq;
+    }
+
+    // Physical index of the entry with sequence number seq, phys_size() if it is no longer queued.
+    // Sequence numbers grow by at least one per entry, so without a compaction in between the entry
+    // is at seq - front_seq(), otherwise before that.
+    size_t seq_index(uint64_t seq) {
+        size_t n = phys_size();
+        if (n == 0 || seq < phys_at(0).seq) return n;
+        size_t hi = std::min<uint64_t>(seq - phys_at(0).seq, n - 1);
+        if (phys_at(hi).seq == seq) return hi;
+        size_t lo = 0;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (phys_at(mid).seq < seq) lo = mid + 1; else hi = mid;
+        }
+        return phys_at(lo).seq == seq ? lo : n;
+    }
+
+    // A consumer that stalls behind a live front would let dropped entries pile up without bound:
+    // once they outnumber the limit and the live ones, they are removed in one pass, which keeps
+    // dropping O(1) amortized.
+    void maybe_compact() {
+        size_t dead = phys_size() - m_live;
+        if (dead <= std::max<size_t>(std::max<size_t>(m_limit > 0 ? m_limit : 0, m_live), 16)) return;
+        auto is_dropped = [](const Entry &e) { return e.dropped; };
+        if (m_type == 0) {
+            m_queue.erase(std::remove_if(m_queue.begin(), m_queue.end(), is_dropped), m_queue.end());
+        } else {
+            m_vec.erase(m_vec.begin(), m_vec.begin() + m_vec_head);
+            m_vec_head = 0;
+            m_vec.erase(std::remove_if(m_vec.begin(), m_vec.end(), is_dropped), m_vec.end());
+        }
+    }
+
+    void trim_front() {
+        while (phys_size() > 0 && phys_at(0).dropped) phys_pop_front();
+    }
+
+    // Moves up to max_num elements to the back of objs.
+    int pop_impl(std::vector<T> &objs, int max_num) {
+        int oc = std::min<int>(max_num, m_live);
+        if (oc <= 0) return 0;
+        // at least doubling, so that repeated appends to one vector stay amortized O(1)
+        if (objs.capacity() < objs.size() + oc) objs.reserve(std::max(objs.size() + oc, objs.capacity() * 2));
+        int64_t now = this->pop_stamp();
+        for (int i = 0; i < oc; i++) {
+            this->on_time_in_queue(now, phys_at(0).stamp);
+            objs.push_back(std::move(phys_at(0).value));
+            phys_pop_front();
+            trim_front();
+        }
+        this->m_metrics.on_pop(oc);
+        m_live -= oc;
+        return oc;
     }
 
-    void wait_and_push_one(T &&data) {
+    // Moves the element with sequence number seq to dropped if it is still queued.
+    bool drop_seq_impl(uint64_t seq, std::vector<T> &dropped) {
+        size_t i = seq_index(seq);
+        if (i == phys_size()) return false;
+        Entry &e = phys_at(i);
+        if (e.dropped) return false;
+        e.dropped = true;
+        dropped.push_back(std::move(e.value));
+        m_live--;
+        trim_front();
+        maybe_compact();
+        return true;
+    }
+
+    bool front_stamp_impl(int64_t &stamp) {
+        if (m_type == BLOCKING_QUEUE_RING) return m_ring->front_stamp(stamp);
+        if (m_live == 0) return false;
+        stamp = phys_at(0).stamp;
+        return true;
+    }
+
+    // A full queue without drop handling blocks the producer in wait_and_push_one, poll for room
+    // before taking the lock to get there
+    void spin_for_room() {
+        if (m_limit <= 0 || m_policy != nullptr || m_drop_fn != nullptr) return;
+        if (m_size_hint.load(std::memory_order_relaxed) < (size_t)m_limit) return;
+        this->spin_until([this] { return m_size_hint.load(std::memory_order_relaxed) < (size_t)m_limit || m_stop; });
+    }
+
+    // drop callbacks run without the queue lock
+    void notify_dropped(std::vector<T> &dropped) {
+        this->m_metrics.on_drop(dropped.size());
+        if (m_drop_fn == nullptr) return;
+        for (auto &obj : dropped) m_drop_fn(obj);
+    }
+
+    // Parks on m_pop_condv until min_num elements are queued (see pop_wait). Called with m_qmtx held.
+    void wait_for_pop(int min_num, int64_t max_delay_us, int64_t deadline_us, bool &is_timeout) {
+        int64_t stamp = 0, wake_us, wait_start = 0;
+        while (this->size_impl() < this->pop_min(min_num) && !m_stop) {
+            bool has_front = max_delay_us >= 0 && this->front_stamp_impl(stamp);
+            if (!WorkQueue<T>::pop_wake_time(has_front, stamp, max_delay_us, deadline_us, &wake_us)) break;
+            if (wait_start == 0 && wake_us > 0) wait_start = blocking_queue_now_us();
+            if (blocking_queue_cond_wait(&m_pop_condv, &m_qmtx, wake_us) == ETIMEDOUT && wake_us == deadline_us) {
+                // adaptive batching hands out whatever is queued when the caller's deadline expires
+                if (max_delay_us < 0 || this->size_impl() == 0) is_timeout = true;
+                break;
+            }
+        }
+        if (wait_start != 0) this->m_metrics.on_pop_wait(blocking_queue_now_us() - wait_start);
+    }
+
+    // The ring path only takes m_qmtx to park when the ring is full or empty. Waiter counts are
+    // published before re-checking the ring, and the other side checks them after its ring
+    // operation; the seq_cst fences on both sides make sure one of them sees the other.
+    void ring_wake_consumers() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_pop_waiters.load(std::memory_order_relaxed) > 0) {
+            pthread_mutex_lock(&m_qmtx);
+            pthread_cond_broadcast(&m_pop_condv);
+            pthread_mutex_unlock(&m_qmtx);
+        }
+    }
+
+    void ring_wake_producers() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_push_waiters.load(std::memory_order_relaxed) > 0) {
+            pthread_mutex_lock(&m_qmtx);
+            pthread_cond_broadcast(&m_push_condv);
+            pthread_mutex_unlock(&m_qmtx);
+        }
+    }
+
+    // false if the queue was stopped: data is then counted and handed to the drop callback. The
+    // caller counts the push.
+    bool ring_push_one(T &&data, int64_t stamp) {
+        while (!m_ring->try_push(std::move(data), stamp)) {
+            if (m_stop) {
+                this->m_metrics.on_drop(1);
+                if (m_drop_fn != nullptr) m_drop_fn(data);
+                return false;
+            }
+            if (m_policy != nullptr) {
+                // the ring can't remove from the middle: a policy only chooses between the incoming
+                // element (seq 1) and the oldest one (seq 0)
+                pthread_mutex_lock(&m_qmtx);
+                bool drop_incoming = m_policy->select_victim(data, 1, 0) == 1;
+                pthread_mutex_unlock(&m_qmtx);
+                if (drop_incoming) {
+                    this->m_metrics.on_drop(1);
+                    if (m_drop_fn != nullptr) m_drop_fn(data);
+                    return true;
+                }
+                if (m_ring->try_consume([this](T &o, int64_t) { if (m_drop_fn != nullptr) m_drop_fn(o); })) {
+                    this->m_metrics.on_drop(1);
+                }
+                continue;
+            }
+            if (m_drop_fn != nullptr) {
+                // flow control by dropping the oldest element, no lock is held here
+                if (m_ring->try_consume([this](T &o, int64_t) { m_drop_fn(o); })) {
+                    this->m_metrics.on_drop(1);
+                }
+                continue;
+            }
+            int64_t block_start = blocking_queue_now_us();
+            if (!this->spin_until([this] { return m_ring->size() < m_ring->capacity() || m_stop; })) {
+                pthread_mutex_lock(&m_qmtx);
+                m_push_waiters.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                while (m_ring->size() >= m_ring->capacity() && !m_stop) {
+                    pthread_cond_wait(&m_push_condv, &m_qmtx);
+                }
+                m_push_waiters.fetch_sub(1);
+                pthread_mutex_unlock(&m_qmtx);
+            }
+            this->m_metrics.on_push_block(blocking_queue_now_us() - block_start);
+        }
+
+        size_t num = m_ring->size();
+        if (num >= (size_t)m_warning && num % 100 == 0) {
+            std::cout << "WARNING: " << m_name << " queue_size is " << num << std::endl;
+        }
+        return true;
+    }
+
+    int ring_pop_wait(std::vector<T> &objs, int min_num, int max_num, int64_t max_delay_us, int64_t deadline_us,
+                      bool &is_timeout) {
+        int oc = 0;
+        while (true) {
+            if (m_ring->size() < this->pop_min(min_num) && !m_stop) {
+                if (deadline_us == 0 && max_delay_us < 0) {
+                    // try_pop, don't touch the mutex
+                    is_timeout = true;
+                    break;
+                }
+                if (!this->spin_until([this, min_num] { return m_ring->size() >= this->pop_min(min_num) || m_stop; })) {
+                    pthread_mutex_lock(&m_qmtx);
+                    m_pop_waiters.fetch_add(1);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    this->wait_for_pop(min_num, max_delay_us, deadline_us, is_timeout);
+                    m_pop_waiters.fetch_sub(1);
+                    pthread_mutex_unlock(&m_qmtx);
+                    if (is_timeout) break;
+                }
+            }
+
+            int64_t now = this->pop_stamp();
+            int got = 0;
+            while (oc < max_num && m_ring->try_consume([this, &objs, now](T &o, int64_t stamp) {
+                this->on_time_in_queue(now, stamp);
+                objs.push_back(std::move(o));
+            })) {
+                oc++;
+                got++;
+            }
+            this->m_metrics.on_pop(got);
+            // other consumers may have raced us to the elements, wait again unless stopped
+            if (oc > 0 || m_stop) break;
+            if (deadline_us != BLOCKING_QUEUE_NO_DEADLINE && blocking_queue_now_us() >= deadline_us) {
+                is_timeout = true;
+                break;
+            }
+        }
+
+        if (oc > 0) {
+            ring_wake_producers();
+        }
+        return oc;
+    }
+
+    // The caller counts the push.
+    void wait_and_push_one(T &&data, int64_t stamp, std::vector<T> &dropped) {
         if (m_limit > 0 && this->size_impl() >= m_limit && !m_stop) {
 # if USE_DEBUG
             std::cout << "WARNING: " << m_name << " queue_size(" << this->size_impl() << ") > "
                       << m_limit << std::endl;
 # endif
             // flow control by dropping
-            if (m_drop_fn != nullptr) {
-                this->drop_half_();
+            if (m_policy != nullptr) {
+                uint64_t seq = m_next_seq;
+                while (true) {
+                    uint64_t victim = m_policy->select_victim(data, seq, front_seq());
+                    if (victim == seq) {
+                        m_next_seq++;
+                        dropped.push_back(std::move(data));
+                        return;
+                    }
+                    if (this->drop_seq_impl(victim, dropped)) break;
+                }
+            } else if (m_drop_fn != nullptr) {
+                this->drop_half_(dropped);
 # if USE_DEBUG
                 std::cout << m_name << " queue_size after dropping, size: " << this->size_impl() << std::endl;
 # endif
             } else {
                 // blocking
+                int64_t block_start = blocking_queue_now_us();
                 do {
                     pthread_cond_wait(&m_push_condv, &m_qmtx);
                 } while (m_limit > 0 && this->size_impl() >= m_limit && !m_stop);
+                this->m_metrics.on_push_block(blocking_queue_now_us() - block_start);
             }
         } else if (this->size_impl() >= m_warning && !m_stop && this->size_impl() % 100 == 0) {
             std::cout << "WARNING: " << m_name << " queue_size is " << this->size_impl() << std::endl;
         }
 
         if (m_type == 0) {
-            m_queue.push(std::move(data));
+            m_queue.push_back(Entry{std::move(data), stamp, m_next_seq, false});
         } else {
-            m_vec.push_back(std::move(data));
+            m_vec.push_back(Entry{std::move(data), stamp, m_next_seq, false});
         }
+        uint64_t seq = m_next_seq++;
+        m_live++;
+        if (m_policy != nullptr) {
+            uint64_t victim = m_policy->on_push(phys_at(phys_size() - 1).value, seq, front_seq());
+            if (victim != DROP_POLICY_NONE && victim < seq) this->drop_seq_impl(victim, dropped);
+        }
+    }
+
+    void wake_waiters() override {
+        pthread_mutex_lock(&m_qmtx);
+        pthread_cond_broadcast(&m_pop_condv);
+        pthread_mutex_unlock(&m_qmtx);
     }
 
 public:
     BlockingQueue(const std::string &name = "", int type = 0, int limit = 0, int warning = 32)
-            : m_stop(false), m_limit(limit), m_drop_fn(nullptr), m_warning(warning) {
+            : m_stop(false), m_vec_head(0), m_live(0), m_size_hint(0), m_next_seq(0), m_ring(nullptr), m_pop_waiters(0),
+              m_push_waiters(0), m_limit(limit), m_drop_fn(nullptr), m_warning(warning) {
         m_name = name;
         m_type = type;
+        if (m_type == BLOCKING_QUEUE_RING) {
+            m_ring = new MpmcRing<T>(limit > 0 ? limit : BLOCKING_QUEUE_RING_DEFAULT_CAPACITY);
+        }
         pthread_mutex_init(&m_qmtx, NULL);
-        pthread_cond_init(&m_push_condv, NULL);
-        pthread_cond_init(&m_pop_condv, NULL);
+        blocking_queue_cond_init(&m_push_condv);
+        blocking_queue_cond_init(&m_pop_condv);
     }
 
     ~BlockingQueue() {
         pthread_mutex_lock(&m_qmtx);
-        std::cout << "destroy " << m_name << ",size:" << m_queue.size() + m_vec.size() << std::endl;
+        std::cout << "destroy " << m_name << ",size:" << this->size_impl() << std::endl;
         m_vec.clear();
-        std::queue<T> empty;
-        m_queue.swap(empty);
+        m_vec_head = 0;
+        m_queue.clear();
+        m_live = 0;
+        delete m_ring;
+        m_ring = nullptr;
         pthread_mutex_unlock(&m_qmtx);
+        pthread_cond_destroy(&m_push_condv);
+        pthread_cond_destroy(&m_pop_condv);
+        pthread_mutex_destroy(&m_qmtx);
     }
 
-    void stop() {
+    void stop() override {
         pthread_mutex_lock(&m_qmtx);
         m_stop = true;
         std::cout << "stop blocking queue:" << m_name << std::endl;
@@ -91,205 +736,1101 @@ public:
         pthread_mutex_unlock(&m_qmtx);
     }
 
-    int push(T &data) {
+    int push(T &data) override {
+        if (m_type == BLOCKING_QUEUE_RING) {
+            bool pushed = this->ring_push_one(std::move(data), this->push_stamp());
+            this->m_metrics.on_push(1, m_ring->size());
+            if (!pushed) return -1;
+            ring_wake_consumers();
+            return m_ring->size();
+        }
+
+        std::vector<T> dropped;
+        this->spin_for_room();
         pthread_mutex_lock(&m_qmtx);
 
-        this->wait_and_push_one(std::move(data));
+        this->wait_and_push_one(std::move(data), this->push_stamp(), dropped);
         int num = this->size_impl();
+        m_size_hint.store(num, std::memory_order_relaxed);
+        this->m_metrics.on_push(1, m_live);
         pthread_cond_broadcast(&m_pop_condv);
 
         pthread_mutex_unlock(&m_qmtx);
 
+        this->notify_dropped(dropped);
         return num;
     }
 
-    int push(std::vector<T> &datas) {
-        int num;
+    int push(std::vector<T> &datas) override {
+        int num = 0;
+        int64_t stamp = this->push_stamp();
+        if (m_type == BLOCKING_QUEUE_RING) {
+            for (auto &data : datas) {
+                // once stopped, the rest of the batch is dropped one by one
+                if (!this->ring_push_one(std::move(data), stamp)) num = -1;
+            }
+            this->m_metrics.on_push(datas.size(), m_ring->size());
+            ring_wake_consumers();
+            return num < 0 ? -1 : (int) m_ring->size();
+        }
+
+        std::vector<T> dropped;
+        this->spin_for_room();
         pthread_mutex_lock(&m_qmtx);
 
-        for (auto &data : datas) {
-            this->wait_and_push_one(std::move(data));
-            if (m_stop) goto err;
+        for (size_t i = 0; i < datas.size(); i++) {
+            this->wait_and_push_one(std::move(datas[i]), stamp, dropped);
+            m_size_hint.store(m_live, std::memory_order_relaxed);
+            if (m_stop) {
+                // the elements not queued yet are dropped rather than left behind unnoticed
+                for (i++; i < datas.size(); i++) dropped.push_back(std::move(datas[i]));
+                goto err;
+            }
             pthread_cond_signal(&m_pop_condv);
         }
         num = this->size_impl();
+        this->m_metrics.on_push(datas.size(), m_live);
 
         pthread_mutex_unlock(&m_qmtx);
+        this->notify_dropped(dropped);
         return num;
 
         err:
+        this->m_metrics.on_push(datas.size(), m_live);
+        pthread_cond_broadcast(&m_pop_condv);
         pthread_mutex_unlock(&m_qmtx);
-        return 0;
+        this->notify_dropped(dropped);
+        return -1;
     }
 
-    int pop_front(std::vector<T> &objs, int min_num, int max_num, long wait_ms = 0, bool *p_is_timeout = nullptr) {
-        bool is_timeout = false;
-
-        struct timespec to;
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        double ms0 = now.tv_sec * 1000 + now.tv_usec / 1000.0;
-        //std::cout << m_name << ",pop:" << now.tv_usec / 1000.0 << std::endl;
-        if (wait_ms == 0) {
-            to.tv_sec = now.tv_sec + 9999999;
-            to.tv_nsec = now.tv_usec * 1000UL;
+    int try_push(std::vector<T> &datas) override {
+        size_t num = 0;
+        int64_t stamp = this->push_stamp();
+        if (m_type == BLOCKING_QUEUE_RING) {
+            if (m_stop) return -1;
+            while (num < datas.size() && m_ring->try_push(std::move(datas[num]), stamp)) num++;
+            this->m_metrics.on_push(num, m_ring->size());
+            if (num > 0) ring_wake_consumers();
         } else {
-            int nsec = now.tv_usec * 1000 + (wait_ms % 1000) * 1000000;
-            to.tv_sec = now.tv_sec + nsec / 1000000000 + wait_ms / 1000;
-            to.tv_nsec = nsec % 1000000000;//(now.tv_usec + wait_ms * 1000UL) * 1000UL;
-        }
-        pthread_mutex_lock(&m_qmtx);
-        while ((m_type ? m_vec.size() < min_num : m_queue.size() < min_num) && !m_stop) {
-#ifdef BLOCKING_QUEUE_PERF
-            m_timer.tic();
-#endif
-            // pthread_timestruc_t to;
-            int err = pthread_cond_timedwait(&m_pop_condv, &m_qmtx, &to);
-            if (err == ETIMEDOUT) {
-                is_timeout = true;
-                break;
+            std::vector<T> dropped;
+            pthread_mutex_lock(&m_qmtx);
+            if (m_stop) {
+                pthread_mutex_unlock(&m_qmtx);
+                return -1;
             }
-#ifdef BLOCKING_QUEUE_PERF
-            m_timer.toc();
-    if (m_timer.total_time_ > 1) {
-      m_timer.summary();
-    }
-#endif
-        }
-
-        if (!is_timeout) {
-            if (m_type == 0) {
-                int oc = 0;
-                while (oc < max_num && m_queue.size() > 0) {
-                    auto o = std::move(m_queue.front());
-                    m_queue.pop();
-                    objs.push_back(o);
-                    oc++;
-                }
-            } else {
-                int oc = 0;
-                while (oc < max_num && m_vec.size() > 0) {
-                    auto o = std::move(m_vec[0]);
-                    m_vec.erase(m_vec.begin());
-                    objs.push_back(o);
-                    oc++;
-                }
+            num = datas.size();
+            if (m_limit > 0) num = std::min(num, this->size_impl() < (size_t)m_limit ? m_limit - this->size_impl() : 0);
+            for (size_t i = 0; i < num; i++) {
+                this->wait_and_push_one(std::move(datas[i]), stamp, dropped);
             }
-            pthread_cond_broadcast(&m_push_condv);
+            m_size_hint.store(m_live, std::memory_order_relaxed);
+            this->m_metrics.on_push(num, m_live);
+            if (num > 0) pthread_cond_broadcast(&m_pop_condv);
+            pthread_mutex_unlock(&m_qmtx);
+            // a drop policy may still pick a queued element as victim
+            this->notify_dropped(dropped);
         }
+        datas.erase(datas.begin(), datas.begin() + num);
+        return num;
+    }
 
-        pthread_mutex_unlock(&m_qmtx);
+    int pop_wait(std::vector<T> &objs, int min_num, int max_num, int64_t max_delay_us, int64_t deadline_us,
+                 bool *p_is_timeout) override {
+        bool is_timeout = false;
+        this->need_stamps(max_delay_us);
 
-        if (m_stop) {
-            return 0;
+        if (m_type == BLOCKING_QUEUE_RING) {
+            this->ring_pop_wait(objs, min_num, max_num, max_delay_us, deadline_us, is_timeout);
+            return WorkQueue<T>::pop_result(m_stop, is_timeout, p_is_timeout);
         }
 
-        if (is_timeout) {
-            *p_is_timeout = true;
-            return -1;
+        if (deadline_us != 0 && m_size_hint.load(std::memory_order_relaxed) < this->pop_min(min_num)) {
+            this->spin_until([this, min_num] {
+                return m_size_hint.load(std::memory_order_relaxed) >= this->pop_min(min_num) || m_stop;
+            });
+        }
+        pthread_mutex_lock(&m_qmtx);
+        this->wait_for_pop(min_num, max_delay_us, deadline_us, is_timeout);
+        if (!is_timeout) {
+            this->pop_impl(objs, max_num);
+            m_size_hint.store(m_live, std::memory_order_relaxed);
+            pthread_cond_broadcast(&m_push_condv);
         }
+        pthread_mutex_unlock(&m_qmtx);
 
-        return 0;
+        return WorkQueue<T>::pop_result(m_stop, is_timeout, p_is_timeout);
     }
 
-    size_t size() {
+    size_t size() override {
         size_t queue_size;
+        if (m_type == BLOCKING_QUEUE_RING) {
+            return m_ring->size();
+        }
         pthread_mutex_lock(&m_qmtx);
         queue_size = this->size_impl();
         pthread_mutex_unlock(&m_qmtx);
         return queue_size;
     }
 
+    // Called for every dropped element, outside the queue lock. Without a drop policy a full queue
+    // drops every other element (drop_half_).
     int set_drop_fn(std::function<void(T &obj)> fn) {
         m_drop_fn = fn;
         return m_limit;
     }
 
-    void drop_half_() {
-        if (m_type == 0) {
-            std::queue<T> temp;
-            size_t num = m_queue.size();
-            for (size_t i = 0; i < num; i++) {
-                auto elem = m_queue.front();
-                if (i % 2 == 0) {
-                    temp.push(elem);
-                } else {
-                    m_drop_fn(elem);
-                }
-                m_queue.pop();
-            }
-            m_queue.swap(temp);
-        } else {
-            std::vector<T> temp;
-            size_t num = m_vec.size();
-            for (size_t i = 0; i < num; i++) {
-                auto elem = m_vec[i];
-                if (i % 2 == 0) {
-                    temp.push_back(elem);
-                } else {
-                    m_drop_fn(elem);
-                }
+    // Chooses what a full queue drops instead of blocking the producer; nullptr restores blocking
+    // (or drop_half_ when a drop callback is set). Must be set before the queue is used.
+    void set_drop_policy(std::shared_ptr<DropPolicy<T>> policy) {
+        pthread_mutex_lock(&m_qmtx);
+        m_policy = policy;
+        pthread_mutex_unlock(&m_qmtx);
+    }
+
+    void drop_half_(std::vector<T> &dropped) {
+        size_t num = phys_size();
+        size_t live = 0;
+        for (size_t i = 0; i < num; i++) {
+            Entry &e = phys_at(i);
+            if (e.dropped) continue;
+            if (live++ % 2 == 1) {
+                e.dropped = true;
+                dropped.push_back(std::move(e.value));
+                m_live--;
             }
-            m_vec.swap(temp);
         }
+        trim_front();
+        maybe_compact();
     }
 
     void drop(int num = 0) {
-        int queue_size;
+        if (m_type == BLOCKING_QUEUE_RING) {
+            if (num == 0) {
+                num = m_ring->size();
+            }
+            int i = 0;
+            while (i < num && m_ring->try_consume([](T &, int64_t) {})) i++;
+            this->m_metrics.on_drop(i);
+            ring_wake_producers();
+            return;
+        }
+
         pthread_mutex_lock(&m_qmtx);
         if (num == 0) {
             num = this->size_impl();
         }
-        if (this->size_impl() < num)
+        if (this->size_impl() < (size_t)num) {
+            pthread_mutex_unlock(&m_qmtx);
             return;
-        if (m_type == 0) {
-            queue_size = m_queue.size();
-            if (num > queue_size)
-                num = queue_size;
-            for (int i = 0; i < num; i++) {
-                m_queue.pop();
-            }
-        } else {
-            queue_size = m_vec.size();
-            if (num > queue_size)
-                num = queue_size;
-            m_vec.erase(m_vec.begin(), m_vec.begin() + num);
         }
+        for (int i = 0; i < num; i++) {
+            phys_pop_front();
+            trim_front();
+        }
+        m_live -= num;
+        m_size_hint.store(m_live, std::memory_order_relaxed);
+        this->m_metrics.on_drop(num);
         pthread_cond_broadcast(&m_push_condv);
         pthread_mutex_unlock(&m_qmtx);
     }
 
-    const std::string &name() { return m_name; }
+    const std::string &name() override { return m_name; }
 
 private:
-    bool m_stop;
+    std::atomic<bool> m_stop;
     std::string m_name;
-    std::vector<T> m_vec;
-    std::queue<T> m_queue;
+    std::vector<Entry> m_vec;
+    size_t m_vec_head; // index of the front element in m_vec
+    std::deque<Entry> m_queue;
+    size_t m_live;
+    std::atomic<size_t> m_size_hint; // m_live for the spinning phase of a wait, read without the lock
+    uint64_t m_next_seq; // sequence number of the next queued element
+    std::shared_ptr<DropPolicy<T>> m_policy;
+    MpmcRing<T> *m_ring;
+    std::atomic<int> m_pop_waiters;
+    std::atomic<int> m_push_waiters;
     pthread_mutex_t m_qmtx;
     pthread_cond_t m_pop_condv;
     pthread_cond_t m_push_condv;
-    int m_type, m_limit; //0:queue,1:vector
+    int m_type, m_limit; //0:queue,1:vector,2:ring
     int m_warning;
     std::function<void(T &obj)> m_drop_fn;
 };
 
+// Single-producer/single-consumer queue with the BlockingQueue interface. push() must only be
+// called from one thread and the pop functions from one (other) thread. Both sides are wait-free while
+// the ring is neither full nor empty; they only take the mutex to park on the condvars.
 template<typename T>
-class WorkerPool {
-    BlockingQueue<T> *m_work_que;
-    int m_thread_num;
-    using OnWorkItemsCallback = std::function<void(std::vector<T> &item)>;
-    OnWorkItemsCallback m_work_item_func;
-    std::vector<std::thread *> m_threads;
-    int m_max_pop_num;
-    int m_min_pop_num;
+class SpscQueue : public WorkQueue<T> {
 public:
-    WorkerPool() : m_work_que(nullptr), m_thread_num(0), m_work_item_func(nullptr), m_max_pop_num(1),
-                   m_min_pop_num(1) {}
+    using WorkQueue<T>::push;
 
-    virtual ~WorkerPool() {}
+private:
+    void wake_consumer() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_pop_waiters.load(std::memory_order_relaxed) > 0) {
+            pthread_mutex_lock(&m_qmtx);
+            pthread_cond_broadcast(&m_pop_condv);
+            pthread_mutex_unlock(&m_qmtx);
+        }
+    }
+
+    void wake_producer() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_push_waiters.load(std::memory_order_relaxed) > 0) {
+            pthread_mutex_lock(&m_qmtx);
+            pthread_cond_broadcast(&m_push_condv);
+            pthread_mutex_unlock(&m_qmtx);
+        }
+    }
+
+    // stages one element, parking while the ring is full; false if the queue was stopped
+    bool stage_one(T &&data, int64_t stamp) {
+        while (!m_ring.stage(std::move(data), stamp)) {
+            if (m_stop) return false;
+            // let the consumer see what we already staged before waiting for it
+            m_ring.publish();
+            wake_consumer();
+            int64_t block_start = blocking_queue_now_us();
+            if (!this->spin_until([this] { return m_ring.size() < m_ring.capacity() || m_stop; })) {
+                pthread_mutex_lock(&m_qmtx);
+                m_push_waiters.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                while (m_ring.size() >= m_ring.capacity() && !m_stop) {
+                    pthread_cond_wait(&m_push_condv, &m_qmtx);
+                }
+                m_push_waiters.fetch_sub(1);
+                pthread_mutex_unlock(&m_qmtx);
+            }
+            this->m_metrics.on_push_block(blocking_queue_now_us() - block_start);
+        }
+        return true;
+    }
+
+    void wake_waiters() override {
+        pthread_mutex_lock(&m_qmtx);
+        pthread_cond_broadcast(&m_pop_condv);
+        pthread_mutex_unlock(&m_qmtx);
+    }
+
+public:
+    SpscQueue(const std::string &name = "", int limit = 0)
+            : m_name(name), m_ring(limit > 0 ? limit : BLOCKING_QUEUE_RING_DEFAULT_CAPACITY), m_stop(false),
+              m_pop_waiters(0), m_push_waiters(0) {
+        pthread_mutex_init(&m_qmtx, NULL);
+        blocking_queue_cond_init(&m_push_condv);
+        blocking_queue_cond_init(&m_pop_condv);
+    }
+
+    ~SpscQueue() {
+        std::cout << "destroy " << m_name << ",size:" << m_ring.size() << std::endl;
+        pthread_cond_destroy(&m_push_condv);
+        pthread_cond_destroy(&m_pop_condv);
+        pthread_mutex_destroy(&m_qmtx);
+    }
+
+    void stop() override {
+        pthread_mutex_lock(&m_qmtx);
+        m_stop = true;
+        std::cout << "stop spsc queue:" << m_name << std::endl;
+        pthread_cond_broadcast(&m_push_condv);
+        pthread_cond_broadcast(&m_pop_condv);
+        pthread_mutex_unlock(&m_qmtx);
+    }
+
+    int push(T &data) override {
+        if (!stage_one(std::move(data), this->push_stamp())) {
+            this->m_metrics.on_push(1, m_ring.size());
+            this->m_metrics.on_drop(1);
+            return -1;
+        }
+        m_ring.publish();
+        wake_consumer();
+        size_t num = m_ring.size();
+        this->m_metrics.on_push(1, num);
+        return num;
+    }
+
+    // the whole batch becomes visible with one publish
+    int push(std::vector<T> &datas) override {
+        size_t staged = 0;
+        int64_t stamp = this->push_stamp();
+        for (auto &data : datas) {
+            if (!stage_one(std::move(data), stamp)) {
+                // stopped: what was staged still goes out, the rest is dropped
+                m_ring.publish();
+                wake_consumer();
+                this->m_metrics.on_push(datas.size(), m_ring.size());
+                this->m_metrics.on_drop(datas.size() - staged);
+                return -1;
+            }
+            staged++;
+        }
+        m_ring.publish();
+        wake_consumer();
+        size_t num = m_ring.size();
+        this->m_metrics.on_push(staged, num);
+        return num;
+    }
+
+    int try_push(std::vector<T> &datas) override {
+        if (m_stop) return -1;
+        size_t num = 0;
+        int64_t stamp = this->push_stamp();
+        while (num < datas.size() && m_ring.stage(std::move(datas[num]), stamp)) num++;
+        if (num > 0) {
+            m_ring.publish();
+            wake_consumer();
+        }
+        this->m_metrics.on_push(num, m_ring.size());
+        datas.erase(datas.begin(), datas.begin() + num);
+        return num;
+    }
+
+    int pop_wait(std::vector<T> &objs, int min_num, int max_num, int64_t max_delay_us, int64_t deadline_us,
+                 bool *p_is_timeout) override {
+        bool is_timeout = false;
+        this->need_stamps(max_delay_us);
+        if (m_ring.size() < this->pop_min(min_num) && !m_stop) {
+            if (deadline_us == 0 && max_delay_us < 0) {
+                return WorkQueue<T>::pop_result(m_stop, true, p_is_timeout);
+            }
+            int64_t stamp = 0, wake_us, wait_start = blocking_queue_now_us();
+            this->spin_until([this, min_num] { return m_ring.size() >= this->pop_min(min_num) || m_stop; });
+            pthread_mutex_lock(&m_qmtx);
+            m_pop_waiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (m_ring.size() < this->pop_min(min_num) && !m_stop) {
+                bool has_front = max_delay_us >= 0 && m_ring.front_stamp(stamp);
+                if (!WorkQueue<T>::pop_wake_time(has_front, stamp, max_delay_us, deadline_us, &wake_us)) break;
+                if (blocking_queue_cond_wait(&m_pop_condv, &m_qmtx, wake_us) == ETIMEDOUT && wake_us == deadline_us) {
+                    if (max_delay_us < 0 || m_ring.size() == 0) is_timeout = true;
+                    break;
+                }
+            }
+            m_pop_waiters.fetch_sub(1);
+            pthread_mutex_unlock(&m_qmtx);
+            this->m_metrics.on_pop_wait(blocking_queue_now_us() - wait_start);
+        }
+
+        if (!is_timeout) {
+            int64_t now = this->pop_stamp();
+            int oc = m_ring.consume(max_num, [this, &objs, now](T &o, int64_t stamp) {
+                this->on_time_in_queue(now, stamp);
+                objs.push_back(std::move(o));
+            });
+            if (oc > 0) {
+                this->m_metrics.on_pop(oc);
+                wake_producer();
+            }
+        }
+
+        return WorkQueue<T>::pop_result(m_stop, is_timeout, p_is_timeout);
+    }
+
+    size_t size() override { return m_ring.size(); }
+
+    const std::string &name() override { return m_name; }
+
+private:
+    std::string m_name;
+    SpscRing<T> m_ring;
+    std::atomic<bool> m_stop;
+    std::atomic<int> m_pop_waiters;
+    std::atomic<int> m_push_waiters;
+    pthread_mutex_t m_qmtx;
+    pthread_cond_t m_pop_condv;
+    pthread_cond_t m_push_condv;
+};
+
+// Fair-share queue for frames of several streams (cameras): elements are kept in one FIFO per key
+// and batches are assembled by deficit round-robin across the keys that have elements queued, so a
+// 60fps stream can't starve a 5fps one. Each turn a key may hand out weight elements; a batch that
+// fills up in the middle of a turn continues that turn in the next pop. The FIFO of a key that has
+// been empty for FAIR_QUEUE_IDLE_US is freed, so keys of closed streams don't pile up.
+#define FAIR_QUEUE_IDLE_US 1000000
+
+template<typename T>
+class FairQueue : public WorkQueue<T> {
+public:
+    using WorkQueue<T>::push;
+    using KeyFunc = std::function<int(const T &obj)>;
+
+private:
+    struct Entry {
+        T value;
+        int64_t stamp; // enqueue time, blocking_queue_now_us()
+    };
+
+    struct SubQueue {
+        std::deque<Entry> entries;
+        int weight;
+        int deficit;
+        bool active; // in m_active
+        int64_t idle_since; // when entries became empty
+    };
+
+    SubQueue &sub_queue(int key) {
+        auto it = m_subs.find(key);
+        if (it == m_subs.end()) {
+            auto w = m_weights.find(key);
+            SubQueue sq;
+            sq.weight = w == m_weights.end() ? 1 : w->second;
+            sq.deficit = 0;
+            sq.active = false;
+            sq.idle_since = 0;
+            it = m_subs.emplace(key, std::move(sq)).first;
+        }
+        return it->second;
+    }
+
+    // The caller counts the push.
+    void wait_and_push_one(T &&data, int64_t stamp) {
+        if (m_limit > 0 && m_size >= (size_t)m_limit && !m_stop) {
+            int64_t block_start = blocking_queue_now_us();
+            do {
+                pthread_cond_wait(&m_push_condv, &m_qmtx);
+            } while (m_limit > 0 && m_size >= (size_t)m_limit && !m_stop);
+            this->m_metrics.on_push_block(blocking_queue_now_us() - block_start);
+        }
+        int key = m_key_fn(data);
+        SubQueue &sq = sub_queue(key);
+        sq.entries.push_back(Entry{std::move(data), stamp});
+        if (!sq.active) {
+            sq.active = true;
+            m_active.push_back(key);
+        }
+        m_size++;
+        m_size_hint.store(m_size, std::memory_order_relaxed);
+    }
+
+    // frees the FIFOs that have been empty for FAIR_QUEUE_IDLE_US, at most once per that period
+    void evict_idle(int64_t now) {
+        if (now - m_last_evict < FAIR_QUEUE_IDLE_US) return;
+        m_last_evict = now;
+        for (auto it = m_subs.begin(); it != m_subs.end();) {
+            if (!it->second.active && now - it->second.idle_since >= FAIR_QUEUE_IDLE_US) {
+                it = m_subs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
 
-    int init(BlockingQueue<T> *que, int thread_num, int min_pop_num, int max_pop_num) {
+    // deficit round-robin, the key at the front of m_active owns the current turn
+    int pop_impl(std::vector<T> &objs, int max_num) {
+        int oc = 0;
+        int64_t now = this->pop_stamp(), idle_now = 0;
+        while (oc < max_num && !m_active.empty()) {
+            int key = m_active.front();
+            SubQueue &sq = m_subs[key];
+            if (sq.deficit <= 0) sq.deficit = sq.weight;
+            while (oc < max_num && sq.deficit > 0 && !sq.entries.empty()) {
+                this->on_time_in_queue(now, sq.entries.front().stamp);
+                objs.push_back(std::move(sq.entries.front().value));
+                sq.entries.pop_front();
+                sq.deficit--;
+                oc++;
+            }
+            if (sq.entries.empty()) {
+                if (idle_now == 0) idle_now = blocking_queue_now_us();
+                sq.deficit = 0;
+                sq.active = false;
+                sq.idle_since = idle_now;
+                m_active.pop_front();
+            } else if (sq.deficit == 0) {
+                m_active.pop_front();
+                m_active.push_back(key);
+            }
+        }
+        m_size -= oc;
+        this->m_metrics.on_pop(oc);
+        if (idle_now != 0) evict_idle(idle_now);
+        return oc;
+    }
+
+    // oldest element over all keys, a scan over the active keys
+    bool front_stamp_impl(int64_t &stamp) {
+        bool found = false;
+        for (int key : m_active) {
+            int64_t s = m_subs[key].entries.front().stamp;
+            if (!found || s < stamp) stamp = s;
+            found = true;
+        }
+        return found;
+    }
+
+    void wake_waiters() override {
+        pthread_mutex_lock(&m_qmtx);
+        pthread_cond_broadcast(&m_pop_condv);
+        pthread_mutex_unlock(&m_qmtx);
+    }
+
+public:
+    FairQueue(const std::string &name, KeyFunc key_fn, int limit = 0)
+            : m_name(name), m_key_fn(key_fn), m_limit(limit), m_size(0), m_size_hint(0), m_stop(false),
+              m_last_evict(0) {
+        pthread_mutex_init(&m_qmtx, NULL);
+        blocking_queue_cond_init(&m_push_condv);
+        blocking_queue_cond_init(&m_pop_condv);
+    }
+
+    ~FairQueue() {
+        std::cout << "destroy " << m_name << ",size:" << m_size << std::endl;
+        pthread_cond_destroy(&m_push_condv);
+        pthread_cond_destroy(&m_pop_condv);
+        pthread_mutex_destroy(&m_qmtx);
+    }
+
+    // share of a key per round relative to the others, default 1
+    void set_weight(int key, int weight) {
+        if (weight < 1) weight = 1;
+        pthread_mutex_lock(&m_qmtx);
+        m_weights[key] = weight;
+        auto it = m_subs.find(key);
+        if (it != m_subs.end()) it->second.weight = weight;
+        pthread_mutex_unlock(&m_qmtx);
+    }
+
+    void stop() override {
+        pthread_mutex_lock(&m_qmtx);
+        m_stop = true;
+        std::cout << "stop fair queue:" << m_name << std::endl;
+        pthread_cond_broadcast(&m_push_condv);
+        pthread_cond_broadcast(&m_pop_condv);
+        pthread_mutex_unlock(&m_qmtx);
+    }
+
+    int push(T &data) override {
+        pthread_mutex_lock(&m_qmtx);
+        this->wait_and_push_one(std::move(data), this->push_stamp());
+        int num = m_size;
+        this->m_metrics.on_push(1, m_size);
+        pthread_cond_broadcast(&m_pop_condv);
+        pthread_mutex_unlock(&m_qmtx);
+        return num;
+    }
+
+    int push(std::vector<T> &datas) override {
+        int num = 0;
+        int64_t stamp = this->push_stamp();
+        // released after the lock
+        std::vector<T> dropped;
+        pthread_mutex_lock(&m_qmtx);
+        for (size_t i = 0; i < datas.size(); i++) {
+            this->wait_and_push_one(std::move(datas[i]), stamp);
+            if (m_stop) {
+                // the elements not queued yet are dropped as in BlockingQueue, not left to the caller
+                dropped.assign(std::make_move_iterator(datas.begin() + i + 1), std::make_move_iterator(datas.end()));
+                this->m_metrics.on_drop(dropped.size());
+                num = -1;
+                break;
+            }
+        }
+        this->m_metrics.on_push(datas.size(), m_size);
+        if (num == 0) num = m_size;
+        pthread_cond_broadcast(&m_pop_condv);
+        pthread_mutex_unlock(&m_qmtx);
+        return num;
+    }
+
+    int try_push(std::vector<T> &datas) override {
+        int64_t stamp = this->push_stamp();
+        pthread_mutex_lock(&m_qmtx);
+        if (m_stop) {
+            pthread_mutex_unlock(&m_qmtx);
+            return -1;
+        }
+        size_t num = datas.size();
+        if (m_limit > 0) num = std::min(num, m_size < (size_t)m_limit ? m_limit - m_size : 0);
+        for (size_t i = 0; i < num; i++) {
+            this->wait_and_push_one(std::move(datas[i]), stamp);
+        }
+        this->m_metrics.on_push(num, m_size);
+        if (num > 0) pthread_cond_broadcast(&m_pop_condv);
+        pthread_mutex_unlock(&m_qmtx);
+        datas.erase(datas.begin(), datas.begin() + num);
+        return num;
+    }
+
+    int pop_wait(std::vector<T> &objs, int min_num, int max_num, int64_t max_delay_us, int64_t deadline_us,
+                 bool *p_is_timeout) override {
+        bool is_timeout = false;
+        this->need_stamps(max_delay_us);
+        int64_t stamp = 0, wake_us, wait_start = 0;
+
+        if (deadline_us != 0 && m_size_hint.load(std::memory_order_relaxed) < this->pop_min(min_num)) {
+            this->spin_until([this, min_num] {
+                return m_size_hint.load(std::memory_order_relaxed) >= this->pop_min(min_num) || m_stop;
+            });
+        }
+        pthread_mutex_lock(&m_qmtx);
+        while (m_size < this->pop_min(min_num) && !m_stop) {
+            bool has_front = max_delay_us >= 0 && this->front_stamp_impl(stamp);
+            if (!WorkQueue<T>::pop_wake_time(has_front, stamp, max_delay_us, deadline_us, &wake_us)) break;
+            if (wait_start == 0 && wake_us > 0) wait_start = blocking_queue_now_us();
+            if (blocking_queue_cond_wait(&m_pop_condv, &m_qmtx, wake_us) == ETIMEDOUT && wake_us == deadline_us) {
+                if (max_delay_us < 0 || m_size == 0) is_timeout = true;
+                break;
+            }
+        }
+        if (wait_start != 0) this->m_metrics.on_pop_wait(blocking_queue_now_us() - wait_start);
+        if (!is_timeout) {
+            if (this->pop_impl(objs, max_num) > 0) pthread_cond_broadcast(&m_push_condv);
+            m_size_hint.store(m_size, std::memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&m_qmtx);
+
+        return WorkQueue<T>::pop_result(m_stop, is_timeout, p_is_timeout);
+    }
+
+    size_t size() override {
+        pthread_mutex_lock(&m_qmtx);
+        size_t queue_size = m_size;
+        pthread_mutex_unlock(&m_qmtx);
+        return queue_size;
+    }
+
+    const std::string &name() override { return m_name; }
+
+private:
+    std::string m_name;
+    KeyFunc m_key_fn;
+    int m_limit;
+    size_t m_size;
+    std::atomic<size_t> m_size_hint; // m_size for the spinning phase of a pop, read without the lock
+    std::atomic<bool> m_stop;
+    std::unordered_map<int, SubQueue> m_subs;
+    std::unordered_map<int, int> m_weights;
+    std::deque<int> m_active; // keys with queued elements, in round-robin order
+    int64_t m_last_evict;
+    pthread_mutex_t m_qmtx;
+    pthread_cond_t m_pop_condv;
+    pthread_cond_t m_push_condv;
+};
+
+// Creates the queue for a BlockingQueueType; BLOCKING_QUEUE_SPSC returns an SpscQueue.
+template<typename T>
+std::shared_ptr<WorkQueue<T>> create_work_queue(const std::string &name, int type, int limit = 0, int warning = 32) {
+    if (type == BLOCKING_QUEUE_SPSC) {
+        return std::make_shared<SpscQueue<T>>(name, limit);
+    }
+    return std::make_shared<BlockingQueue<T>>(name, type, limit, warning);
+}
+
+template<typename T>
+class WorkerPool {
+    WorkQueue<T> *m_work_que;
+    int m_thread_num;
+    using OnWorkItemsCallback = std::function<void(std::vector<T> &item)>;
+    using OnWorkerIdleCallback = std::function<void(int index)>;
+    using TraceIdFunc = std::function<uint64_t(const T &item)>;
+    OnWorkItemsCallback m_work_item_func;
+    OnWorkerIdleCallback m_idle_func;
+    std::vector<std::thread *> m_threads;
+    int m_max_pop_num;
+    int m_min_pop_num;
+    // work stealing: each worker grabs up to m_steal_chunk batches from the shared queue at once and
+    // parks the extra batches in its own deque, idle workers steal them. 0 disables it.
+    int m_steal_chunk;
+    std::vector<ChaseLevDeque<std::vector<T> *> *> m_deques;
+    // idle workers in steal_work_loop, under m_steal_mtx: whether one of them waits on the shared
+    // queue, and whether that one found it stopped
+    bool m_steal_leader;
+    bool m_steal_stop;
+    std::atomic<int> m_steal_waiters;
+    pthread_mutex_t m_steal_mtx;
+    pthread_cond_t m_steal_condv;
+    // batch vectors parked in the deques, recycled with their capacity
+    ObjectPool<std::vector<T>> *m_batch_pool;
+    // adaptive batching deadline, 0: wait for min_pop_num elements
+    int64_t m_batch_delay_us;
+    std::vector<WorkerMetrics *> m_metrics;
+    // autoscaling: a monitor thread keeps between m_min_thread_num and m_max_thread_num workers
+    // running, m_max_thread_num == 0 disables it. Workers [0, m_active_num) run, the others are
+    // retired (m_retire set) or not started. m_exited[i] is set once the thread of slot i returned.
+    int m_min_thread_num;
+    int m_max_thread_num;
+    int m_scale_interval_ms;
+    std::atomic<int> m_active_num;
+    std::atomic<bool> *m_retire;
+    std::atomic<bool> *m_exited;
+    std::thread *m_monitor;
+    bool m_monitor_stop;
+    pthread_mutex_t m_monitor_mtx;
+    pthread_cond_t m_monitor_condv;
+    // placement: one cpuset per worker slot, empty without a placement policy
+    bm::CpuPlacement m_placement;
+    std::vector<cpu_set_t> m_cpusets;
+    // startWork releases the workers once all of them are pinned and have their buffers
+    int m_start_pending;
+    int m_start_error;
+    bool m_start_go;
+    pthread_mutex_t m_start_mtx;
+    pthread_cond_t m_start_condv;
+    // tracing, see setTracer()
+    bm::Tracer *m_tracer;
+    int m_trace_track;
+    TraceIdFunc m_trace_id_func;
+
+    static int &current_index() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    // runs the callback on a batch and accounts its time to worker index; the size is taken before
+    // the callback, which may erase items (e.g. shed frames)
+    void process(int index, std::vector<T> &items) {
+        int64_t start = blocking_queue_now_us();
+        if (m_tracer != nullptr && m_tracer->enabled()) {
+            trace_process(index, items, start);
+            return;
+        }
+        size_t num = items.size();
+        m_work_item_func(items);
+        m_metrics[index]->on_batch(num, blocking_queue_now_us() - start);
+    }
+
+    // process() with a record of the batch and of each sampled item; the ids are taken before the
+    // callback, which may move the items on
+    void trace_process(int index, std::vector<T> &items, int64_t start) {
+        static thread_local std::vector<uint64_t> ids;
+        ids.clear();
+        for (auto &item : items) {
+            uint64_t id = m_trace_id_func(item);
+            if (m_tracer->sampled(id)) ids.push_back(id);
+        }
+        size_t num = items.size();
+        m_work_item_func(items);
+        int64_t end = blocking_queue_now_us();
+        m_metrics[index]->on_batch(num, end - start);
+        for (auto id : ids) m_tracer->record(m_trace_track, bm::TRACE_RUN, id, start, end);
+        m_tracer->record(m_trace_track, bm::TRACE_BATCH, num, start, end);
+    }
+
+    // records when the sampled items from first on left the queue; they may still wait in a deque or
+    // for the callback to start
+    void trace_dequeue(const std::vector<T> &items, size_t first = 0) {
+        if (m_tracer == nullptr || !m_tracer->enabled()) return;
+        int64_t now = blocking_queue_now_us();
+        for (size_t i = first; i < items.size(); i++) {
+            uint64_t id = m_trace_id_func(items[i]);
+            if (m_tracer->sampled(id)) m_tracer->record(m_trace_track, bm::TRACE_DEQUEUE, id, now);
+        }
+    }
+
+    int pop_work(std::vector<T> &items, int max_num, long wait_ms, bool *p_is_timeout) {
+        if (m_batch_delay_us > 0) {
+            return m_work_que->pop_batch(items, max_num, m_batch_delay_us, wait_ms, p_is_timeout);
+        }
+        return m_work_que->pop_front(items, m_min_pop_num, max_num, wait_ms, p_is_timeout);
+    }
+
+    void work_loop(int index) {
+        // with autoscaling the wait is bounded so that a retired worker notices it in time; the
+        // flag is only checked between batches, so a popped batch is always processed
+        long wait_ms = m_max_thread_num > 0 ? m_scale_interval_ms : 0;
+        // one batch buffer per worker, reused for every batch
+        std::vector<T> items;
+        items.reserve(m_max_pop_num);
+        while (m_retire == nullptr || !m_retire[index]) {
+            items.clear();
+            //if (m_work_que->size() < 4) { bm::usleep(10); continue; }
+            bool is_timeout = false;
+            if (m_idle_func != nullptr) {
+                // the idle callback only runs when no batch is ready right now
+                if (m_work_que->pop_wait(items, m_min_pop_num, m_max_pop_num, -1, 0, nullptr) == 0 &&
+                    !items.empty()) {
+                    trace_dequeue(items);
+                    process(index, items);
+                    continue;
+                }
+                m_idle_func(index);
+            }
+            int64_t idle_start = blocking_queue_now_us();
+            int ret = this->pop_work(items, m_max_pop_num, wait_ms, &is_timeout);
+            m_metrics[index]->on_idle(blocking_queue_now_us() - idle_start);
+            if (ret != 0) {
+                if (is_timeout) continue;
+                break;
+            }
+            if (items.empty())
+                break;
+            trace_dequeue(items);
+            process(index, items);
+        }
+        if (m_idle_func != nullptr) m_idle_func(index);
+    }
+
+    void thread_main(int i) {
+        int ret = 0;
+        if (!m_cpusets.empty()) {
+            ret = bm::set_thread_affinity(pthread_self(), &m_cpusets[i]);
+        }
+        // allocated after pinning, so that first touch places it on the worker's NUMA node
+        if (m_steal_chunk > 0) {
+            m_deques[i] = new ChaseLevDeque<std::vector<T> *>(m_steal_chunk * 2);
+        }
+
+        pthread_mutex_lock(&m_start_mtx);
+        if (ret != 0) m_start_error = ret;
+        m_start_pending--;
+        pthread_cond_broadcast(&m_start_condv);
+        while (!m_start_go) {
+            pthread_cond_wait(&m_start_condv, &m_start_mtx);
+        }
+        pthread_mutex_unlock(&m_start_mtx);
+
+        current_index() = i;
+        if (m_tracer != nullptr) {
+            m_tracer->name_thread(m_tracer->track_name(m_trace_track) + "#" + std::to_string(i));
+        }
+        if (m_steal_chunk > 0) {
+            steal_work_loop(i);
+        } else {
+            work_loop(i);
+        }
+        if (m_exited != nullptr) m_exited[i] = true;
+    }
+
+    // Starts the workers of slots [first, first + num) and waits until they are pinned and have
+    // their buffers; returns the error of a failed pinning, the workers then run unpinned.
+    int start_threads(int first, int num) {
+        pthread_mutex_lock(&m_start_mtx);
+        m_start_pending = num;
+        m_start_error = 0;
+        pthread_mutex_unlock(&m_start_mtx);
+        for (int i = first; i < first + num; ++i) {
+            m_threads[i] = new std::thread([this, i] { thread_main(i); });
+        }
+        pthread_mutex_lock(&m_start_mtx);
+        while (m_start_pending > 0) {
+            pthread_cond_wait(&m_start_condv, &m_start_mtx);
+        }
+        m_start_go = true;
+        pthread_cond_broadcast(&m_start_condv);
+        int ret = m_start_error;
+        pthread_mutex_unlock(&m_start_mtx);
+        return ret;
+    }
+
+    // Samples queue depth and worker utilization every m_scale_interval_ms. Adds a worker after two
+    // busy samples in a row (utilization above 80% or more than one full batch queued per worker)
+    // and retires the newest one after ten idle samples in a row (utilization below 30% and less
+    // than a batch queued); the gap between the thresholds and the sample counts is the hysteresis.
+    void monitor_loop() {
+        std::vector<uint64_t> last_busy(m_max_thread_num, 0);
+        int busy_samples = 0, idle_samples = 0;
+        int64_t last_us = blocking_queue_now_us();
+
+        pthread_mutex_lock(&m_monitor_mtx);
+        while (!m_monitor_stop) {
+            blocking_queue_cond_wait(&m_monitor_condv, &m_monitor_mtx, blocking_queue_deadline_us(m_scale_interval_ms));
+            if (m_monitor_stop) break;
+
+            int active = m_active_num;
+            int64_t now = blocking_queue_now_us();
+            uint64_t busy_us = 0;
+            WorkerStats st;
+            for (int i = 0; i < m_max_thread_num; ++i) {
+                m_metrics[i]->snapshot(st);
+                if (i < active) busy_us += st.busy_us - last_busy[i];
+                last_busy[i] = st.busy_us;
+            }
+            double util = now > last_us ? (double) busy_us / ((now - last_us) * active) : 0;
+            last_us = now;
+            size_t depth = m_work_que->stats().depth;
+
+            if (util > 0.8 || depth > (size_t) m_max_pop_num * active) {
+                busy_samples++;
+                idle_samples = 0;
+            } else if (util < 0.3 && depth < (size_t) m_max_pop_num) {
+                idle_samples++;
+                busy_samples = 0;
+            } else {
+                busy_samples = idle_samples = 0;
+            }
+
+            if (busy_samples >= 2 && active < m_max_thread_num) {
+                // the slot may still be held by a retired thread that hasn't finished its last batch;
+                // it is only joined once it has returned, the scale up waits for a later sample
+                if (m_threads[active] != nullptr) {
+                    if (!m_exited[active]) continue;
+                    m_threads[active]->join();
+                    delete m_threads[active];
+                    m_threads[active] = nullptr;
+                }
+                m_retire[active] = false;
+                m_exited[active] = false;
+                if (start_threads(active, 1) != 0) {
+                    std::cerr << "[ERROR] WorkerPool(" << m_work_que->name() << "): worker " << active
+                              << " runs unpinned" << std::endl;
+                }
+                m_active_num = active + 1;
+                std::cout << "WorkerPool(" << m_work_que->name() << ") scale up to " << active + 1
+                          << " threads, util=" << util << ", depth=" << depth << std::endl;
+                busy_samples = 0;
+            } else if (idle_samples >= 10 && active > m_min_thread_num) {
+                m_retire[active - 1] = true;
+                m_active_num = active - 1;
+                std::cout << "WorkerPool(" << m_work_que->name() << ") scale down to " << active - 1
+                          << " threads, util=" << util << ", depth=" << depth << std::endl;
+                idle_samples = 0;
+            }
+        }
+        pthread_mutex_unlock(&m_monitor_mtx);
+    }
+
+    bool take_or_steal(int index, std::vector<T> &items) {
+        std::vector<T> *batch = nullptr;
+        if (!m_deques[index]->take(batch)) {
+            for (int k = 1; k < m_thread_num && batch == nullptr; ++k) {
+                if (!m_deques[(index + k) % m_thread_num]->steal(batch)) batch = nullptr;
+            }
+        }
+        if (batch == nullptr) return false;
+        items.swap(*batch);
+        batch->clear();
+        m_batch_pool->release(batch);
+        return true;
+    }
+
+    size_t parked_batches() const {
+        size_t num = 0;
+        for (auto dq : m_deques) num += dq->size();
+        return num;
+    }
+
+    // wakes the workers parked in steal_work_loop after batches were parked in a deque
+    void wake_stealers() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_steal_waiters.load(std::memory_order_relaxed) > 0) {
+            pthread_mutex_lock(&m_steal_mtx);
+            pthread_cond_broadcast(&m_steal_condv);
+            pthread_mutex_unlock(&m_steal_mtx);
+        }
+    }
+
+    // Splits a grabbed chunk into batches of m_max_pop_num: the first one goes to items, the rest,
+    // a shorter tail included, to this worker's deque for itself or idle peers to take.
+    void distribute(int index, std::vector<T> &grabbed, std::vector<T> &items) {
+        // top the tail up with what is queued by now rather than leave a short batch
+        size_t tail = grabbed.size() % m_max_pop_num;
+        trace_dequeue(grabbed);
+        if (tail > 0 && grabbed.size() > (size_t)m_max_pop_num) {
+            size_t old_num = grabbed.size();
+            m_work_que->try_pop(grabbed, m_max_pop_num - tail);
+            trace_dequeue(grabbed, old_num);
+        }
+        size_t num = grabbed.size();
+        size_t batch_num = (num + m_max_pop_num - 1) / m_max_pop_num;
+        // push the newest batch first so the owner takes older batches and thieves the newer ones
+        for (size_t b = batch_num - 1; b > 0; --b) {
+            auto first = grabbed.begin() + b * m_max_pop_num;
+            auto last = grabbed.begin() + std::min(num, (b + 1) * m_max_pop_num);
+            std::vector<T> *batch = m_batch_pool->acquire();
+            batch->assign(std::make_move_iterator(first), std::make_move_iterator(last));
+            m_deques[index]->push(batch);
+        }
+        size_t own = std::min(num, (size_t)m_max_pop_num);
+        items.assign(std::make_move_iterator(grabbed.begin()), std::make_move_iterator(grabbed.begin() + own));
+        if (batch_num > 1) wake_stealers();
+    }
+
+    // An idle worker first looks for batches in the deques. Then one of the idle workers, the
+    // leader, waits on the shared queue while the others park until batches are parked, the leader
+    // leaves with a chunk, or the queue is stopped; nobody polls.
+    void steal_work_loop(int index) {
+        std::vector<T> items, grabbed;
+        items.reserve(m_max_pop_num);
+        grabbed.reserve(m_max_pop_num * m_steal_chunk);
+        while (true) {
+            items.clear();
+            if (take_or_steal(index, items)) {
+                process(index, items);
+                continue;
+            }
+
+            pthread_mutex_lock(&m_steal_mtx);
+            if (m_steal_stop) {
+                // stopped: only the owner parks batches in a deque and take_or_steal just found this
+                // worker's own one empty, the others drain theirs before they leave
+                pthread_mutex_unlock(&m_steal_mtx);
+                break;
+            }
+            if (m_steal_leader) {
+                pthread_mutex_unlock(&m_steal_mtx);
+                if (m_idle_func != nullptr) m_idle_func(index);
+                int64_t idle_start = blocking_queue_now_us();
+                pthread_mutex_lock(&m_steal_mtx);
+                m_steal_waiters.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                while (m_steal_leader && !m_steal_stop && parked_batches() == 0) {
+                    pthread_cond_wait(&m_steal_condv, &m_steal_mtx);
+                }
+                m_steal_waiters.fetch_sub(1);
+                pthread_mutex_unlock(&m_steal_mtx);
+                m_metrics[index]->on_idle(blocking_queue_now_us() - idle_start);
+                continue;
+            }
+            m_steal_leader = true;
+            pthread_mutex_unlock(&m_steal_mtx);
+
+            if (m_idle_func != nullptr) m_idle_func(index);
+            grabbed.clear();
+            int64_t idle_start = blocking_queue_now_us();
+            int ret = this->pop_work(grabbed, m_max_pop_num * m_steal_chunk, 0, nullptr);
+            m_metrics[index]->on_idle(blocking_queue_now_us() - idle_start);
+
+            // hand the wait on the queue over to a parked worker
+            pthread_mutex_lock(&m_steal_mtx);
+            m_steal_leader = false;
+            if (ret == 0 && grabbed.empty()) {
+                m_steal_stop = true;
+                pthread_cond_broadcast(&m_steal_condv);
+            } else {
+                pthread_cond_signal(&m_steal_condv);
+            }
+            pthread_mutex_unlock(&m_steal_mtx);
+            if (grabbed.empty()) continue;
+
+            distribute(index, grabbed, items);
+            process(index, items);
+        }
+        if (m_idle_func != nullptr) m_idle_func(index);
+    }
+
+public:
+    WorkerPool() : m_work_que(nullptr), m_thread_num(0), m_work_item_func(nullptr), m_max_pop_num(1),
+                   m_min_pop_num(1), m_steal_chunk(0), m_steal_leader(false), m_steal_stop(false),
+                   m_steal_waiters(0), m_batch_pool(nullptr), m_batch_delay_us(0),
+                   m_min_thread_num(0), m_max_thread_num(0), m_scale_interval_ms(100), m_active_num(0), m_retire(nullptr),
+                   m_exited(nullptr), m_monitor(nullptr), m_monitor_stop(false), m_start_pending(0),
+                   m_start_error(0), m_start_go(false), m_tracer(nullptr), m_trace_track(0) {
+        pthread_mutex_init(&m_monitor_mtx, NULL);
+        blocking_queue_cond_init(&m_monitor_condv);
+        pthread_mutex_init(&m_start_mtx, NULL);
+        pthread_cond_init(&m_start_condv, NULL);
+        pthread_mutex_init(&m_steal_mtx, NULL);
+        pthread_cond_init(&m_steal_condv, NULL);
+    }
+
+    virtual ~WorkerPool() {
+        if (!m_threads.empty()) stopWork();
+        for (auto dq : m_deques) delete dq;
+        delete m_batch_pool;
+        for (auto m : m_metrics) delete m;
+        delete[] m_retire;
+        delete[] m_exited;
+        pthread_cond_destroy(&m_monitor_condv);
+        pthread_mutex_destroy(&m_monitor_mtx);
+        pthread_cond_destroy(&m_start_condv);
+        pthread_mutex_destroy(&m_start_mtx);
+        pthread_cond_destroy(&m_steal_condv);
+        pthread_mutex_destroy(&m_steal_mtx);
+    }
+
+    int init(WorkQueue<T> *que, int thread_num, int min_pop_num, int max_pop_num) {
         m_work_que = que;
         m_thread_num = thread_num;
         m_min_pop_num = min_pop_num;
@@ -297,51 +1838,144 @@ public:
         return 0;
     }
 
+    // Must be called before startWork. chunk is the number of batches a worker takes from the
+    // shared queue at once, 0 (default) keeps every pop on the shared queue. The last batch of a
+    // chunk may be shorter than min_pop_num when the queue had no more elements.
+    int setWorkStealing(int chunk) {
+        m_steal_chunk = m_thread_num > 1 ? chunk : 0;
+        return 0;
+    }
+
+    // Must be called before startWork. With max_delay_us > 0 workers take a batch as soon as
+    // max_pop_num elements are queued or the oldest one has waited max_delay_us, whichever comes
+    // first, instead of waiting for min_pop_num elements.
+    int setBatchDeadline(int64_t max_delay_us) {
+        m_batch_delay_us = max_delay_us;
+        return 0;
+    }
+
+    // Must be called before startWork. Starts with the init() thread_num clamped to
+    // [min_thread_num, max_thread_num] and lets a monitor thread resize the pool every interval_ms
+    // based on queue depth and worker utilization. Not combined with work stealing, whose deques are
+    // sized by the thread count.
+    int setAutoScale(int min_thread_num, int max_thread_num, int interval_ms = 100) {
+        if (min_thread_num < 1 || max_thread_num < min_thread_num || interval_ms <= 0) {
+            std::cout << "WorkerPool: invalid autoscale range [" << min_thread_num << ", " << max_thread_num
+                      << "]" << std::endl;
+            return -1;
+        }
+        m_min_thread_num = min_thread_num;
+        m_max_thread_num = max_thread_num;
+        m_scale_interval_ms = interval_ms;
+        return 0;
+    }
+
+    // Must be called before startWork. Worker i is pinned according to placement (see
+    // bm::placement_cpuset); its deque and batch buffers are allocated by the worker after pinning.
+    int setPlacement(const bm::CpuPlacement &placement) {
+        m_placement = placement;
+        return 0;
+    }
+
+    // Must be called before startWork. fn(index) runs on worker index whenever it finds no batch
+    // ready and is about to wait, and once more before the worker exits, so that a callback holding
+    // on to work across calls (e.g. batches in flight on an accelerator) can finish it.
+    int setIdleCallback(OnWorkerIdleCallback fn) {
+        m_idle_func = fn;
+        return 0;
+    }
+
+    // Must be called before startWork. Records every batch on the tracer's track, and the dequeue
+    // and the run of every item whose id_fn(item) the tracer samples; the stage pushing into the
+    // queue records the items' TRACE_ENQUEUE.
+    int setTracer(bm::Tracer *tracer, int track, TraceIdFunc id_fn) {
+        m_tracer = tracer;
+        m_trace_track = track;
+        m_trace_id_func = id_fn;
+        return 0;
+    }
+
+    // index of the calling worker thread in its pool, -1 outside of a worker
+    static int workerIndex() {
+        return current_index();
+    }
+
+    // number of running workers
+    int threadNum() const {
+        return m_max_thread_num > 0 ? m_active_num.load() : m_thread_num;
+    }
+
+    // Returns -1 if the placement can't be computed (no worker is started), or if pinning a worker
+    // failed (the workers run unpinned).
     int startWork(OnWorkItemsCallback fn) {
         m_work_item_func = fn;
 
-        for (int i = 0; i < m_thread_num; ++i) {
-            auto pth = new std::thread([this] {
-                while (true) {
-                    std::vector<T> items;
-                    //if (m_work_que->size() < 4) { bm::usleep(10); continue; }
-                    if (m_work_que->pop_front(items, m_min_pop_num, m_max_pop_num) != 0) {
-                        break;
-                    }
-                    if (items.empty())
-                        break;
-                    m_work_item_func(items);
+        if (m_steal_chunk > 0) {
+            if (m_max_thread_num > 0) {
+                std::cout << "WorkerPool: autoscaling is disabled with work stealing" << std::endl;
+                m_max_thread_num = 0;
+            }
+            m_deques.assign(m_thread_num, nullptr);
+            m_steal_leader = false;
+            m_steal_stop = false;
+            m_batch_pool = new ObjectPool<std::vector<T>>(m_steal_chunk * 2);
+        }
+
+        int slot_num = m_thread_num;
+        if (m_max_thread_num > 0) {
+            m_thread_num = std::max(m_min_thread_num, std::min(m_thread_num, m_max_thread_num));
+            slot_num = m_max_thread_num;
+            m_retire = new std::atomic<bool>[slot_num];
+            m_exited = new std::atomic<bool>[slot_num];
+            for (int i = 0; i < slot_num; ++i) m_retire[i] = m_exited[i] = false;
+        }
+        m_active_num = m_thread_num;
+
+        m_cpusets.clear();
+        if (m_placement.policy != bm::CPU_PLACE_NONE) {
+            m_cpusets.resize(slot_num);
+            for (int i = 0; i < slot_num; ++i) {
+                if (bm::placement_cpuset(m_placement, i, &m_cpusets[i]) != 0) {
+                    m_cpusets.clear();
+                    return -1;
                 }
-            });
-            //setCPU(*pth);
-            m_threads.push_back(pth);
+            }
         }
-        return 0;
-    }
 
-    void setCPU(std::thread &th) {
-        static int cpu_count = std::thread::hardware_concurrency();
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(cpu_index++ % cpu_count, &cpuset);
-        int ret = pthread_setaffinity_np(th.native_handle(),
-                                         sizeof(cpu_set_t),
-                                         &cpuset);
-        if (ret != 0) {
-            std::cerr << "[ERROR] caling pthread_setaffinity_np failed" << std::endl;
-            exit(-1);
-        } else {
-            std::cout << "[SUCCESS] caling pthread_setaffinity_np success, " << cpu_index << std::endl;
+        for (int i = 0; i < slot_num; ++i) {
+            m_metrics.push_back(new WorkerMetrics());
+        }
+        m_threads.assign(slot_num, nullptr);
+
+        m_start_go = false;
+        int ret = start_threads(0, m_thread_num);
+
+        if (m_max_thread_num > 0) {
+            m_monitor_stop = false;
+            m_monitor = new std::thread([this] { monitor_loop(); });
         }
+        // the workers run unpinned if pinning failed, the caller decides whether to stopWork
+        return ret;
     }
 
     int stopWork() {
+        if (m_monitor != nullptr) {
+            pthread_mutex_lock(&m_monitor_mtx);
+            m_monitor_stop = true;
+            pthread_cond_signal(&m_monitor_condv);
+            pthread_mutex_unlock(&m_monitor_mtx);
+            m_monitor->join();
+            delete m_monitor;
+            m_monitor = nullptr;
+        }
         m_work_que->stop();
-        for (int i = 0; i < m_thread_num; i++) {
+        for (size_t i = 0; i < m_threads.size(); i++) {
+            if (m_threads[i] == nullptr) continue;
             m_threads[i]->join();
             delete m_threads[i];
             m_threads[i] = nullptr;
         }
+        m_threads.clear();
         return 0;
     }
 
@@ -349,6 +1983,15 @@ public:
         m_work_que->stop();
         return 0;
     }
+
+    // Per-thread counters, lock-free; stays readable after stopWork.
+    std::vector<WorkerStats> workerStats() const {
+        std::vector<WorkerStats> stats(m_metrics.size());
+        for (size_t i = 0; i < m_metrics.size(); i++) {
+            m_metrics[i]->snapshot(stats[i]);
+        }
+        return stats;
+    }
 };
 
 
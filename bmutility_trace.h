@@ -0,0 +1,247 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef BMUTILITY_TRACE_H
+#define BMUTILITY_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace bm {
+    enum TraceKind {
+        // a frame was pushed into the queue of a track's stage
+        TRACE_ENQUEUE = 0,
+        // a worker took the frame out of that queue
+        TRACE_DEQUEUE = 1,
+        // a frame went through the stage's callback, ts_us to end_us
+        TRACE_RUN = 2,
+        // a worker ran the stage's callback on a batch of id frames
+        TRACE_BATCH = 3,
+    };
+
+    struct TraceRecord {
+        uint64_t id;
+        int64_t ts_us;
+        int64_t end_us;
+        int32_t track;
+        int32_t kind;
+    };
+
+    // Opt-in per-frame stage tracing. Every thread writes its records into a ring buffer of its own
+    // without any lock or atomic read-modify-write; a ring that wraps keeps its latest records.
+    // dump() writes all of them as Chrome trace JSON (chrome://tracing, ui.perfetto.dev): each traced
+    // frame gets a track of its own with, for every stage, the time in the queue, the wait between
+    // dequeue and the callback (in a work-stealing deque, or behind the batch before it) and the run;
+    // each worker thread shows its batches.
+    //
+    // Frames are sampled by id, so a frame is traced in every stage or in none. Tracing a frame costs
+    // a few clock reads and records per stage, noticeable with cheap stages; sample_every bounds it.
+    //
+    // Tracks are added before tracing starts. dump() may run while frames are traced, records being
+    // overwritten meanwhile are left out.
+    class Tracer {
+        struct Buffer {
+            explicit Buffer(size_t capacity) : records(capacity), head(0), tid(0) {}
+
+            std::vector<TraceRecord> records;
+            std::atomic<uint64_t> head; // records written so far, only the owner thread stores
+            int tid;
+            std::string name;
+        };
+
+        int m_id;
+        size_t m_capacity;
+        uint64_t m_sample_every;
+        std::atomic<bool> m_enabled;
+        std::vector<std::string> m_tracks;
+        pthread_mutex_t m_mtx;
+        std::vector<std::unique_ptr<Buffer>> m_buffers;
+
+        static int next_id() {
+            static std::atomic<int> id(0);
+            return id.fetch_add(1);
+        }
+
+        // buffer of the calling thread, by tracer id; ids are never reused
+        Buffer *buffer() {
+            static thread_local std::vector<Buffer *> buffers;
+            if ((int) buffers.size() <= m_id) buffers.resize(m_id + 1, nullptr);
+            if (buffers[m_id] == nullptr) {
+                Buffer *b = new Buffer(m_capacity);
+                b->tid = (int) syscall(SYS_gettid);
+                pthread_mutex_lock(&m_mtx);
+                m_buffers.emplace_back(b);
+                pthread_mutex_unlock(&m_mtx);
+                buffers[m_id] = b;
+            }
+            return buffers[m_id];
+        }
+
+        // a begin/end pair of frame id's async track
+        static void span(FILE *fp, const char *&sep, const std::string &name, uint64_t id, int tid, int64_t begin_us,
+                         int64_t end_us) {
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"b\",\"id\":\"%lu\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%ld}", sep, name.c_str(), (unsigned long) id, tid, (long) begin_us);
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"e\",\"id\":\"%lu\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%ld}", name.c_str(), (unsigned long) id, tid, (long) end_us);
+            sep = ",";
+        }
+
+        static std::string escape(const std::string &str) {
+            std::string out;
+            for (char c : str) {
+                if (c == '"' || c == '\\') out += '\\';
+                out += c;
+            }
+            return out;
+        }
+
+    public:
+        // capacity_per_thread records are kept per thread; sample_every n traces one frame id in n
+        explicit Tracer(size_t capacity_per_thread = 65536, int sample_every = 1)
+                : m_id(next_id()), m_capacity(capacity_per_thread > 0 ? capacity_per_thread : 1),
+                  m_sample_every(sample_every > 1 ? sample_every : 1), m_enabled(true) {
+            pthread_mutex_init(&m_mtx, NULL);
+        }
+
+        ~Tracer() {
+            pthread_mutex_destroy(&m_mtx);
+        }
+
+        // a stage to trace, e.g. "preprocess"; returns its track index
+        int add_track(const std::string &name) {
+            m_tracks.push_back(name);
+            return (int) m_tracks.size() - 1;
+        }
+
+        const std::string &track_name(int track) const { return m_tracks[track]; }
+
+        void set_enabled(bool enable) { m_enabled = enable; }
+
+        bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+        // whether frame id is traced right now, the same answer in every stage
+        bool sampled(uint64_t id) const {
+            if (!enabled()) return false;
+            return m_sample_every == 1 || ((id * 0x9E3779B97F4A7C15ull) >> 32) % m_sample_every == 0;
+        }
+
+        void record(int track, int kind, uint64_t id, int64_t ts_us, int64_t end_us = 0) {
+            Buffer *b = buffer();
+            uint64_t head = b->head.load(std::memory_order_relaxed);
+            TraceRecord &r = b->records[head % m_capacity];
+            r.id = id;
+            r.ts_us = ts_us;
+            r.end_us = end_us;
+            r.track = track;
+            r.kind = kind;
+            b->head.store(head + 1, std::memory_order_release);
+        }
+
+        // names the calling thread in the trace
+        void name_thread(const std::string &name) {
+            Buffer *b = buffer();
+            pthread_mutex_lock(&m_mtx);
+            b->name = name;
+            pthread_mutex_unlock(&m_mtx);
+        }
+
+        // writes the records of all threads as Chrome trace JSON, -1 if the file can't be written
+        int dump(const std::string &path) {
+            struct Item {
+                TraceRecord rec;
+                int tid;
+            };
+            std::vector<Item> items;
+            std::vector<std::pair<int, std::string>> threads;
+
+            pthread_mutex_lock(&m_mtx);
+            for (auto &b : m_buffers) {
+                uint64_t head = b->head.load(std::memory_order_acquire);
+                uint64_t first = head > m_capacity ? head - m_capacity : 0;
+                size_t base = items.size();
+                for (uint64_t i = first; i < head; i++) items.push_back(Item{b->records[i % m_capacity], b->tid});
+                // the owner may have wrapped over the oldest ones while they were copied, and may be
+                // writing the slot of record now_head - capacity
+                uint64_t now_head = b->head.load(std::memory_order_acquire);
+                uint64_t valid = now_head + 1 > m_capacity ? now_head + 1 - m_capacity : 0;
+                if (valid > first) {
+                    size_t lost = (size_t) std::min(valid - first, head - first);
+                    items.erase(items.begin() + base, items.begin() + base + lost);
+                }
+                if (!b->name.empty()) threads.emplace_back(b->tid, b->name);
+            }
+            pthread_mutex_unlock(&m_mtx);
+
+            FILE *fp = fopen(path.c_str(), "w");
+            if (fp == nullptr) {
+                std::cerr << "[ERROR] Tracer::dump: can't open " << path << std::endl;
+                return -1;
+            }
+            std::sort(items.begin(), items.end(), [](const Item &a, const Item &b) {
+                return a.rec.ts_us != b.rec.ts_us ? a.rec.ts_us < b.rec.ts_us : a.rec.kind < b.rec.kind;
+            });
+
+            const char *sep = "";
+            fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+            for (auto &t : threads) {
+                fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                        sep, t.first, escape(t.second).c_str());
+                sep = ",";
+            }
+            // (track, frame id) -> time the frame was queued for the track's stage, and left the queue
+            std::map<std::pair<int, uint64_t>, int64_t> queued, dequeued;
+            for (auto &item : items) {
+                const TraceRecord &r = item.rec;
+                if (r.track < 0 || r.track >= (int) m_tracks.size()) continue;
+                std::string name = escape(m_tracks[r.track]);
+                if (r.kind == TRACE_ENQUEUE) {
+                    queued[std::make_pair(r.track, r.id)] = r.ts_us;
+                } else if (r.kind == TRACE_DEQUEUE) {
+                    dequeued[std::make_pair(r.track, r.id)] = r.ts_us;
+                } else if (r.kind == TRACE_BATCH) {
+                    fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%ld,\"dur\":%ld,"
+                                "\"args\":{\"frames\":%lu}}", sep, name.c_str(), item.tid, (long) r.ts_us,
+                            (long) (r.end_us - r.ts_us), (unsigned long) r.id);
+                    sep = ",";
+                } else if (r.kind == TRACE_RUN) {
+                    auto key = std::make_pair(r.track, r.id);
+                    auto dq = dequeued.find(key);
+                    int64_t dequeue_us = dq != dequeued.end() ? dq->second : r.ts_us;
+                    auto it = queued.find(key);
+                    if (it != queued.end()) {
+                        span(fp, sep, name + " queue", r.id, item.tid, it->second, dequeue_us);
+                        queued.erase(it);
+                    }
+                    if (dq != dequeued.end()) {
+                        if (dequeue_us < r.ts_us) span(fp, sep, name + " wait", r.id, item.tid, dequeue_us, r.ts_us);
+                        dequeued.erase(dq);
+                    }
+                    span(fp, sep, name, r.id, item.tid, r.ts_us, r.end_us);
+                }
+            }
+            fprintf(fp, "\n]}\n");
+            int ret = ferror(fp) ? -1 : 0;
+            fclose(fp);
+            return ret;
+        }
+    };
+} // end namespace bm
+
+#endif //BMUTILITY_TRACE_H
@@ -0,0 +1,506 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+// BMInferencePipe tests, one function per feature.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "bmutility_stage_graph.h"
+#include "bmutility_mock_delegate.h"
+#include "bmutility_frame_scheduler.h"
+#include "bmutility_dedup.h"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            std::cerr << "[ERROR] " << __FILE__ << ":" << __LINE__ << ": " << #cond << std::endl; \
+            return 1; \
+        } \
+    } while (0)
+
+static void sleep_ms(int ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+struct TestFrame {
+    int stream;
+    int64_t seq;
+    int64_t deadline_us;
+};
+
+// synchronous delegate whose forward sleeps for forward_us per batch
+class SleepDelegate : public bm::DetectorDelegate<TestFrame> {
+    int64_t m_forward_us;
+    bool m_notify;
+
+public:
+    // notify: postprocess invokes the detected callback, off when the pipe does it
+    explicit SleepDelegate(int64_t forward_us = 200, bool notify = true) : m_forward_us(forward_us), m_notify(notify) {}
+
+    int preprocess(std::vector<TestFrame> &) override { return 0; }
+
+    int forward(std::vector<TestFrame> &) override {
+        std::this_thread::sleep_for(std::chrono::microseconds(m_forward_us));
+        return 0;
+    }
+
+    int postprocess(std::vector<TestFrame> &frames) override {
+        if (!m_notify || m_pfnDetectFinish == nullptr) return 0;
+        for (auto &frame : frames) m_pfnDetectFinish(frame);
+        return 0;
+    }
+};
+
+static bm::DetectorParam small_param() {
+    bm::DetectorParam param;
+    param.batch_num = 4;
+    param.preprocess_thread_num = 2;
+    param.postprocess_thread_num = 2;
+    param.preprocess_batch_delay_us = 1000;
+    param.inference_batch_delay_us = 1000;
+    return param;
+}
+
+using MockDelegate = bm::MockDetectorDelegate<TestFrame>;
+
+static bm::MockDelegateParam fast_cost() {
+    bm::MockDelegateParam cost;
+    cost.preprocess_frame_us = 20;
+    cost.forward_us = 200;
+    cost.forward_frame_us = 20;
+    cost.postprocess_frame_us = 10;
+    return cost;
+}
+
+// credits are taken without waiting while there are any, a waiting acquire gets the first one given
+// back, and times out or returns on stop otherwise
+static int test_credit_gate() {
+    bm::CreditGate gate;
+    gate.reset(2);
+    CHECK(gate.try_acquire() && gate.try_acquire() && !gate.try_acquire());
+    CHECK(gate.acquire(blocking_queue_deadline_us(10)) == -1);
+    std::thread giver([&gate] {
+        sleep_ms(10);
+        gate.release(1);
+    });
+    CHECK(gate.acquire(blocking_queue_deadline_us(5000)) == 0);
+    giver.join();
+    CHECK(gate.available() == 0);
+    std::thread stopper([&gate] {
+        sleep_ms(10);
+        gate.stop();
+    });
+    CHECK(gate.acquire(BLOCKING_QUEUE_NO_DEADLINE) == -1);
+    stopper.join();
+    return 0;
+}
+
+// drain() waits for every frame pushed before it; stop() racing with producers loses none of the
+// frames it accepted
+static int test_drain_stop() {
+    auto delegate = std::make_shared<SleepDelegate>();
+    std::atomic<int> detected(0);
+    delegate->set_detected_callback([&detected](TestFrame &) { detected++; });
+    bm::BMInferencePipe<TestFrame> pipe;
+    CHECK(pipe.init(small_param(), delegate) == 0);
+    for (int i = 0; i < 50; i++) {
+        TestFrame frame{0, i, 0};
+        CHECK(pipe.push_frame(&frame) == 0);
+    }
+    CHECK(pipe.drain(5000) == 0);
+    CHECK(detected == 50 && pipe.completed_frames() == 50);
+
+    std::atomic<int> accepted(50);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < 3; p++) {
+        producers.emplace_back([&pipe, &accepted, p] {
+            for (int i = 0; i < 1000; i++) {
+                TestFrame frame{p, i, 0};
+                int ret = pipe.push_frame(&frame, 10);
+                if (ret < 0) break;
+                if (ret == 0) accepted++;
+            }
+        });
+    }
+    sleep_ms(20);
+    pipe.stop();
+    for (auto &t : producers) t.join();
+    CHECK(detected == accepted);
+    TestFrame frame{0, 0, 0};
+    CHECK(pipe.push_frame(&frame) == -1);
+    return 0;
+}
+
+struct GraphItem {
+    int key;
+    int sum;
+};
+
+// A diamond whose branches are joined per key, a routed fan-out and a cycle. Only entry stages take
+// items from outside.
+static int test_stage_graph() {
+    bm::StageParam param;
+    param.thread_num = 2;
+    param.max_batch = 4;
+    bm::StageGraph<GraphItem> graph;
+    std::atomic<int> out(0), wrong(0);
+    int src = graph.add_stage("src", param, [](std::vector<GraphItem> &) {});
+    int a = graph.add_stage("a", param, [](std::vector<GraphItem> &items) {
+        for (auto &item : items) item.sum += 1;
+    });
+    int b = graph.add_stage("b", param, [](std::vector<GraphItem> &items) {
+        for (auto &item : items) item.sum += 10;
+    });
+    int sink = graph.add_stage("sink", param, [&](std::vector<GraphItem> &items) {
+        for (auto &item : items) {
+            out++;
+            if (item.sum != 11) wrong++;
+        }
+    });
+    CHECK(graph.add_stage("a", param, nullptr) == -1);
+    CHECK(graph.connect(src, a) == 0 && graph.connect(src, b) == 0);
+    CHECK(graph.connect(a, sink) == 0 && graph.connect(b, sink) == 0);
+    graph.set_join(sink, [](const GraphItem &item) { return (uint64_t) item.key; },
+                   [](GraphItem &acc, GraphItem &item) { acc.sum += item.sum; });
+    CHECK(graph.start() == 0);
+    for (int i = 0; i < 100; i++) {
+        GraphItem item{i, 0};
+        CHECK(graph.push(src, item) == 0);
+    }
+    GraphItem inner{-1, 0};
+    CHECK(graph.push(a, inner) == -1);
+    CHECK(graph.drain(5000) == 0);
+    CHECK(out == 100 && wrong == 0);
+    graph.stop();
+
+    bm::StageGraph<GraphItem> routed;
+    std::atomic<int> even(0), odd(0);
+    int in = routed.add_stage("in", param, [](std::vector<GraphItem> &) {});
+    int x = routed.add_stage("even", param, [&even](std::vector<GraphItem> &items) { even += items.size(); });
+    int y = routed.add_stage("odd", param, [&odd](std::vector<GraphItem> &items) { odd += items.size(); });
+    routed.connect(in, x);
+    routed.connect(in, y);
+    routed.set_route(in, [](const GraphItem &item) { return item.key % 2 == 0 ? 1u : 2u; });
+    CHECK(routed.start() == 0);
+    for (int i = 0; i < 100; i++) {
+        GraphItem item{i, 0};
+        CHECK(routed.push(in, item) == 0);
+    }
+    CHECK(routed.drain(5000) == 0);
+    CHECK(even == 50 && odd == 50);
+    routed.stop();
+
+    bm::StageGraph<GraphItem> cyclic;
+    int c0 = cyclic.add_stage("c0", param, [](std::vector<GraphItem> &) {});
+    int c1 = cyclic.add_stage("c1", param, [](std::vector<GraphItem> &) {});
+    cyclic.connect(c0, c1);
+    cyclic.connect(c1, c0);
+    CHECK(cyclic.start() == -1);
+    return 0;
+}
+
+// ordered output hands each stream's frames on in seq order although postprocess runs on
+// several threads
+static int test_reorder() {
+    auto delegate = std::make_shared<SleepDelegate>(200, false);
+    std::map<int, int64_t> next;
+    bool in_order = true;
+    int detected = 0;
+    // the pipe serializes the callbacks of ordered output per stream, not across streams
+    pthread_mutex_t mtx;
+    pthread_mutex_init(&mtx, NULL);
+    delegate->set_detected_callback([&](TestFrame &frame) {
+        pthread_mutex_lock(&mtx);
+        in_order &= frame.seq == next[frame.stream]++;
+        detected++;
+        pthread_mutex_unlock(&mtx);
+    });
+    bm::DetectorParam param = small_param();
+    param.postprocess_thread_num = 3;
+    bm::BMInferencePipe<TestFrame> pipe;
+    pipe.set_ordered_output([](const TestFrame &frame) { return frame.stream; },
+                            [](const TestFrame &frame) { return frame.seq; }, 64, 1000);
+    CHECK(pipe.init(param, delegate) == 0);
+    for (int i = 0; i < 100; i++) {
+        for (int s = 0; s < 3; s++) {
+            TestFrame frame{s, i, 0};
+            CHECK(pipe.push_frame(&frame) == 0);
+        }
+    }
+    CHECK(pipe.drain(10000) == 0);
+    pipe.stop();
+    pthread_mutex_destroy(&mtx);
+    CHECK(in_order && detected == 300);
+    return 0;
+}
+
+// with several batches in flight per inference worker every frame still comes out once, whether
+// completion waits for the whole thread or for one batch
+static int test_async_forward() {
+    for (int thread_sync = 0; thread_sync <= 1; thread_sync++) {
+        bm::MockDelegateParam cost = fast_cost();
+        cost.thread_sync = thread_sync == 1;
+        auto delegate = std::make_shared<MockDelegate>(cost);
+        std::atomic<int> detected(0);
+        delegate->set_detected_callback([&detected](TestFrame &) { detected++; });
+        bm::DetectorParam param = small_param();
+        param.inference_inflight_batches = 3;
+        bm::BMInferencePipe<TestFrame> pipe;
+        CHECK(pipe.init(param, delegate) == 0);
+        for (int i = 0; i < 200; i++) {
+            TestFrame frame{0, i, 0};
+            CHECK(pipe.push_frame(&frame) == 0);
+        }
+        CHECK(pipe.drain(10000) == 0);
+        CHECK(detected == 200);
+        for (int i = 0; i < 50; i++) {
+            TestFrame frame{0, i, 0};
+            CHECK(pipe.push_frame(&frame) == 0);
+        }
+        pipe.stop();
+        CHECK(detected == 250);
+    }
+    return 0;
+}
+
+// an overloaded pipe sheds the frames past their deadline, every frame is either detected or shed
+static int test_shedding() {
+    bm::MockDelegateParam cost = fast_cost();
+    cost.forward_us = 5000;
+    auto delegate = std::make_shared<MockDelegate>(cost);
+    std::atomic<int> detected(0), dropped(0);
+    delegate->set_detected_callback([&detected](TestFrame &) { detected++; });
+    bm::BMInferencePipe<TestFrame> pipe;
+    pipe.set_frame_deadline([](TestFrame &frame) -> int64_t & { return frame.deadline_us; }, 10000);
+    pipe.set_drop_callback([&dropped](TestFrame &, int) { dropped++; });
+    CHECK(pipe.init(small_param(), delegate) == 0);
+    for (int i = 0; i < 200; i++) {
+        TestFrame frame{0, i, 0};
+        CHECK(pipe.push_frame(&frame) == 0);
+    }
+    CHECK(pipe.drain(10000) == 0);
+    int shed = (int) pipe.expiry_stats()[0].total();
+    CHECK(shed > 0 && shed == dropped);
+    CHECK(detected + dropped == 200);
+    return 0;
+}
+
+// a stride of 3 sends every third frame of its stream to the pipe and hands the others to the skip
+// callback; streams without a stride send all of theirs
+static int test_frame_scheduler() {
+    auto delegate = std::make_shared<SleepDelegate>();
+    std::atomic<int> detected(0), skipped(0);
+    delegate->set_detected_callback([&detected](TestFrame &) { detected++; });
+    bm::BMInferencePipe<TestFrame> pipe;
+    CHECK(pipe.init(small_param(), delegate) == 0);
+    bm::FrameScheduler<TestFrame> scheduler(&pipe, [](const TestFrame &frame) { return frame.stream; });
+    scheduler.set_stream_stride(0, 3);
+    scheduler.set_skip_callback([&skipped](TestFrame &) { skipped++; });
+    for (int i = 0; i < 30; i++) {
+        for (int s = 0; s < 2; s++) {
+            TestFrame frame{s, i, 0};
+            int ret = scheduler.push_frame(&frame);
+            CHECK(ret == 0 || (s == 0 && ret == BM_INFER_PIPE_SKIPPED));
+        }
+    }
+    CHECK(pipe.drain(5000) == 0);
+    auto stats = scheduler.stats();
+    CHECK(stats[0].offered == 30 && stats[0].admitted == 10 && stats[0].skipped == 20);
+    CHECK(stats[1].admitted == 30 && stats[1].skipped == 0);
+    CHECK(detected == 40 && skipped == 20);
+    return 0;
+}
+
+// a replica that fails for a while hands its batches over and rejoins after its cool-down
+static int test_replica_failover() {
+    auto delegate = std::make_shared<MockDelegate>(fast_cost());
+    bm::MockDelegateParam broken_cost = fast_cost();
+    broken_cost.forward_fail_after = 5;
+    broken_cost.forward_fail_num = 2;
+    auto broken = std::make_shared<MockDelegate>(broken_cost);
+    std::atomic<int> detected(0), dropped(0);
+    delegate->set_detected_callback([&detected](TestFrame &) { detected++; });
+    bm::BMInferencePipe<TestFrame> pipe;
+    pipe.set_drop_callback([&dropped](TestFrame &, int stage) {
+        if (stage == bm::PIPE_STAGE_INFERENCE) dropped++;
+    });
+    pipe.add_forward_replica(broken);
+    pipe.set_replica_cooldown(20);
+    CHECK(pipe.init(small_param(), delegate) == 0);
+    for (int i = 0; i < 400; i++) {
+        TestFrame frame{0, i, 0};
+        CHECK(pipe.push_frame(&frame) == 0);
+        if (i % 20 == 0) sleep_ms(5);
+    }
+    CHECK(pipe.drain(10000) == 0);
+    std::vector<bm::ReplicaStats> stats = pipe.replica_stats();
+    CHECK(stats.size() == 2 && stats[1].error_num == 2 && stats[1].healthy);
+    // a failed batch the other replica has no room for is dropped, not waited for
+    CHECK(detected + dropped == 400 && (int) stats[1].drop_num == dropped);
+    CHECK(stats[0].frame_num + stats[1].frame_num + stats[1].drop_num == 400);
+    return 0;
+}
+
+// a budget for fewer frames than a batch neither strands them nor stalls the pipe
+static int test_memory_budget() {
+    bm::MemoryBudget budget(3000);
+    auto delegate = std::make_shared<MockDelegate>(fast_cost());
+    std::atomic<int> detected(0);
+    delegate->set_detected_callback([&detected](TestFrame &) { detected++; });
+    bm::DetectorParam param = small_param();
+    param.preprocess_batch_delay_us = 0;
+    bm::BMInferencePipe<TestFrame> pipe;
+    pipe.set_memory_budget([](const TestFrame &) { return (int64_t) 1000; }, bm::MEMORY_POLICY_BLOCK, "test",
+                           &budget);
+    CHECK(pipe.init(param, delegate) == 0);
+    for (int i = 0; i < 20; i++) {
+        TestFrame frame{0, i, 0};
+        CHECK(pipe.push_frame(&frame, 5000) == 0);
+        CHECK(budget.used() <= 3000);
+    }
+    CHECK(pipe.drain(5000) == 0);
+    CHECK(detected == 20 && budget.used() == 0);
+    return 0;
+}
+
+struct DedupFrame {
+    int stream;
+    int seq;
+    uint8_t luma;
+    bm::DedupTag tag;
+    int result;
+};
+
+// the model: every frame's result is its seq
+class SeqDelegate : public bm::DetectorDelegate<DedupFrame> {
+public:
+    int forwarded = 0;
+
+    int preprocess(std::vector<DedupFrame> &) override { return 0; }
+
+    int forward(std::vector<DedupFrame> &frames) override {
+        forwarded += frames.size();
+        return 0;
+    }
+
+    int postprocess(std::vector<DedupFrame> &frames) override {
+        for (auto &frame : frames) {
+            frame.result = frame.seq;
+            if (m_pfnDetectFinish != nullptr) m_pfnDetectFinish(frame);
+        }
+        return 0;
+    }
+};
+
+// Frames of a static scene reuse the result of the stream's last frame the model ran on, a change
+// runs the model again. A miss that never reaches postprocess (shed) doesn't stop the next one from
+// becoming the reference.
+static int test_dedup() {
+    auto model = std::make_shared<SeqDelegate>();
+    std::vector<uint8_t> plane(64 * 64);
+    bm::DedupDetectorDelegate<DedupFrame, int> dedup(
+            model, [](const DedupFrame &frame) { return frame.stream; },
+            [&plane](const DedupFrame &frame, bm::LumaPlane &luma) {
+                // every frame is a flat image of its luma value, the plane is only read in preprocess
+                std::fill(plane.begin(), plane.end(), frame.luma);
+                luma.data = plane.data();
+                luma.width = luma.height = luma.stride = 64;
+                return 0;
+            },
+            [](DedupFrame &frame) -> bm::DedupTag & { return frame.tag; },
+            [](const DedupFrame &frame) { return frame.result; },
+            [](const int &last, DedupFrame &frame) { frame.result = last; });
+    int detected = 0;
+    dedup.set_detected_callback([&detected](DedupFrame &) { detected++; });
+    auto run = [&dedup](std::vector<DedupFrame> &frames) {
+        dedup.preprocess(frames);
+        dedup.forward(frames);
+        dedup.postprocess(frames);
+    };
+
+    std::vector<DedupFrame> frames = {{0, 1, 100, {}, 0}};
+    run(frames);
+    CHECK(!frames[0].tag.hit && frames[0].result == 1);
+    frames = {{0, 2, 100, {}, 0}, {1, 3, 100, {}, 0}, {0, 4, 102, {}, 0}};
+    run(frames);
+    CHECK(frames[0].tag.hit && frames[0].result == 1 && frames[2].tag.hit && frames[2].result == 1);
+    CHECK(!frames[1].tag.hit && frames[1].result == 3);
+    frames = {{0, 5, 200, {}, 0}};
+    run(frames);
+    CHECK(!frames[0].tag.hit && frames[0].result == 5);
+    CHECK(model->forwarded == 3 && detected == 5);
+
+    frames = {{0, 6, 50, {}, 0}};
+    dedup.preprocess(frames);
+    frames = {{0, 7, 60, {}, 0}};
+    run(frames);
+    frames = {{0, 8, 60, {}, 0}};
+    run(frames);
+    CHECK(frames[0].tag.hit && frames[0].result == 7);
+
+    auto stats = dedup.stats();
+    CHECK(stats[0].hits == 3 && stats[0].misses == 4 && stats[1].hits == 0 && stats[1].misses == 1);
+    return 0;
+}
+
+static int count_of(const std::string &text, const std::string &what) {
+    int num = 0;
+    for (size_t pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1)) num++;
+    return num;
+}
+
+// every traced frame gets a queue and a run span in each stage of the Chrome trace
+static int test_trace() {
+    bm::Tracer tracer(4096, 1);
+    auto delegate = std::make_shared<SleepDelegate>();
+    bm::BMInferencePipe<TestFrame> pipe;
+    pipe.set_tracer(&tracer, [](const TestFrame &frame) { return (uint64_t) frame.seq; });
+    CHECK(pipe.init(small_param(), delegate) == 0);
+    for (int i = 0; i < 20; i++) {
+        TestFrame frame{0, i, 0};
+        CHECK(pipe.push_frame(&frame) == 0);
+    }
+    CHECK(pipe.drain(5000) == 0);
+    pipe.stop();
+    const char *path = "test_trace.json";
+    CHECK(tracer.dump(path) == 0);
+    std::ifstream in(path);
+    std::stringstream json;
+    json << in.rdbuf();
+    remove(path);
+    for (const char *stage : {"preprocess", "inference", "postprocess"}) {
+        std::string begin = std::string("{\"name\":\"") + stage;
+        CHECK(count_of(json.str(), begin + " queue\",\"cat\":\"frame\",\"ph\":\"b\"") == 20);
+        CHECK(count_of(json.str(), begin + "\",\"cat\":\"frame\",\"ph\":\"b\"") == 20);
+    }
+    return 0;
+}
+
+int main() {
+    int ret = 0;
+    ret |= test_credit_gate();
+    ret |= test_drain_stop();
+    ret |= test_stage_graph();
+    ret |= test_reorder();
+    ret |= test_async_forward();
+    ret |= test_shedding();
+    ret |= test_frame_scheduler();
+    ret |= test_replica_failover();
+    ret |= test_memory_budget();
+    ret |= test_dedup();
+    ret |= test_trace();
+    std::cout << (ret == 0 ? "test_pipeline passed" : "test_pipeline FAILED") << std::endl;
+    return ret;
+}
@@ -0,0 +1,462 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2022 Sophgo Technologies Inc.  All rights reserved.
+//
+// SOPHON-PIPELINE is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+// WorkQueue and WorkerPool tests, one function per feature.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "bmutility_thread_queue.h"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            std::cerr << "[ERROR] " << __FILE__ << ":" << __LINE__ << ": " << #cond << std::endl; \
+            return 1; \
+        } \
+    } while (0)
+
+static int64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void sleep_ms(int ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// several producers and a WorkerPool on a ring queue, with and without work stealing: every
+// element arrives exactly once
+static int test_ring_pool(int work_stealing) {
+    const int producers = 4, num = 20000;
+    BlockingQueue<int> que("ring", BLOCKING_QUEUE_RING, 128);
+    std::vector<std::atomic<int>> seen(producers * num);
+    for (auto &s : seen) s = 0;
+    std::atomic<int> done(0);
+    WorkerPool<int> pool;
+    pool.init(&que, 3, 1, 8);
+    if (work_stealing > 0) CHECK(pool.setWorkStealing(work_stealing) == 0);
+    pool.startWork([&](std::vector<int> &items) {
+        for (int v : items) seen[v]++;
+        done += items.size();
+    });
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&que, p] {
+            for (int i = 0; i < num; i++) {
+                int v = p * num + i;
+                que.push(v);
+            }
+        });
+    }
+    for (auto &t : threads) t.join();
+    while (done < producers * num) sleep_ms(1);
+    pool.stopWork();
+    for (auto &s : seen) CHECK(s == 1);
+    return 0;
+}
+
+// A stopped full queue refuses pushes and hands what it could not take to the drop callback; the
+// mutex queues still append the first element they were about to wait for.
+static int test_stop_drops() {
+    for (int type = 0; type <= BLOCKING_QUEUE_RING; type++) {
+        BlockingQueue<int> que("stop", type, 4);
+        for (int i = 0; i < 4; i++) que.push(i);
+        int dropped = 0;
+        que.set_drop_fn([&dropped](int &) { dropped++; });
+        que.stop();
+        std::vector<int> more = {4, 5, 6};
+        CHECK(que.push(more) == -1);
+        CHECK(dropped >= 2 && (int) que.size() + dropped == 7);
+    }
+    return 0;
+}
+
+// one producer, one consumer: everything arrives once and in order
+static int test_spsc_order() {
+    const int num = 100000;
+    SpscQueue<int> que("spsc", 64);
+    std::thread producer([&que] {
+        std::vector<int> batch;
+        for (int i = 0; i < num; i++) {
+            if (i % 3 == 0) {
+                if (!batch.empty()) que.push(batch);
+                batch.clear();
+                que.push(i);
+                continue;
+            }
+            batch.push_back(i);
+            if (batch.size() == 4) {
+                que.push(batch);
+                batch.clear();
+            }
+        }
+        que.push(batch);
+    });
+    int next = 0;
+    bool in_order = true;
+    std::vector<int> items;
+    while (next < num) {
+        items.clear();
+        que.pop_front(items, 1, 16);
+        for (int v : items) in_order &= v == next++;
+    }
+    producer.join();
+    CHECK(in_order && que.size() == 0);
+    return 0;
+}
+
+// move-only elements go through every queue type, batch pops keep their order
+static int test_move_only() {
+    for (int type = 0; type <= BLOCKING_QUEUE_SPSC; type++) {
+        auto que = create_work_queue<std::unique_ptr<int>>("move", type, 256);
+        std::vector<std::unique_ptr<int>> batch;
+        for (int i = 0; i < 100; i++) batch.emplace_back(new int(i));
+        que->push(batch);
+        std::unique_ptr<int> last(new int(100));
+        que->push(last);
+        std::vector<std::unique_ptr<int>> items;
+        while (items.size() < 101) {
+            // pops append to items
+            if (que->pop_front(items, 1, 7) != 0) break;
+        }
+        CHECK(items.size() == 101);
+        for (int i = 0; i <= 100; i++) CHECK(items[i] != nullptr && *items[i] == i);
+    }
+    return 0;
+}
+
+// stealing workers that run out of work leave once the queue is stopped, after the batches queued
+// before the stop went through
+static int test_steal_stop() {
+    BlockingQueue<int> que("steal_stop", BLOCKING_QUEUE_RING, 64);
+    std::atomic<int> done(0);
+    WorkerPool<int> pool;
+    pool.init(&que, 4, 1, 4);
+    CHECK(pool.setWorkStealing(2) == 0);
+    pool.startWork([&done](std::vector<int> &items) { done += items.size(); });
+    for (int i = 0; i < 50; i++) que.push(i);
+    while (done < 50) sleep_ms(1);
+    sleep_ms(20);
+    auto start = std::chrono::steady_clock::now();
+    pool.stopWork();
+    CHECK(done == 50 && elapsed_us(start) < 2000000);
+    return 0;
+}
+
+// a partial batch goes once its oldest element has waited the batch deadline, a full one right away
+static int test_batch_deadline() {
+    BlockingQueue<int> que("deadline", 0, 64);
+    std::vector<size_t> sizes;
+    std::vector<int64_t> waits;
+    std::atomic<int> done(0);
+    auto pushed = std::chrono::steady_clock::now();
+    WorkerPool<int> pool;
+    pool.init(&que, 1, 8, 8);
+    CHECK(pool.setBatchDeadline(20000) == 0);
+    pool.startWork([&](std::vector<int> &items) {
+        sizes.push_back(items.size());
+        waits.push_back(elapsed_us(pushed));
+        done += items.size();
+    });
+    // the worker is waiting by now, so the elements get an enqueue time
+    sleep_ms(10);
+    pushed = std::chrono::steady_clock::now();
+    for (int i = 0; i < 3; i++) que.push(i);
+    while (done < 3) sleep_ms(1);
+    std::vector<int> batch = {3, 4, 5, 6, 7, 8, 9, 10};
+    que.push(batch);
+    while (done < 11) sleep_ms(1);
+    pool.stopWork();
+    CHECK(sizes.size() == 2 && sizes[0] == 3 && sizes[1] == 8);
+    CHECK(waits[0] >= 15000);
+    return 0;
+}
+
+// timed pops give up at their deadline and say so, a stop wakes a waiting pop without a timeout
+static int test_timed_waits() {
+    for (int type = 0; type <= BLOCKING_QUEUE_SPSC; type++) {
+        auto que = create_work_queue<int>("timed", type, 16);
+        std::vector<int> items;
+        bool is_timeout = false;
+        auto start = std::chrono::steady_clock::now();
+        CHECK(que->pop_front(items, 1, 1, 20, &is_timeout) == -1 && is_timeout);
+        CHECK(elapsed_us(start) >= 19000);
+        CHECK(que->try_pop(items) == 0);
+        is_timeout = false;
+        CHECK(que->pop_for(items, 1, 1, std::chrono::milliseconds(10), &is_timeout) == -1 && is_timeout);
+        que->push(7);
+        CHECK(que->pop_until(items, 1, 1, std::chrono::steady_clock::now() + std::chrono::seconds(1)) == 0);
+        CHECK(items.size() == 1 && items[0] == 7);
+
+        std::thread stopper([&que] {
+            sleep_ms(10);
+            que->stop();
+        });
+        is_timeout = false;
+        start = std::chrono::steady_clock::now();
+        que->pop_front(items, 1, 1, 5000, &is_timeout);
+        stopper.join();
+        CHECK(!is_timeout && elapsed_us(start) < 4000000);
+    }
+    return 0;
+}
+
+// drop policies shed without blocking the producer and pass what they drop to the drop callback
+static int test_drop_policy() {
+    std::vector<int> items;
+    BlockingQueue<int> oldest("oldest", 0, 4);
+    oldest.set_drop_policy(std::make_shared<DropOldestPolicy<int>>());
+    for (int i = 0; i < 10; i++) oldest.push(i);
+    oldest.try_pop(items, 10);
+    CHECK(items == std::vector<int>({6, 7, 8, 9}));
+
+    BlockingQueue<int> newest("newest", 1, 4);
+    newest.set_drop_policy(std::make_shared<DropNewestPolicy<int>>());
+    for (int i = 0; i < 10; i++) newest.push(i);
+    items.clear();
+    newest.try_pop(items, 10);
+    CHECK(items == std::vector<int>({0, 1, 2, 3}));
+
+    BlockingQueue<int> cond("drop_if", 1, 4);
+    cond.set_drop_policy(std::make_shared<DropIfPolicy<int>>([](const int &v) { return v % 2 == 0; }));
+    for (int i = 0; i < 1000; i++) cond.push(i);
+    items.clear();
+    cond.try_pop(items, 1000);
+    CHECK(items.size() <= 4 && !items.empty());
+    for (int v : items) CHECK(v % 2 == 1 || v >= 996);
+
+    // three streams, at most two queued frames each, whatever the queue limit
+    BlockingQueue<int> latest("latest", 0, 100);
+    int dropped = 0;
+    latest.set_drop_fn([&dropped](int &) { dropped++; });
+    latest.set_drop_policy(std::make_shared<KeepLatestPerKeyPolicy<int>>([](const int &v) { return v % 3; }, 2));
+    for (int i = 0; i < 30; i++) latest.push(i);
+    items.clear();
+    latest.try_pop(items, 100);
+    CHECK(items == std::vector<int>({24, 25, 26, 27, 28, 29}) && dropped == 24);
+
+    // a full queue still drops its oldest element
+    BlockingQueue<int> full("latest_full", 1, 4);
+    full.set_drop_policy(std::make_shared<KeepLatestPerKeyPolicy<int>>([](const int &v) { return v % 3; }, 2));
+    for (int i = 0; i < 30; i++) full.push(i);
+    items.clear();
+    full.try_pop(items, 100);
+    CHECK(items == std::vector<int>({26, 27, 28, 29}));
+    return 0;
+}
+
+// Deficit round-robin: a busy stream can't starve a quiet one and weights set the shares, also
+// for a key whose FIFO was freed while idle. A stopped queue drops a refused batch instead of
+// leaving it to the caller.
+static int test_fair_queue() {
+    FairQueue<int> que("fair", [](const int &v) { return v / 1000; });
+    for (int i = 0; i < 40; i++) que.push(i);
+    for (int i = 0; i < 5; i++) que.push(1000 + i);
+    std::vector<int> items;
+    que.pop_front(items, 10, 10);
+    CHECK(std::count_if(items.begin(), items.end(), [](int v) { return v >= 1000; }) == 5);
+    items.clear();
+    CHECK(que.try_pop(items, 100) == 35);
+
+    que.set_weight(1, 3);
+    sleep_ms(FAIR_QUEUE_IDLE_US / 1000 + 100);
+    // the next pop that empties a FIFO frees the idle ones
+    que.push(1);
+    items.clear();
+    CHECK(que.try_pop(items, 10) == 1);
+    for (int i = 0; i < 40; i++) que.push(i);
+    for (int i = 0; i < 40; i++) que.push(1000 + i);
+    items.clear();
+    que.pop_front(items, 8, 8);
+    CHECK(std::count_if(items.begin(), items.end(), [](int v) { return v >= 1000; }) == 6);
+
+    FairQueue<std::unique_ptr<int>> stopped("fair_stop", [](const std::unique_ptr<int> &v) { return *v; });
+    stopped.stop();
+    std::vector<std::unique_ptr<int>> batch;
+    batch.emplace_back(new int(0));
+    batch.emplace_back(new int(1));
+    CHECK(stopped.push(batch) == -1);
+    for (auto &v : batch) CHECK(v == nullptr);
+    return 0;
+}
+
+// queue counters of every queue type, drops of a stopped queue included, and per-worker counters
+static int test_metrics() {
+    for (int type = 0; type <= BLOCKING_QUEUE_SPSC; type++) {
+        auto que = create_work_queue<int>("metrics", type, 4);
+        for (int i = 0; i < 4; i++) que->push(i);
+        que->stop();
+        std::vector<int> more = {4, 5, 6};
+        CHECK(que->push(more) == -1);
+        QueueStats st = que->stats();
+        CHECK(st.push_num == 7 && st.drop_num >= 2 && st.high_water >= 4 && st.depth == que->size());
+        std::vector<int> items;
+        que->pop_front(items, 1, 2);
+        st = que->stats();
+        CHECK(st.pop_num == 2 && st.depth == que->size());
+    }
+
+    BlockingQueue<int> lat("latency", 0, 16);
+    lat.set_latency_metrics(true);
+    lat.push(0);
+    sleep_ms(2);
+    std::vector<int> items;
+    lat.try_pop(items);
+    QueueStats st = lat.stats();
+    CHECK(st.time_in_queue.count == 1 && st.time_in_queue.max_us >= 1000);
+
+    BlockingQueue<int> que("pool_metrics", 0, 64);
+    std::atomic<int> done(0);
+    WorkerPool<int> pool;
+    pool.init(&que, 2, 1, 4);
+    pool.startWork([&done](std::vector<int> &items) { done += items.size(); });
+    for (int i = 0; i < 100; i++) que.push(i);
+    while (done < 100) sleep_ms(1);
+    pool.stopWork();
+    uint64_t batch_num = 0, item_num = 0;
+    for (auto &ws : pool.workerStats()) {
+        batch_num += ws.batch_num;
+        item_num += ws.item_num;
+    }
+    CHECK(item_num == 100 && batch_num >= 25 && batch_num <= 100);
+    return 0;
+}
+
+// an autoscaling pool grows under a backlog, shrinks back once idle, grows again and loses nothing
+static int test_autoscale() {
+    BlockingQueue<int> que("scale", 0, 0);
+    std::atomic<int> done(0);
+    WorkerPool<int> pool;
+    pool.init(&que, 1, 1, 1);
+    CHECK(pool.setAutoScale(1, 4, 10) == 0);
+    CHECK(pool.startWork([&done](std::vector<int> &items) {
+        sleep_ms(2);
+        done += items.size();
+    }) == 0);
+    for (int round = 1; round <= 2; round++) {
+        int max_threads = 1;
+        for (int i = 0; i < 300; i++) que.push(i);
+        while (done < 300 * round) {
+            max_threads = std::max(max_threads, pool.threadNum());
+            sleep_ms(5);
+        }
+        CHECK(max_threads > 1 && max_threads <= 4);
+        for (int i = 0; i < 300 && pool.threadNum() > 1; i++) sleep_ms(10);
+        CHECK(pool.threadNum() == 1);
+    }
+    pool.stopWork();
+    CHECK(done == 600);
+    return 0;
+}
+
+// CPU lists parse, and a pool placed on CPU 0 runs its workers there
+static int test_placement() {
+    std::vector<int> cpus;
+    CHECK(bm::parse_cpu_list("0-3,8,10-11", cpus) == 0);
+    CHECK(cpus == std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+    CHECK(bm::parse_cpu_list("1,x", cpus) == -1);
+
+    bm::CpuPlacement placement;
+    placement.policy = bm::CPU_PLACE_CPU_LIST;
+    placement.cpus = {0};
+    cpu_set_t cpuset;
+    CHECK(bm::placement_cpuset(placement, 5, &cpuset) == 0 && CPU_COUNT(&cpuset) == 1 && CPU_ISSET(0, &cpuset));
+
+    BlockingQueue<int> que("pinned", 0, 16);
+    std::atomic<int> done(0), on_cpu0(0);
+    WorkerPool<int> pool;
+    pool.init(&que, 2, 1, 1);
+    CHECK(pool.setPlacement(placement) == 0);
+    CHECK(pool.startWork([&](std::vector<int> &items) {
+        if (sched_getcpu() == 0) on_cpu0 += items.size();
+        done += items.size();
+    }) == 0);
+    for (int i = 0; i < 20; i++) que.push(i);
+    while (done < 20) sleep_ms(1);
+    pool.stopWork();
+    CHECK(on_cpu0 == 20);
+    return 0;
+}
+
+// spinning waits hand every element over in order and still honour timeouts
+static int test_wait_profile() {
+    for (int type = 0; type <= BLOCKING_QUEUE_SPSC; type++) {
+        const int num = 20000;
+        auto que = create_work_queue<int>("spin", type, 16);
+        que->set_wait_profile(WAIT_PROFILE_LOW_LATENCY);
+        std::thread producer([&que] {
+            for (int i = 0; i < num; i++) que->push(i);
+        });
+        int next = 0;
+        bool in_order = true;
+        std::vector<int> items;
+        while (next < num) {
+            items.clear();
+            que->pop_front(items, 1, 8);
+            for (int v : items) in_order &= v == next++;
+        }
+        producer.join();
+        CHECK(in_order);
+        bool is_timeout = false;
+        CHECK(que->pop_front(items, 1, 1, 5, &is_timeout) == -1 && is_timeout);
+    }
+    return 0;
+}
+
+// objects made on one thread and released on another are recycled, the pool stops growing
+static int test_object_pool() {
+    using Pool = ObjectPool<std::vector<int>>;
+    const int num = 10000;
+    Pool pool(8);
+    BlockingQueue<Pool::Ptr> que("objects", 0, 16);
+    bool intact = true;
+    std::thread consumer([&que, &intact] {
+        std::vector<Pool::Ptr> items;
+        int next = 0;
+        while (next < num) {
+            items.clear();
+            que.pop_front(items, 1, 8);
+            for (auto &p : items) intact &= p->size() == 4 && (*p)[3] == next++;
+        }
+    });
+    for (int i = 0; i < num; i++) {
+        Pool::Ptr p = pool.make();
+        p->assign(4, i);
+        que.push(p);
+    }
+    consumer.join();
+    CHECK(intact);
+    // queue, items in the consumer's hands and both thread caches
+    CHECK(pool.created() <= 64);
+    return 0;
+}
+
+int main() {
+    int ret = 0;
+    ret |= test_ring_pool(0);
+    ret |= test_ring_pool(4);
+    ret |= test_stop_drops();
+    ret |= test_spsc_order();
+    ret |= test_move_only();
+    ret |= test_steal_stop();
+    ret |= test_batch_deadline();
+    ret |= test_timed_waits();
+    ret |= test_drop_policy();
+    ret |= test_fair_queue();
+    ret |= test_metrics();
+    ret |= test_autoscale();
+    ret |= test_placement();
+    ret |= test_wait_profile();
+    ret |= test_object_pool();
+    std::cout << (ret == 0 ? "test_queue passed" : "test_queue FAILED") << std::endl;
+    return ret;
+}